@@ -16,6 +16,8 @@
 # along with ScalityRestBlock.  If not, see <http://www.gnu.org/licenses/>.
 
 import argparse
+import ctypes
+import ctypes.util
 import errno
 import logging
 import os
@@ -32,6 +34,16 @@ LOGGER = logging.getLogger(__name__)
 if chaussette:
     chaussette.util.configure_logger(LOGGER, level='DEBUG')
 
+# fallocate(2) is not exposed by the os module
+LIBC = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+LIBC.fallocate.argtypes = [ctypes.c_int, ctypes.c_int,
+                           ctypes.c_int64, ctypes.c_int64]
+FALLOC_FL_KEEP_SIZE = 0x01
+FALLOC_FL_PUNCH_HOLE = 0x02
+FALLOC_FL_ZERO_RANGE = 0x10
+# Largest chunk written at once when replicating a block over a range
+FILL_CHUNK_SIZE = 1024 * 1024
+
 def ensure_exists(func):
     """
         This is a decorator that raises
@@ -115,6 +127,19 @@ class Volume(object):
                     'Internal Server Error', str(ex))
         return data
 
+    def is_hole(self, offset, size):
+        """ Whether the range is a hole of the Volume, reading as zeroes """
+        seek_data = getattr(os, 'SEEK_DATA', None)
+        if seek_data is None or size <= 0:
+            return False
+        try:
+            with open(self._path, 'rb') as openfile:
+                return os.lseek(openfile.fileno(), offset,
+                                seek_data) >= offset + size
+        except OSError as ex:
+            # No data past offset
+            return ex.errno == errno.ENXIO
+
     @ensure_exists
     def write(self, offset, data):
         """ Write facility for the Volume """
@@ -150,6 +175,89 @@ class Volume(object):
                 'Internal Server Error',
                 "Could not truncate: %s" % (str(ex)))
 
+    @ensure_exists
+    def punch(self, offset, size):
+        """ Deallocation facility for the Volume: the range reads as zeroes """
+        try:
+            with open(self._path, 'r+b') as openfile:
+                ret = LIBC.fallocate(openfile.fileno(),
+                                     FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                     offset, size)
+                if ret != 0:
+                    err = ctypes.get_errno()
+                    raise OSError(err, os.strerror(err))
+        except OSError as ex:
+            if ex.errno == errno.ENOENT:
+                raise falcon.HTTPInternalServerError(
+                    'Internal Server Error',
+                    "File not found when expected to find it.")
+            raise falcon.HTTPInternalServerError(
+                'Internal Server Error',
+                "Could not punch hole: %s" % (str(ex)))
+
+    @ensure_exists
+    def fill(self, offset, size, block):
+        """ Write same facility for the Volume: repeats block over the range """
+        if len(block) == 0 or size % len(block) != 0:
+            raise falcon.HTTPBadRequest(
+                'Bad request',
+                "Range is not a multiple of the %i bytes payload" % len(block))
+        chunk = block * max(1, FILL_CHUNK_SIZE // len(block))
+        try:
+            with open(self._path, 'r+b') as openfile:
+                openfile.seek(offset)
+                while size > 0:
+                    openfile.write(chunk[:size])
+                    size -= min(size, len(chunk))
+        except OSError as ex:
+            if ex.errno == errno.ENOENT:
+                raise falcon.HTTPInternalServerError(
+                    'Internal Server Error',
+                    "File not found when expected to find it.")
+            raise falcon.HTTPInternalServerError(
+                'Internal Server Error',
+                "Could not fill: %s" % (str(ex)))
+
+    @ensure_exists
+    def zero(self, offset, size):
+        """ Zeroing facility for the Volume: the range stays allocated """
+        try:
+            with open(self._path, 'r+b') as openfile:
+                ret = LIBC.fallocate(openfile.fileno(),
+                                     FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                                     offset, size)
+                if ret != 0:
+                    err = ctypes.get_errno()
+                    if err != errno.EOPNOTSUPP:
+                        raise OSError(err, os.strerror(err))
+                    ret = None
+        except OSError as ex:
+            if ex.errno == errno.ENOENT:
+                raise falcon.HTTPInternalServerError(
+                    'Internal Server Error',
+                    "File not found when expected to find it.")
+            raise falcon.HTTPInternalServerError(
+                'Internal Server Error',
+                "Could not zero range: %s" % (str(ex)))
+        # Filesystem without zero range support: write the zeroes
+        if ret is None:
+            self.fill(offset, size, b'\0')
+
+    @ensure_exists
+    def sync(self):
+        """ Sync facility for the Volume: makes written data durable """
+        try:
+            with open(self._path, 'r+b') as openfile:
+                os.fsync(openfile.fileno())
+        except OSError as ex:
+            if ex.errno == errno.ENOENT:
+                raise falcon.HTTPInternalServerError(
+                    'Internal Server Error',
+                    "File not found when expected to find it.")
+            raise falcon.HTTPInternalServerError(
+                'Internal Server Error',
+                "Could not sync: %s" % (str(ex)))
+
     def create(self):
         """ Create facility for the Volume """
         if self.exists():
@@ -230,6 +338,9 @@ class VolumeHandler(object):
         response.status = falcon.HTTP_200
         response.content_type = "application/binary"
         response.body = volume.read(offset, size)
+        # Lets the driver serve the range with zeroes until written
+        if volume.is_hole(offset, size):
+            response.set_header("X-Scal-Hole", "1")
 
     def _create_file(self, response, volume):
         volume.create()
@@ -243,6 +354,22 @@ class VolumeHandler(object):
         volume.write(offset, data)
         response.status = falcon.HTTP_204
 
+    def _punch_file(self, response, volume, offset, size):
+        volume.punch(offset, size)
+        response.status = falcon.HTTP_204
+
+    def _zero_file(self, response, volume, offset, size):
+        volume.zero(offset, size)
+        response.status = falcon.HTTP_204
+
+    def _fill_file(self, response, volume, offset, size, block):
+        volume.fill(offset, size, block)
+        response.status = falcon.HTTP_204
+
+    def _sync_file(self, response, volume):
+        volume.sync()
+        response.status = falcon.HTTP_204
+
     def on_get(self, request, response, volname):
         """ VolumeHandler's GET handler """
         self._logger.debug("[VolumeHandler] GET %s" % (volname))
@@ -262,6 +389,10 @@ class VolumeHandler(object):
         # If-None-Match: <- Exclusive put (CREATE)
         # X-Scal-Truncate: <- Truncate size
         # Range: bytes=N-M   <- Range
+        # X-Scal-Punch-Hole: <- Deallocate Range (no payload)
+        # X-Scal-Zero-Range: <- Zero Range, keeping it allocated (no payload)
+        # X-Scal-Write-Same: <- Repeat the payload over Range
+        # X-Scal-Sync:     <- Sync once written (flush or FUA write)
         volume = self._get_volume(volname)
         if request.get_param('metadata'):
             raise falcon.HTTPInternalServerError(
@@ -286,6 +417,28 @@ class VolumeHandler(object):
                     'Could not translate Trunc size to integer.')
             self._truncate_file(response, volume, truncsz)
 
+        elif request.get_header("X-Scal-Punch-Hole") is not None:
+            if datarange is None:
+                raise falcon.HTTPBadRequest(
+                    'Bad request',
+                    'Cannot punch a hole without range')
+            self._punch_file(response, volume, offset, size)
+
+        elif request.get_header("X-Scal-Zero-Range") is not None:
+            if datarange is None:
+                raise falcon.HTTPBadRequest(
+                    'Bad request',
+                    'Cannot zero without range')
+            self._zero_file(response, volume, offset, size)
+
+        elif request.get_header("X-Scal-Write-Same") is not None:
+            if datarange is None or request.content_length is None:
+                raise falcon.HTTPBadRequest(
+                    'Bad request',
+                    'Cannot write same without range and length')
+            block = request.stream.read(request.content_length)
+            self._fill_file(response, volume, offset, size, block)
+
         elif request.if_none_match is None:
             if request.content_length is None:
                 raise falcon.HTTPLengthRequired(
@@ -294,6 +447,10 @@ class VolumeHandler(object):
             data = request.stream.read(request.content_length)
             self._write_file(response, volume, offset, data)
 
+        # Finally, make the data acknowledged so far durable
+        if request.get_header("X-Scal-Sync") is not None:
+            self._sync_file(response, volume)
+
     def on_delete(self, request, response, volname):
         """ VolumeHandler's DELETE handler """
         volume = self._get_volume(volname)
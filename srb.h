@@ -28,7 +28,15 @@
 #include <linux/net.h>
 #include <linux/scatterlist.h>
 #include <net/sock.h>
-#include <linux/genhd.h>
+#include <linux/workqueue.h>
+#include <linux/mempool.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/completion.h>
+
+#include "srb_compat.h"
 
 /* Constants */
 #define kB			1024
@@ -42,7 +50,26 @@
 #define DEV_DEFAULT_DISKSIZE	(50 * MB)
 #define DEV_MAX			64
 #define DEV_SECTORSIZE		1 * MB
-#define DEV_NB_PHYS_SEGS	512
+#define DEV_MQ_QUEUE_DEPTH	64	/* Tags per blk-mq hardware queue */
+#define DEV_MAX_PATHS		8	/* Servers a device spreads its I/O over */
+#define DEV_DISCARD_MAX_SECTORS	(1U << 21)	/* 1GB, no payload involved */
+#define DEV_ZEROES_MAX_SECTORS	(1U << 21)	/* Same for zeroing/write same */
+#define SRB_REQUEUE_DELAY_MS	10	/* Legacy queue restart when out of commands */
+#define SRB_HEDGE_BUCKETS	32	/* Read latency histogram, log2(us) */
+#define SRB_HEDGE_SAMPLES	256	/* Reads between threshold updates */
+#define SRB_HEDGE_WINDOW	1024	/* Reads the hedge budget applies to */
+#define SRB_RA_MIN_SEQ		2	/* Sequential reads making a stream */
+#define SRB_CACHE_MAX_IO	(64 * kB)	/* Larger reads bypass the cache */
+#define SRB_CACHE_MAX_PAGES	(SRB_CACHE_MAX_IO / PAGE_SIZE + 1)	/* Unaligned */
+#define SRB_WBLOG_SLOT		512	/* Write-back log record header */
+#define SRB_WBLOG_START		4096	/* Records follow its superblock */
+#define SRB_WBLOG_BATCH		(16 * MB)	/* Records destaged at once */
+#define SRB_WBLOG_DESTAGE_MS	1000	/* Background destaging period */
+#define SRB_WBLOG_HIGH_PCT	50	/* Log usage destaging right away */
+#define SRB_WBACK_MAX_DIRTY_DFLT	(64 * MB)	/* Volatile write-back */
+#define SRB_WBACK_EXPIRE_DFLT	5000	/* ms a write may stay in memory */
+#define SRB_WBACK_PERIOD_MS	500	/* Background flusher period */
+#define SRB_ZMAP_MAX_EXTENTS	4096	/* Known-zero extents of a device */
 
 /* Device state (reduce spinlock section and avoid multiple operation on same device) */
 #define DEV_IN_USE		1
@@ -51,10 +78,7 @@
 /* Dewpoint server related constants */
 #define SRB_HTTP_HEADER_SIZE	1024
 #define SRB_URL_SIZE		256
-#define SRB_REUSE_LIMIT	100 /* Max number of requests sent to
-				     * a single HTTP connection before
-				     * restarting a new one.
-				     */
+#define SRB_HTTP_TMPL_SIZE	(SRB_URL_SIZE + 256)
 
 /*
  * Linux Kernel Module (LKM) parameters
@@ -64,6 +88,12 @@ extern unsigned short req_timeout;
 extern unsigned short nb_req_retries;
 extern unsigned short server_conn_timeout;
 extern unsigned int thread_pool_size;
+extern unsigned int pipeline_depth;
+extern unsigned int max_io_size;
+extern unsigned short zero_copy;
+extern unsigned short tcp_fastopen;
+extern unsigned int split_size;
+extern unsigned int split_fanout;
 
 /*
  * Default values for ScalityRestBlock LKM parameters
@@ -73,6 +103,19 @@ extern unsigned int thread_pool_size;
 #define SRB_CONN_TIMEOUT_DFLT		30
 #define SRB_LOG_LEVEL_DFLT		SRB_INFO
 #define SRB_THREAD_POOL_SIZE_DFLT	8
+#define SRB_PIPELINE_DEPTH_DFLT	1	/* No pipelining */
+#define SRB_PIPELINE_DEPTH_MAX		32
+#define SRB_MAX_IO_SIZE_DFLT		(4 * MB)	/* Largest request */
+#define SRB_MAX_IO_SIZE_MAX		(32 * MB)
+#define SRB_ZERO_COPY_DFLT		1	/* Send written pages as they are */
+#define SRB_TCP_FASTOPEN_DFLT		0
+#define SRB_SPLIT_SIZE_DFLT		(1 * MB)	/* Smallest piece of a request */
+#define SRB_SPLIT_FANOUT_DFLT		4	/* Max pieces of a request */
+#define SRB_SPLIT_FANOUT_MAX		64
+#define SRB_HEDGE_BUDGET_DFLT		5	/* % of the reads */
+#define SRB_RA_WINDOW_DFLT		(1 * MB)	/* Read ahead of a stream */
+#define SRB_RA_STREAMS_DFLT		4
+#define SRB_RA_STREAMS_MAX		64
 
 #define SRB_DEBUG_LEVEL	0   /* We do not want to be polluted
 			     * by default */
@@ -143,6 +186,43 @@ enum srb_http_statuscode
 	SRB_HTTP_STATUS_EXTENSION		= 0	//	; extension-code
 };
 
+/* srb_http.c */
+enum srb_http_parse_state
+{
+	SRB_HTTP_PARSE_STATUS = 0,	// Waiting for the status line
+	SRB_HTTP_PARSE_HEADERS,		// Waiting for the end of the header
+	SRB_HTTP_PARSE_BODY,		// Header parsed, receiving the body
+};
+
+struct srb_http_parser_s {
+	enum srb_http_parse_state	state;
+	int				scanned;	/* Bytes already parsed */
+	int				line_start;	/* Offset of current line */
+	int				hdr_size;	/* CRLFCRLF included */
+	enum srb_http_statuscode	code;
+	uint64_t			content_length;
+	int				ka_timeout;	/* Keep-Alive timeout (s), or -1 */
+	int				ka_max;		/* Requests still allowed, or -1 */
+	int				ka_close;	/* Connection: close */
+	int				hole;		/* X-Scal-Hole: range reads as
+							 * zeroes */
+};
+
+/* Log context of a device or connection pool */
+typedef struct srb_debug_s {
+	const char		*name;
+	int			level;
+} srb_debug_t;
+
+/*
+ * Invariant part of the requests on a volume, from the space following the
+ * method to the end of the Host header (see srb_http_mktemplate).
+ */
+struct srb_http_tmpl_s {
+	char			buff[SRB_HTTP_TMPL_SIZE];
+	int			len;
+};
+
 /* srb_cdmi.c */
 struct srb_cdmi_desc_s {
 	/* For /sys/block/srb?/srb_url */
@@ -151,23 +231,257 @@ struct srb_cdmi_desc_s {
 	char			ip_addr[16];
 	uint16_t		port;
 	char			filename[SRB_URL_SIZE + 1];
-	char			xmit_buff[SRB_XMIT_BUFFER_SIZE];
+	char			*xmit_buff;	/* See srb_cdmi_desc_alloc */
+	int			xmit_size;
 	uint64_t		nb_requests; /* Number of HTTP
 					      * requests already sent
 					      * through this socket */
-	struct scatterlist	sgl[DEV_NB_PHYS_SEGS];
-	int			sgl_size;
+	uint8_t			fastopen;	/* Connect with TCP Fast Open */
+	struct srb_http_parser_s parser;	/* Last response received */
 	struct socket		*socket;
-	struct sockaddr_in	sockaddr;
-	struct timeval		timeout;
+	unsigned int		timeout;	/* send/recv timeout (s) */
+
+	/*
+	 * Asynchronous engine state (srb_engine.c), only used by the
+	 * connections of the server pools.
+	 */
+	struct srb_conn_pool_s	*pool;
+	struct srb_debug_s	*dbg;
+	spinlock_t		lock;		/* Protects the lists below */
+	struct list_head	send_queue;	/* Commands not fully sent yet */
+	struct list_head	inflight;	/* Sent, oldest response first */
+	int			nb_queued;	/* Commands in both lists */
+	int			nb_inflight;
+	int			error;		/* Pending connection error */
+	int			retire;		/* Idle for too long, to close */
+	int			stopping;
+	int			rcvd;		/* Bytes in the receive area */
+	unsigned long		deadline;	/* Next progress due (jiffies) */
+	unsigned long		idle_since;	/* Last response (jiffies) */
+	uint64_t		nb_answered;	/* Responses on this socket */
+	uint64_t		max_requests;	/* Allowed by the server on it */
+	struct kvec		*iov;		/* Vectors of one socket call */
+	int			nr_iov;
+	struct work_struct	work;
+	struct delayed_work	watchdog;
+	void			(*saved_data_ready)(SRB_DATA_READY_ARGS);
+	void			(*saved_write_space)(struct sock *sk);
+	void			(*saved_state_change)(struct sock *sk);
 };
 
-/* srb device definition */
-typedef struct srb_debug_s {
-	const char		*name;
-	int			level;
-} srb_debug_t;
+/*
+ * Connections to a server, shared by all the devices it serves. They are
+ * created on demand, up to thread_pool_size, and their sockets are renewed
+ * in the background following the server's keep-alive terms (srb_engine.c).
+ */
+struct srb_conn_pool_s {
+	struct list_head	list;		/* Module-wide pools */
+	int			refs;		/* Devices using the pool */
+	char			ip_addr[16];
+	uint16_t		port;
+	char			name[24];	/* ip:port, for the logs */
+	struct srb_debug_s	debug;
+	spinlock_t		lock;		/* Protects nb_conns and spare */
+	struct srb_cdmi_desc_s	**conns;	/* thread_pool_size slots */
+	int			nb_conns;
+	int			max_segs;	/* Largest command's segments */
+	int			growing;	/* Connection being created */
+	int			stopping;
+	struct work_struct	grow;
+	atomic_t		nb_queued;	/* Commands of all its connections */
+	unsigned long		latency;	/* Moving average (us) */
+	int			failures;	/* Consecutive ones */
+	int			down;		/* Circuit breaker open */
+	unsigned long		probe_at;	/* Next health probe (jiffies) */
+	struct socket		*spare;		/* Connected, ready for use */
+	unsigned long		spare_since;	/* jiffies */
+	unsigned long		ka_timeout;	/* Server's idle timeout (jiffies),
+						 * 0 until it is known */
+	struct delayed_work	keepalive;
+};
+
+/* srb_driver.c */
+struct srb_device_s;
+
+/* One per blk-mq hardware context, or a single one on legacy kernels */
+struct srb_queue_s {
+	struct srb_device_s	*dev;
+	int			id;
+	spinlock_t		plug_lock;
+	struct list_head	plugged;	/* Reads and writes to coalesce,
+						 * by offset (see srb_unplug) */
+};
+
+enum srb_cmd_op {
+	SRB_CMD_READ = 0,	/* GET range */
+	SRB_CMD_WRITE,		/* PUT range */
+	SRB_CMD_SYNC,		/* Make acknowledged writes durable */
+	SRB_CMD_DISCARD,	/* Deallocate range, no payload */
+	SRB_CMD_ZERO,		/* Zero range, no payload */
+	SRB_CMD_WRITE_SAME,	/* Repeat a one block payload over the range */
+};
+
+/* What a command of the engine stands for */
+enum srb_cmd_kind {
+	SRB_CMD_REQUEST = 0,	/* A block request (its PDU) */
+	SRB_CMD_LEG,		/* A leg of a hedged read */
+	SRB_CMD_PIECE,		/* A piece of a striped request */
+	SRB_CMD_BATCH,		/* Coalesced requests */
+	SRB_CMD_PREFETCH,	/* Readahead of a sequential stream */
+	SRB_CMD_WAITED,		/* Driver's own I/O, waited for */
+};
 
+struct srb_ra_chunk_s;
+struct srb_ra_stream_s;
+struct srb_wblog_s;
+
+/*
+ * Per-request driver data (blk-mq PDU, or allocated from a mempool on
+ * legacy kernels), along with its progress on the connection.
+ */
+struct srb_cmd_s {
+	int			error;
+	struct list_head	list;		/* Connection's send_queue or inflight,
+						 * device's flushes, queue's plugged
+						 * or batch's members */
+	enum srb_cmd_kind	kind;
+	struct request		*req;		/* Only for SRB_CMD_REQUEST */
+	struct srb_device_s	*dev;
+	enum srb_cmd_op		op;
+	int			fua;		/* Durable write */
+	uint64_t		offset;
+	int			size;
+	unsigned long		epoch;		/* Flush epoch (see srb_flush) */
+	int			wait_writes;	/* Flush: earlier writes in flight */
+	int			attempts;	/* Failed transmissions, all servers */
+	int			hdr_len;	/* 0 until the header is built */
+	int			sent;		/* Header and payload bytes sent */
+	int			body_rcvd;	/* -1 until the header is received */
+	ktime_t			start;		/* Submission to the server */
+	int			path;		/* Device's path it went through */
+	int			sync_leg;	/* Flush: path being synced */
+	const struct srb_http_tmpl_s *tmpl;	/* Of the volume on the server */
+
+	/*
+	 * Hedged reads (see srb_hedge_arm): the request's command sends one
+	 * leg, and a second one if the first is late. Both legs share its
+	 * pages, which the first leg to get its response header fills.
+	 */
+	struct srb_cmd_s	*parent;	/* Leg: NULL once its request ended,
+						 * piece: its request */
+	struct srb_cmd_s	*legs[2];	/* Request: primary, then hedge */
+	struct srb_cmd_s	*owner;		/* Request: leg filling its pages */
+	int			nb_legs;	/* Request: legs still racing */
+	int			cancelled;	/* Leg: lost, not to be sent */
+	int			discard;	/* Leg: drains its response body */
+	ktime_t			submitted;	/* Request: for its latency */
+	struct timer_list	hedge_timer;
+
+	/*
+	 * Striped requests (see srb_split_submit): the pieces of a large
+	 * request go their own way, and the request completes with the last.
+	 */
+	atomic_t		nb_pieces;	/* Request: pieces not completed */
+	int			split_error;	/* Request: of its failed pieces */
+
+	/* Coalesced requests (see srb_unplug), completed along with a batch */
+	struct list_head	members;	/* Batch: its requests' commands */
+
+	/* Readahead (see srb_ra_read) */
+	struct srb_ra_chunk_s	*chunk;		/* Prefetch: the chunk it fills */
+	int			local;		/* Request: served from a chunk
+						 * or the cache */
+
+	/* Block cache (see srb_cache_fill) */
+	unsigned long		cache_wseq;	/* Read: writes completed before
+						 * it, 0: not to be cached */
+
+	/* Known-zero extents (see srb_zeromap.c) */
+	unsigned long		zmap_wseq;	/* Read, discard or zeroing: writes
+						 * seen when submitted */
+
+	struct completion	*done;		/* Waited (see srb_send_wait) */
+
+	int			sgl_size;
+	struct scatterlist	*sgl;		/* max_segs entries of the device,
+						 * stored after the command */
+};
+
+/*
+ * A server holding the volume of a device, along with the invariant part of
+ * the requests on the volume through it.
+ */
+struct srb_path_s {
+	struct srb_conn_pool_s	*pool;
+	struct srb_http_tmpl_s	http_tmpl;
+};
+
+/*
+ * RAM cache of the blocks of a device (srb_cache.c), whose admission
+ * follows 2Q: blocks read once go through a1in and are forgotten, unless
+ * they are read again after leaving it while their ghost is in a1out, in
+ * which case they go to the am LRU.
+ */
+struct srb_cache_s {
+	spinlock_t		lock;
+	struct list_head	list;		/* Module-wide caches, see the
+						 * shrinker */
+	struct rb_root		blocks;		/* Resident ones and ghosts */
+	struct list_head	a1in;		/* Read once, FIFO */
+	struct list_head	a1out;		/* Ghosts of those evicted from
+						 * a1in, FIFO */
+	struct list_head	am;		/* Read again, LRU */
+	unsigned long		nr_a1in;
+	unsigned long		nr_a1out;
+	unsigned long		nr_am;
+	unsigned long		max_pages;	/* 0: no cache */
+	unsigned long		wseq;		/* Completed writes, never 0 */
+	unsigned long		hits;
+	unsigned long		misses;
+};
+
+/*
+ * Volatile write-back of a device (srb_writeback.c): the ranges written
+ * and not flushed yet, with their data, merged into extents by offset.
+ */
+struct srb_wback_s {
+	struct srb_device_s	*dev;
+	spinlock_t		lock;		/* Changes to what follows */
+	struct rb_root		extents;
+	uint64_t		dirty;		/* Bytes of the extents */
+	struct list_head	pending;	/* Requests for the worker */
+	int			enabled;	/* Writes are absorbed */
+	int			stopping;
+
+	struct mutex		map_mutex;	/* Extents' data, changes */
+	unsigned long		gen;		/* Of the latest write absorbed */
+	int			readers;	/* Reads waiting for a server */
+
+	struct mutex		flush_mutex;
+	struct scatterlist	*sgl;		/* Flusher's, max_segs + 1 */
+	struct workqueue_struct	*wq;		/* NULL until first enabled */
+	struct work_struct	work;		/* Worker, absorbing writes */
+	struct delayed_work	flush_work;	/* Background flusher */
+
+	uint64_t		max_dirty;	/* Writes wait beyond it */
+	unsigned int		expire_ms;
+};
+
+/*
+ * Extents of a device known to read as zeroes (srb_zeromap.c), sorted by
+ * offset and merged.
+ */
+struct srb_zmap_s {
+	spinlock_t		lock;
+	struct rb_root		extents;
+	unsigned long		nr_extents;
+	uint64_t		bytes;		/* Covered by the extents */
+	unsigned long		wseq;		/* Writes submitted or completed */
+	int			inflight;	/* Writes not completed */
+	unsigned long		hits;		/* Reads served with zeroes */
+};
+
+/* srb device definition */
 typedef struct srb_device_s {
 	/* Device subsystem related data */
 	int			id;		/* device ID */
@@ -182,21 +496,76 @@ typedef struct srb_device_s {
 	int			state; 		/* for create extend attach detach destroy purpose */
 
 	struct request_queue	*q;
+#ifdef SRB_BLK_MQ
+	struct blk_mq_tag_set	tag_set;
+#else
 	spinlock_t		rq_lock;	/* request queue lock */
+	mempool_t		*cmd_pool;	/* Commands of the request_fn */
+#endif
 
-	struct task_struct	**thread;	/* allow dynamic allocation during device creation */
-	int			nb_threads;
+	/* Request size limits, set at attach time */
+	unsigned int		max_io_size;	/* In bytes */
+	unsigned short		max_segs;	/* Entries of each command's sgl */
 
 	/* Dewpoint specific data */
-	struct srb_cdmi_desc_s	 **thread_cdmi_desc;	/* allow dynamic allocation during device creation*/
+	char			url[SRB_URL_SIZE + 1];	/* Volume's */
+	char			filename[SRB_URL_SIZE + 1];
+	struct srb_path_s	paths[DEV_MAX_PATHS];	/* See srb_pick_path */
+	int			nb_paths;
+
+	/* Submission contexts */
+	struct srb_queue_s	*queues;
+	int			nb_queues;
 
 	/*
-	** List of requests received by the drivers, but still to be
-	** processed. This due to network latency.
+	** Flushes wait for the writes submitted before them to complete:
+	** each flush closes an epoch of writes.
 	*/
-	spinlock_t		waiting_lock;	/* wait_queue lock */
-	wait_queue_head_t	waiting_wq;
-	struct list_head	waiting_queue;  /* Requests to be sent */
+	spinlock_t		flush_lock;
+	unsigned long		flush_epoch;	/* Epoch of the new writes */
+	int			epoch_writes;	/* Its writes in flight */
+	struct list_head	flushes;	/* Waiting flushes, oldest first */
+
+	/*
+	 * Hedged reads: reads late by hedge_threshold get a second leg, as
+	 * long as hedges stay within hedge_budget percents of the reads.
+	 * The threshold follows the hedge_percentile of the read latency,
+	 * unless it was set by hand.
+	 */
+	spinlock_t		hedge_lock;
+	unsigned int		hedge_threshold;	/* In us, 0: no hedging */
+	unsigned int		hedge_percentile;	/* 0: fixed threshold */
+	unsigned int		hedge_budget;		/* In percents */
+	unsigned int		lat_hist[SRB_HEDGE_BUCKETS];	/* log2(us) */
+	unsigned int		lat_samples;		/* Since last update */
+	unsigned int		window_reads;		/* Budget's window */
+	unsigned int		window_hedges;
+	unsigned long		hedges_issued;
+	unsigned long		hedges_won;
+	atomic_t		nb_legs;		/* Allocated, see srb_free_disk */
+	wait_queue_head_t	legs_wait;
+
+	/*
+	 * Readahead: sequential streams of reads get the ra_window following
+	 * them prefetched, and are served from it (srb_readahead.c).
+	 */
+	spinlock_t		ra_lock;
+	struct mutex		ra_mutex;	/* Serializes srb_ra_configure */
+	struct srb_ra_stream_s	*ra_streams;	/* NULL: no readahead */
+	unsigned int		ra_nb_streams;
+	unsigned int		ra_window;	/* In bytes */
+	unsigned int		ra_chunk_size;	/* Half the window, in bytes */
+	unsigned long		ra_hits;	/* Reads served from the window */
+	unsigned long		ra_misses;	/* Stream reads sent to a server */
+	atomic_t		ra_refs;	/* Chunks loading or being copied */
+	wait_queue_head_t	ra_wait;
+
+	struct srb_cache_s	cache;
+
+	struct srb_wblog_s	*wblog;		/* Write-back log, or NULL */
+	struct srb_wback_s	wback;		/* Volatile write-back */
+
+	struct srb_zmap_s	zmap;		/* Known-zero extents */
 
 	/* Debug traces */
 	srb_debug_t		debug;
@@ -215,7 +584,8 @@ int srb_device_create(const char *filename, unsigned long long size);
 int srb_device_extend(const char *filename, unsigned long long size);
 int srb_device_destroy(const char *filename);
 
-int srb_device_attach(const char *filename, const char *devname);
+int srb_device_attach(const char *filename, const char *devname,
+		unsigned long long max_io, const char *wblog);
 int srb_device_detach(const char *devname);
 
 int srb_server_add(const char *url);
@@ -223,29 +593,96 @@ int srb_server_remove(const char *url);
 ssize_t srb_servers_dump(char *buf, ssize_t max_size);
 int srb_volumes_dump(char *buf, size_t max_size);
 
+void srb_end_request(struct request *req, int error);
+void srb_end_cmd(struct srb_cmd_s *cmd, int error);
+void srb_dispatch(struct srb_device_s *dev, struct srb_cmd_s *cmd);
+void srb_send(struct srb_device_s *dev, struct srb_cmd_s *cmd, int path);
+int srb_send_wait(struct srb_device_s *dev, enum srb_cmd_op op, int fua,
+		uint64_t offset, int size, struct scatterlist *sgl, int nr_sgl,
+		int path);
+void srb_flush_submit(struct srb_device_s *dev, struct srb_cmd_s *cmd);
+void srb_resubmit(struct srb_cmd_s *cmd);
+int srb_read_claim(struct srb_cmd_s *cmd);
+void srb_hedge_set_threshold(struct srb_device_s *dev, unsigned int threshold);
+void srb_hedge_set_percentile(struct srb_device_s *dev, unsigned int percentile);
+
+/* srb_engine.c */
+int srb_engine_init(void);
+void srb_engine_cleanup(void);
+struct srb_conn_pool_s *srb_engine_pool_get(const char *ip_addr,
+		uint16_t port, int max_segs);
+void srb_engine_pool_put(struct srb_conn_pool_s *pool);
+void srb_engine_submit(struct srb_conn_pool_s *pool, struct srb_cmd_s *cmd);
+unsigned long srb_engine_pool_load(struct srb_conn_pool_s *pool);
+int srb_engine_pool_healthy(struct srb_conn_pool_s *pool);
+
+/* srb_readahead.c */
+int srb_ra_configure(struct srb_device_s *dev, unsigned int window,
+		unsigned int nb_streams);
+int srb_ra_read(struct srb_device_s *dev, struct srb_cmd_s *cmd);
+void srb_ra_end(struct srb_cmd_s *cmd, int error);
+void srb_ra_invalidate(struct srb_device_s *dev, uint64_t offset, int size);
+
+/* srb_cache.c */
+int srb_cache_init(void);
+void srb_cache_cleanup(void);
+void srb_cache_device_init(struct srb_device_s *dev);
+void srb_cache_device_cleanup(struct srb_device_s *dev);
+void srb_cache_resize(struct srb_device_s *dev, unsigned long max_pages);
+int srb_cache_read(struct srb_device_s *dev, struct srb_cmd_s *cmd);
+void srb_cache_fill(struct srb_device_s *dev, struct srb_cmd_s *cmd);
+void srb_cache_write(struct srb_device_s *dev, struct srb_cmd_s *cmd,
+		int error);
+
+/* srb_writeback.c */
+void srb_wback_device_init(struct srb_device_s *dev);
+int srb_wback_enable(struct srb_device_s *dev, int enable);
+void srb_wback_stop(struct srb_device_s *dev);
+int srb_wback_submit(struct srb_device_s *dev, struct srb_cmd_s *cmd);
+
+/* srb_zeromap.c */
+void srb_zmap_device_init(struct srb_device_s *dev);
+void srb_zmap_device_cleanup(struct srb_device_s *dev);
+void srb_zmap_write_start(struct srb_device_s *dev, struct srb_cmd_s *cmd);
+void srb_zmap_write_end(struct srb_device_s *dev, struct srb_cmd_s *cmd,
+		int error);
+unsigned long srb_zmap_seq(struct srb_device_s *dev);
+void srb_zmap_hint(struct srb_device_s *dev, uint64_t offset, int size,
+		unsigned long seq);
+int srb_zmap_read(struct srb_device_s *dev, struct srb_cmd_s *cmd);
+void srb_zmap_resize(struct srb_device_s *dev, uint64_t old_size,
+		uint64_t new_size);
+
+/* srb_wblog.c */
+int srb_wblog_open(struct srb_device_s *dev, const char *path);
+void srb_wblog_close(struct srb_device_s *dev);
+int srb_wblog_submit(struct srb_device_s *dev, struct srb_cmd_s *cmd);
+const char *srb_wblog_path(struct srb_device_s *dev);
+uint64_t srb_wblog_dirty(struct srb_device_s *dev);
+
 /* srb_sysfs.c*/
 int srb_sysfs_init(void);
 void srb_sysfs_device_init(srb_device_t *dev);
 void srb_sysfs_cleanup(void);
 
 /* srb_cdmi.c */
+struct srb_cdmi_desc_s *srb_cdmi_desc_alloc(int xmit_size);
+void srb_cdmi_desc_free(struct srb_cdmi_desc_s *desc);
+void srb_cdmi_desc_copy(struct srb_cdmi_desc_s *dst,
+		const struct srb_cdmi_desc_s *src);
 int srb_cdmi_init(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
 		const char *url);
+int srb_cdmi_sock_open(srb_debug_t *dbg, const struct srb_cdmi_desc_s *desc,
+		int fastopen, struct socket **sockp);
+void srb_cdmi_sock_close(struct socket *sock);
+void srb_cdmi_adopt(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
+		struct socket *sock);
 int srb_cdmi_connect(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc);
 int srb_cdmi_disconnect(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc);
 
 int srb_cdmi_getsize(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
 		uint64_t *size);
 
-int srb_cdmi_getrange(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
-		uint64_t offset, int size);
-
-int srb_cdmi_putrange(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
-		uint64_t offset, int size);
-
-int srb_cdmi_flush(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
-		unsigned long flush_size);
-
 int srb_cdmi_truncate(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
 		unsigned long trunc_size);
 
@@ -260,11 +697,22 @@ int srb_cdmi_list(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
 		   srb_cdmi_list_cb cb, void *cb_data);
 
 /* srb_http.c */
-int srb_http_check_response_complete(char *buff, int len);
+void srb_http_parser_init(struct srb_http_parser_s *parser);
+int srb_http_parse_response(struct srb_http_parser_s *parser,
+		char *buff, int len);
 int srb_http_mklist(char *buff, int len, char *host, char *page);
 int srb_http_mkhead(char *buff, int len, char *host, char *page);
-int srb_http_mkrange(char *cmd, char *buff, int len, char *host, char *page,
-		uint64_t start, uint64_t end);
+
+int srb_http_mktemplate(struct srb_http_tmpl_s *tmpl, char *host, char *page);
+int srb_http_mkrange_tmpl(const struct srb_http_tmpl_s *tmpl, char *buff,
+		int len, int put, uint64_t start, uint64_t end, int sync);
+int srb_http_mksync(const struct srb_http_tmpl_s *tmpl, char *buff, int len);
+int srb_http_mkdiscard(const struct srb_http_tmpl_s *tmpl, char *buff,
+		int len, uint64_t start, uint64_t end);
+int srb_http_mkzero(const struct srb_http_tmpl_s *tmpl, char *buff,
+		int len, uint64_t start, uint64_t end);
+int srb_http_mkwritesame(const struct srb_http_tmpl_s *tmpl, char *buff,
+		int len, uint64_t start, uint64_t end, unsigned long block_size);
 
 int srb_http_mkcreate(char *buff, int len, char *host, char *page);
 int srb_http_mktruncate(char *buff, int len, char *host, char *page,
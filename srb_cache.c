@@ -0,0 +1,531 @@
+/*
+ * Copyright (C) 2014 SCALITY SA - http://www.scality.com
+ *
+ * This file is part of ScalityRestBlock.
+ *
+ * ScalityRestBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ScalityRestBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ScalityRestBlock.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Block cache
+ *
+ * Devices may keep the pages they read in memory, so that the reads which
+ * do not go through the page cache (O_DIRECT) are served again without a
+ * round-trip to a server. Only reads up to SRB_CACHE_MAX_IO are cached:
+ * larger ones are mostly scans, which would only evict the working set.
+ *
+ * The admission follows the 2Q policy: a block read for the first time
+ * enters the a1in FIFO, about a quarter of the cache. When it is evicted
+ * from there, its ghost (the block without its page) stays in the a1out
+ * FIFO for a while. Only the blocks read again while their ghost is there
+ * make it to the am LRU, which holds the rest of the cache. A scan thus
+ * only cycles through a1in, without evicting the blocks of am.
+ *
+ * The cache is written through: the writes update the blocks it holds once
+ * they completed, and the reads which completed after a write do not fill
+ * it, as they may hold the data it replaced. Discards and zeroing just drop
+ * the blocks they cover.
+ *
+ * A module-wide shrinker evicts blocks under memory pressure.
+ *
+ * Reads are only completed from the cache with blk-mq, for the same reason
+ * as in srb_readahead.c.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/scatterlist.h>
+#include <linux/shrinker.h>
+
+#include "srb.h"
+
+enum srb_cache_queue {
+	SRB_CACHE_A1IN = 0,
+	SRB_CACHE_A1OUT,
+	SRB_CACHE_AM,
+};
+
+struct srb_cache_block_s {
+	struct rb_node		node;
+	struct list_head	lru;		/* Entry of its queue */
+	enum srb_cache_queue	queue;
+	uint64_t		index;		/* Offset >> PAGE_SHIFT */
+	struct page		*page;		/* NULL for a ghost */
+};
+
+/* Caches with blocks, for the shrinker */
+static LIST_HEAD(srb_caches);
+static DEFINE_SPINLOCK(srb_caches_lock);
+
+/* Position in the pages of a command, moving forward only */
+struct srb_cache_sg_pos {
+	int			i;
+	unsigned int		base;		/* Request's bytes before sgl[i] */
+};
+
+/*
+ * Copies len bytes at position at of a request between buf and its pages,
+ * to them if to_sg is set.
+ */
+static void cache_sg_copy(struct srb_cmd_s *cmd, struct srb_cache_sg_pos *pos,
+			  unsigned int at, char *buf, unsigned int len,
+			  int to_sg)
+{
+	struct scatterlist *sg;
+	unsigned int off;
+	unsigned int n;
+
+	while (len && pos->i < cmd->sgl_size) {
+		sg = &cmd->sgl[pos->i];
+		if (at >= pos->base + sg->length) {
+			pos->base += sg->length;
+			pos->i++;
+			continue;
+		}
+		off = at - pos->base;
+		n = min_t(unsigned int, len, sg->length - off);
+		if (to_sg)
+			memcpy((char *)sg_virt(sg) + off, buf, n);
+		else
+			memcpy(buf, (char *)sg_virt(sg) + off, n);
+		at += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* First block at or after index. cache lock held. */
+static struct srb_cache_block_s *__cache_first(struct srb_cache_s *cache,
+					       uint64_t index)
+{
+	struct rb_node *node = cache->blocks.rb_node;
+	struct srb_cache_block_s *first = NULL;
+	struct srb_cache_block_s *b;
+
+	while (node) {
+		b = rb_entry(node, struct srb_cache_block_s, node);
+		if (b->index < index) {
+			node = node->rb_right;
+		} else {
+			first = b;
+			if (b->index == index)
+				break;
+			node = node->rb_left;
+		}
+	}
+
+	return first;
+}
+
+static struct srb_cache_block_s *__cache_next(struct srb_cache_block_s *b)
+{
+	struct rb_node *node = rb_next(&b->node);
+
+	return node ? rb_entry(node, struct srb_cache_block_s, node) : NULL;
+}
+
+static struct srb_cache_block_s *__cache_lookup(struct srb_cache_s *cache,
+						uint64_t index)
+{
+	struct srb_cache_block_s *b = __cache_first(cache, index);
+
+	return b && b->index == index ? b : NULL;
+}
+
+static void __cache_insert(struct srb_cache_s *cache,
+			   struct srb_cache_block_s *new)
+{
+	struct rb_node **link = &cache->blocks.rb_node;
+	struct rb_node *parent = NULL;
+	struct srb_cache_block_s *b;
+
+	while (*link) {
+		parent = *link;
+		b = rb_entry(parent, struct srb_cache_block_s, node);
+		if (new->index < b->index)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &cache->blocks);
+}
+
+static unsigned long *__cache_count(struct srb_cache_s *cache,
+				    enum srb_cache_queue queue)
+{
+	switch (queue) {
+	case SRB_CACHE_A1IN:
+		return &cache->nr_a1in;
+	case SRB_CACHE_A1OUT:
+		return &cache->nr_a1out;
+	default:
+		return &cache->nr_am;
+	}
+}
+
+/* Forgets a block, ghost or not. cache lock held. */
+static void __cache_drop(struct srb_cache_s *cache, struct srb_cache_block_s *b)
+{
+	(*__cache_count(cache, b->queue))--;
+	list_del(&b->lru);
+	rb_erase(&b->node, &cache->blocks);
+	if (b->page)
+		put_page(b->page);
+	kfree(b);
+}
+
+/*
+ * Evicts blocks until at most target of them are resident, a1in first once
+ * it outgrew its share, and trims the ghosts. cache lock held.
+ */
+static unsigned long __cache_shrink(struct srb_cache_s *cache,
+				    unsigned long target)
+{
+	struct srb_cache_block_s *b;
+	unsigned long freed = 0;
+
+	while (cache->nr_a1in + cache->nr_am > target) {
+		if (cache->nr_a1in > max(cache->max_pages / 4, 1UL) ||
+		    !cache->nr_am) {
+			b = list_last_entry(&cache->a1in,
+					    struct srb_cache_block_s, lru);
+			put_page(b->page);
+			b->page = NULL;
+			b->queue = SRB_CACHE_A1OUT;
+			list_move(&b->lru, &cache->a1out);
+			cache->nr_a1in--;
+			cache->nr_a1out++;
+		} else {
+			b = list_last_entry(&cache->am,
+					    struct srb_cache_block_s, lru);
+			__cache_drop(cache, b);
+		}
+		freed++;
+	}
+
+	while (cache->nr_a1out > cache->max_pages / 2) {
+		b = list_last_entry(&cache->a1out, struct srb_cache_block_s, lru);
+		__cache_drop(cache, b);
+	}
+
+	return freed;
+}
+
+/*
+ * Completes a read from the cache if it holds all of its pages. Returns 0
+ * if the read is to be sent to a server.
+ */
+int srb_cache_read(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	struct srb_cache_block_s *blocks[SRB_CACHE_MAX_PAGES];
+	struct page *pages[SRB_CACHE_MAX_PAGES];
+	struct srb_cache_s *cache = &dev->cache;
+	struct srb_cache_sg_pos pos = { 0, 0 };
+	uint64_t first = cmd->offset >> PAGE_SHIFT;
+	unsigned int at = 0;
+	unsigned int off;
+	unsigned int len;
+	unsigned long flags;
+	int nr;
+	int i;
+
+	cmd->cache_wseq = 0;
+	if (!cache->max_pages || cmd->size > SRB_CACHE_MAX_IO)
+		return 0;
+	nr = ((cmd->offset + cmd->size - 1) >> PAGE_SHIFT) - first + 1;
+	if (nr > SRB_CACHE_MAX_PAGES)
+		return 0;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	cmd->cache_wseq = cache->wseq;
+	for (i = 0; i < nr; i++) {
+		blocks[i] = __cache_lookup(cache, first + i);
+		if (!blocks[i] || !blocks[i]->page)
+			break;
+	}
+	if (i < nr) {
+		cache->misses++;
+		spin_unlock_irqrestore(&cache->lock, flags);
+		return 0;
+	}
+	for (i = 0; i < nr; i++) {
+		/* Blocks of a1in are not promoted before leaving it */
+		if (blocks[i]->queue == SRB_CACHE_AM)
+			list_move(&blocks[i]->lru, &cache->am);
+		pages[i] = blocks[i]->page;
+		get_page(pages[i]);
+	}
+	cache->hits++;
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	off = cmd->offset & ~PAGE_MASK;
+	for (i = 0; i < nr; i++, off = 0) {
+		len = min_t(unsigned int, PAGE_SIZE - off, cmd->size - at);
+		cache_sg_copy(cmd, &pos, at, (char *)page_address(pages[i]) + off,
+			      len, 1);
+		at += len;
+		put_page(pages[i]);
+	}
+
+	cmd->local = 1;
+	srb_end_request(cmd->req, 0);
+
+	return 1;
+}
+
+/*
+ * Admits the whole pages a read got from a server, unless a write
+ * completed since it was submitted. Called on its completion.
+ */
+void srb_cache_fill(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	struct srb_cache_s *cache = &dev->cache;
+	struct srb_cache_sg_pos pos = { 0, 0 };
+	struct srb_cache_block_s *b;
+	uint64_t index = DIV_ROUND_UP(cmd->offset, PAGE_SIZE);
+	uint64_t end = (cmd->offset + cmd->size) >> PAGE_SHIFT;
+	unsigned long flags;
+	struct page *page;
+
+	if (!cmd->cache_wseq || index >= end)
+		return;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	if (cmd->cache_wseq != cache->wseq || !cache->max_pages)
+		goto out;
+
+	for (; index < end; index++) {
+		b = __cache_lookup(cache, index);
+		if (b && b->page)
+			continue;
+
+		/* Best effort: we may be in atomic context */
+		page = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+		if (!page)
+			break;
+		if (!b) {
+			b = kzalloc(sizeof(*b), GFP_NOWAIT | __GFP_NOWARN);
+			if (!b) {
+				__free_page(page);
+				break;
+			}
+			b->index = index;
+			b->queue = SRB_CACHE_A1IN;
+			list_add(&b->lru, &cache->a1in);
+			cache->nr_a1in++;
+			__cache_insert(cache, b);
+		} else {
+			/* Read again soon after leaving a1in */
+			b->queue = SRB_CACHE_AM;
+			list_move(&b->lru, &cache->am);
+			cache->nr_a1out--;
+			cache->nr_am++;
+		}
+		b->page = page;
+		cache_sg_copy(cmd, &pos, (index << PAGE_SHIFT) - cmd->offset,
+			      page_address(page), PAGE_SIZE, 0);
+	}
+	__cache_shrink(cache, cache->max_pages);
+
+out:
+	spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/*
+ * Updates the blocks a completed write covered with its data, or drops
+ * them if it failed or has no data of its own to copy.
+ */
+void srb_cache_write(struct srb_device_s *dev, struct srb_cmd_s *cmd,
+		     int error)
+{
+	struct srb_cache_s *cache = &dev->cache;
+	struct srb_cache_sg_pos pos = { 0, 0 };
+	struct srb_cache_block_s *b, *next;
+	uint64_t end = cmd->offset + cmd->size;
+	uint64_t start, stop;
+	unsigned long flags;
+	int update;
+
+	if (!cache->max_pages)
+		return;
+	update = !error && cmd->op == SRB_CMD_WRITE;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	if (!++cache->wseq)
+		cache->wseq++;
+
+	b = __cache_first(cache, cmd->offset >> PAGE_SHIFT);
+	for (; b && (b->index << PAGE_SHIFT) < end; b = next) {
+		next = __cache_next(b);
+		if (!b->page)
+			continue;
+		if (!update) {
+			__cache_drop(cache, b);
+			continue;
+		}
+		start = max_t(uint64_t, cmd->offset, b->index << PAGE_SHIFT);
+		stop = min_t(uint64_t, end, (b->index + 1) << PAGE_SHIFT);
+		cache_sg_copy(cmd, &pos, start - cmd->offset,
+			      (char *)page_address(b->page) +
+			      (start & ~PAGE_MASK), stop - start, 0);
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/* Sets the number of pages the cache of a device holds, 0 disabling it */
+void srb_cache_resize(struct srb_device_s *dev, unsigned long max_pages)
+{
+	struct srb_cache_s *cache = &dev->cache;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	cache->max_pages = max_pages;
+	__cache_shrink(cache, max_pages);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	spin_lock(&srb_caches_lock);
+	if (max_pages && list_empty(&cache->list))
+		list_add_tail(&cache->list, &srb_caches);
+	else if (!max_pages && !list_empty(&cache->list))
+		list_del_init(&cache->list);
+	spin_unlock(&srb_caches_lock);
+}
+
+void srb_cache_device_init(struct srb_device_s *dev)
+{
+	struct srb_cache_s *cache = &dev->cache;
+
+	spin_lock_init(&cache->lock);
+	INIT_LIST_HEAD(&cache->list);
+	cache->blocks = RB_ROOT;
+	INIT_LIST_HEAD(&cache->a1in);
+	INIT_LIST_HEAD(&cache->a1out);
+	INIT_LIST_HEAD(&cache->am);
+	cache->nr_a1in = 0;
+	cache->nr_a1out = 0;
+	cache->nr_am = 0;
+	cache->max_pages = 0;
+	cache->wseq = 1;
+	cache->hits = 0;
+	cache->misses = 0;
+}
+
+/* Drops the cache of a device whose requests all completed */
+void srb_cache_device_cleanup(struct srb_device_s *dev)
+{
+	srb_cache_resize(dev, 0);
+}
+
+/*
+ * Shrinker
+ */
+static unsigned long srb_cache_count(struct shrinker *shrinker,
+				     struct shrink_control *sc)
+{
+	struct srb_cache_s *cache;
+	unsigned long count = 0;
+
+	spin_lock(&srb_caches_lock);
+	list_for_each_entry(cache, &srb_caches, list)
+		count += cache->nr_a1in + cache->nr_am;
+	spin_unlock(&srb_caches_lock);
+
+	return count;
+}
+
+/* Evicts from each cache in proportion to its size */
+static unsigned long srb_cache_scan(struct shrinker *shrinker,
+				    struct shrink_control *sc)
+{
+	unsigned long total = srb_cache_count(shrinker, sc);
+	struct srb_cache_s *cache;
+	unsigned long freed = 0;
+	unsigned long resident;
+	unsigned long nr;
+	unsigned long flags;
+
+	if (!total)
+		return SHRINK_STOP;
+
+	spin_lock(&srb_caches_lock);
+	list_for_each_entry(cache, &srb_caches, list) {
+		spin_lock_irqsave(&cache->lock, flags);
+		resident = cache->nr_a1in + cache->nr_am;
+		nr = min(resident, DIV_ROUND_UP(sc->nr_to_scan * resident, total));
+		freed += __cache_shrink(cache, resident - nr);
+		spin_unlock_irqrestore(&cache->lock, flags);
+	}
+	spin_unlock(&srb_caches_lock);
+
+	return freed;
+}
+
+#ifdef SRB_SHRINKER_ALLOC
+static struct shrinker *srb_shrinker;
+#else
+#ifndef SRB_SHRINKER_SCAN
+static int srb_cache_shrink(struct shrinker *shrinker,
+			    struct shrink_control *sc)
+{
+	if (sc->nr_to_scan)
+		srb_cache_scan(shrinker, sc);
+
+	return min_t(unsigned long, srb_cache_count(shrinker, sc), INT_MAX);
+}
+#endif
+
+static struct shrinker srb_shrinker_s = {
+#ifdef SRB_SHRINKER_SCAN
+	.count_objects	= srb_cache_count,
+	.scan_objects	= srb_cache_scan,
+#else
+	.shrink		= srb_cache_shrink,
+#endif
+	.seeks		= DEFAULT_SEEKS,
+};
+static struct shrinker *srb_shrinker = &srb_shrinker_s;
+#endif
+
+int srb_cache_init(void)
+{
+#ifdef SRB_SHRINKER_ALLOC
+	srb_shrinker = shrinker_alloc(0, "srb-cache");
+	if (!srb_shrinker)
+		return -ENOMEM;
+	srb_shrinker->count_objects = srb_cache_count;
+	srb_shrinker->scan_objects = srb_cache_scan;
+	srb_shrinker->seeks = DEFAULT_SEEKS;
+	shrinker_register(srb_shrinker);
+
+	return 0;
+#else
+	return srb_register_shrinker(srb_shrinker, "srb-cache");
+#endif
+}
+
+void srb_cache_cleanup(void)
+{
+#ifdef SRB_SHRINKER_ALLOC
+	shrinker_free(srb_shrinker);
+#else
+	unregister_shrinker(srb_shrinker);
+#endif
+}
@@ -27,6 +27,7 @@
 #include <linux/sched.h>
 #include <linux/socket.h>
 #include <linux/tcp.h>
+#include <linux/vmalloc.h>
 #include "srb.h"
 
 #include "jsmn/jsmn.h"
@@ -97,6 +98,53 @@ static int get_port(const char *url, int *port)
 	return i;
 }
 
+/*
+ * Allocates a descriptor along with its transmit buffer of xmit_size
+ * bytes, which bounds the requests and buffered responses it can handle.
+ */
+struct srb_cdmi_desc_s *srb_cdmi_desc_alloc(int xmit_size)
+{
+	struct srb_cdmi_desc_s *desc;
+
+	desc = vmalloc(sizeof(*desc));
+	if (desc == NULL)
+		return NULL;
+	memset(desc, 0, sizeof(*desc));
+
+	desc->xmit_buff = vmalloc(xmit_size);
+	if (desc->xmit_buff == NULL) {
+		vfree(desc);
+		return NULL;
+	}
+	desc->xmit_size = xmit_size;
+
+	return desc;
+}
+
+void srb_cdmi_desc_free(struct srb_cdmi_desc_s *desc)
+{
+	if (desc == NULL)
+		return;
+	if (desc->xmit_buff)
+		vfree(desc->xmit_buff);
+	vfree(desc);
+}
+
+/*
+ * Copies the server and volume of src into dst, which keeps its own
+ * transmit buffer.
+ */
+void srb_cdmi_desc_copy(struct srb_cdmi_desc_s *dst,
+			const struct srb_cdmi_desc_s *src)
+{
+	char *xmit_buff = dst->xmit_buff;
+	int xmit_size = dst->xmit_size;
+
+	memcpy(dst, src, sizeof(*dst));
+	dst->xmit_buff = xmit_buff;
+	dst->xmit_size = xmit_size;
+}
+
 /* srb_cdmi_init (URL)
  *
  * Parse url and initialise cdmi structure in all threads descriptors
@@ -156,81 +204,124 @@ int srb_cdmi_init(srb_debug_t *dbg,
 	return 0;	
 }
 
-/* srb_cdmi_connect
+/* srb_cdmi_sock_open
  *
- * Connect thread pools descriptors
+ * Opens a new connection to the server of the descriptor, without handing
+ * it over to the descriptor (see srb_cdmi_adopt). Connecting takes at most
+ * server_conn_timeout seconds. With fastopen set, TCP Fast Open is
+ * requested: once the server gave us a cookie, connecting returns right
+ * away and the first request goes along with the SYN.
  *
  * Returns 0 if successfull or a negative value depending the error.
  */
-int srb_cdmi_connect(srb_debug_t *dbg,
-		struct srb_cdmi_desc_s *desc)
+int srb_cdmi_sock_open(srb_debug_t *dbg,
+		const struct srb_cdmi_desc_s *desc, int fastopen,
+		struct socket **sockp)
 {
+	struct sockaddr_in sockaddr;
+	struct socket *sock = NULL;
 	int ret;
-	int arg = 1;
-
-	if (!desc)
-		return -EINVAL;
-
-	if (desc->state == CDMI_CONNECTED)
-		return 0;
 
 	/* Init socket */
-	ret = sock_create_kern(PF_INET, SOCK_STREAM, IPPROTO_TCP, &desc->socket);
+	ret = srb_sock_create_kern(PF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
 	if (ret < 0) {
 		SRB_LOG_ERR(dbg->level, "Unable to create socket: %d", ret);
+		sock = NULL;
 		goto out_error;
 	}
-	memset(&desc->sockaddr, 0, sizeof(desc->sockaddr));
+
+	if (fastopen) {
+		ret = srb_sock_set_fastopen(sock);
+		if (ret < 0)
+			SRB_LOG_DEBUG(dbg->level, "TCP Fast Open unavailable: %d", ret);
+	}
+	if (server_conn_timeout > 0)
+		srb_sock_set_timeout(sock, server_conn_timeout);
 
 	/* Connecting socket */
-	desc->sockaddr.sin_family	= AF_INET;
-	desc->sockaddr.sin_addr.s_addr  = in_aton(desc->ip_addr);
-	desc->sockaddr.sin_port		= htons(desc->port);
-	ret = desc->socket->ops->connect(desc->socket,
-				(struct sockaddr*)&desc->sockaddr,
-				sizeof(struct sockaddr_in), !O_NONBLOCK);
+	memset(&sockaddr, 0, sizeof(sockaddr));
+	sockaddr.sin_family		= AF_INET;
+	sockaddr.sin_addr.s_addr	= in_aton(desc->ip_addr);
+	sockaddr.sin_port		= htons(desc->port);
+	ret = sock->ops->connect(sock, (struct sockaddr*)&sockaddr,
+				 sizeof(struct sockaddr_in), !O_NONBLOCK);
 	if (ret < 0) {
 		SRB_LOG_ERR(dbg->level, "Unable to connect to cdmi server: %d", ret);
 		goto out_error;
 	}
-	desc->state = CDMI_CONNECTED;
 
-	ret = kernel_setsockopt(desc->socket,
-		IPPROTO_TCP, TCP_NODELAY, (char *)&arg,
-		sizeof(arg));
+	ret = srb_sock_set_nodelay(sock);
 	if (ret < 0) {
 		SRB_LOG_ERR(dbg->level, "setsockopt failed: %d", ret);
 		goto out_error;
 	}
 
-	if (desc->timeout.tv_sec > 0) {
-		SRB_LOG_DEBUG(dbg->level, "srb_cdmi_connect: set socket timeout %lu", desc->timeout.tv_sec);
-		ret = kernel_setsockopt(desc->socket, SOL_SOCKET, SO_RCVTIMEO,
-			(char *)&desc->timeout, sizeof(struct timeval));
-		if (ret < 0) {
-			SRB_LOG_ERR(dbg->level, "Failed to set socket receive timeout value: %d", ret);
-		}
-		ret = kernel_setsockopt(desc->socket, SOL_SOCKET, SO_SNDTIMEO, (char *)&desc->timeout, sizeof(struct timeval));
-		if (ret < 0) {
-			SRB_LOG_ERR(dbg->level, "Failed to set socket send timeout value: %d", ret);
-		}
+	if (desc->timeout > 0 || server_conn_timeout > 0) {
+		SRB_LOG_DEBUG(dbg->level, "srb_cdmi_connect: set socket timeout %u", desc->timeout);
+		srb_sock_set_timeout(sock, desc->timeout);
 	}
 
+	*sockp = sock;
+
+	return 0;
+
+out_error:
+	if (sock)
+		srb_cdmi_sock_close(sock);
+
+	return ret;
+}
+
+void srb_cdmi_sock_close(struct socket *sock)
+{
+	kernel_sock_shutdown(sock, SHUT_RDWR);
+	sock_release(sock);
+}
+
+/*
+ * Connects the descriptor through a socket opened by srb_cdmi_sock_open.
+ */
+void srb_cdmi_adopt(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
+		struct socket *sock)
+{
+	if (desc->state == CDMI_CONNECTED)
+		srb_cdmi_disconnect(dbg, desc);
+
+	desc->socket = sock;
+	desc->state = CDMI_CONNECTED;
+
 	/* As we established a new connection, reset the number of
 	   HTTP requests sent */
 	desc->nb_requests = 0;
+}
 
-	return 0;
+/* srb_cdmi_connect
+ *
+ * Connect thread pools descriptors
+ *
+ * Returns 0 if successfull or a negative value depending the error.
+ */
+int srb_cdmi_connect(srb_debug_t *dbg,
+		struct srb_cdmi_desc_s *desc)
+{
+	struct socket *sock;
+	int ret;
 
-out_error:
-	if (desc->socket) {
-		kernel_sock_shutdown(desc->socket, SHUT_RDWR);
-		sock_release(desc->socket);
+	if (!desc)
+		return -EINVAL;
+
+	if (desc->state == CDMI_CONNECTED)
+		return 0;
+
+	ret = srb_cdmi_sock_open(dbg, desc, desc->fastopen, &sock);
+	if (ret) {
+		desc->socket = NULL;
+		desc->state = CDMI_DISCONNECTED;
+		return ret;
 	}
-	desc->socket = NULL;
-	desc->state = CDMI_DISCONNECTED;
+	srb_cdmi_adopt(dbg, desc, sock);
 
-	return ret;
+	return 0;
 }
 
 /* srb_cdmi_disconnect
@@ -246,8 +337,7 @@ int srb_cdmi_disconnect(srb_debug_t *dbg,
 	if (!desc->socket || desc->state == CDMI_DISCONNECTED)
 		return 0;
 
-	kernel_sock_shutdown(desc->socket, SHUT_RDWR);
-	sock_release(desc->socket);
+	srb_cdmi_sock_close(desc->socket);
 	desc->socket = NULL;
 	desc->state = CDMI_DISCONNECTED;
 
@@ -303,10 +393,9 @@ static int sock_xmit(srb_debug_t *dbg,
 		}
 		SRB_LOG_DEBUG(dbg->level, "Result for socket exchange: %d", result);
 		if (signal_pending(current)) {
-			siginfo_t info;
 			SRB_LOG_INFO(dbg->level, "srb (pid %d: %s) got signal %d\n",
 				task_pid_nr(current), current->comm,
-				dequeue_signal_lock(current, &current->blocked, &info));
+				srb_dequeue_signal());
 			result = -EINTR;
 			break;
 		}
@@ -328,48 +417,92 @@ static int sock_xmit(srb_debug_t *dbg,
 	} while (size > 0);
 
 	sigprocmask(SIG_SETMASK, &oldset, NULL);
-	tsk_restore_flags(current, pflags, PF_MEMALLOC);
+	srb_restore_flags(pflags, PF_MEMALLOC);
 
 	return result;
 }
 
+/*
+ * Receives a response in rcvbuf (at most rcv_size bytes), parsing it on the
+ * fly into desc->parser. rcvbuf may already hold the first rcvd bytes of the
+ * response. Once the header is known, only the exact number of missing bytes
+ * is requested from the socket.
+ *
+ * Returns the number of bytes received or a negative value depending the
+ * error.
+ */
+static int sock_receive_response(srb_debug_t *dbg,
+				struct srb_cdmi_desc_s *desc,
+				char *rcvbuf, int rcvd, int rcv_size)
+{
+	struct srb_http_parser_s *parser = &desc->parser;
+	int need;
+	int ret;
+
+	srb_http_parser_init(parser);
+	while ((need = srb_http_parse_response(parser, rcvbuf, rcvd)) != 0)
+	{
+		if (need < 0) {
+			SRB_LOG_ERR(dbg->level, "Malformed HTTP response");
+			return -EIO;
+		}
+		if (parser->state == SRB_HTTP_PARSE_BODY) {
+			if (need > rcv_size - rcvd) {
+				SRB_LOG_ERR(dbg->level, "Response exceeds %d bytes", rcv_size);
+				return -EIO;
+			}
+			ret = sock_xmit(dbg, desc, 0, rcvbuf + rcvd, need, 1);
+		} else {
+			if (rcvd == rcv_size) {
+				SRB_LOG_ERR(dbg->level, "Response header exceeds %d bytes", rcv_size);
+				return -EIO;
+			}
+			ret = sock_xmit(dbg, desc, 0, rcvbuf + rcvd, rcv_size - rcvd, 0);
+		}
+		if (ret < 0)
+			return ret;
+		rcvd += ret;
+	}
+
+	return rcvd;
+}
+
+/*
+ * Closes the connection once the response received said the server would not
+ * serve any other request on it, so that the next one reconnects instead of
+ * failing.
+ */
+static void sock_keepalive(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc)
+{
+	if (desc->parser.ka_close || desc->parser.ka_max == 0) {
+		SRB_LOG_DEBUG(dbg->level, "Server closes the connection");
+		srb_cdmi_disconnect(dbg, desc);
+	}
+}
+
 static int sock_send_receive(srb_debug_t *dbg,
 			struct srb_cdmi_desc_s *desc,
 			int send_size, int rcv_size)
 {
 	char *buff = desc->xmit_buff;
-	int strict_rcv = 1;
 	int ret = 0;
 	int rcvd = 0;
 	char *rcvbuf = NULL;
 	int has_epiped = 0;
 
-	if (rcv_size == 0) {
-		strict_rcv = 0;
-		rcv_size = SRB_XMIT_BUFFER_SIZE;
-	}
-	rcvbuf = vmalloc(rcv_size);
-	if (rcvbuf == NULL) {
-		ret = -ENOMEM;
-		goto cleanup;
-	}
-
 	/*
-	 * Check if the connection needs to be restarted:
-	 * Reconnect the socket after a predefined number of HTTP
-	 * requests sent.
+	 * The request must be kept intact in case it has to be sent again,
+	 * so the response is received right after it, then moved in place.
 	 */
-	if (desc->nb_requests == SRB_REUSE_LIMIT) {
-		SRB_LOG_DEBUG(dbg->level, "Limit of %u requests reached reconnecting socket", SRB_REUSE_LIMIT);
-		srb_cdmi_disconnect(dbg, desc);
+	rcvbuf = buff + send_size;
+	if (rcv_size == 0)
+		rcv_size = desc->xmit_size - send_size - 1;
+	if (rcv_size > desc->xmit_size - send_size - 1) {
+		ret = -ENOMEM;
+		goto cleanup;
 	}
-	else
-		desc->nb_requests++;
 
-	/*
-	 * Reconnect whether it's been resetted manually (SRB_REUSE_LIMIT) or
-	 * it was left disconnected
-	 */
+	/* Reconnect if the server closed the connection after the last one */
 	if (desc->state == CDMI_DISCONNECTED) {
 		ret = srb_cdmi_connect(dbg, desc);
 		if (ret)
@@ -397,91 +530,11 @@ retry_once:
 	}
 	
 	/* Receive response - We want to make sure we received a full response */
-	rcvd = 0;
-	while (!srb_http_check_response_complete(rcvbuf, rcvd))
-	{
-		if (rcvd)
-			SRB_LOG_WARN(dbg->level, "Response not read fully in one go: "
-			             "read %i bytes until now", rcvd);
-
-		ret = sock_xmit(dbg, desc, 0, rcvbuf+rcvd, rcv_size-rcvd, strict_rcv);
+	ret = sock_receive_response(dbg, desc, rcvbuf, 0, rcv_size);
+	if (ret < 0) {
 		/* Is the connection to be reopened ? */
-		if (ret < 0) {
-			if (ret == -EPIPE) {
-				srb_cdmi_disconnect(dbg, desc);
-				if (has_epiped == 0) {
-					has_epiped = 1;
-					ret = srb_cdmi_connect(dbg, desc);
-					if (ret)
-						goto cleanup;
-					goto retry_once;
-				}
-			}
-			goto cleanup;
-		}
-		rcvd += ret;
-		ret = rcvd;
-	}
-
-	memcpy(buff, rcvbuf, rcvd);
-
-cleanup:
-	if (rcvbuf)
-		vfree(rcvbuf);
-	return ret;
-}
-
-static int sock_send_sglist_receive(srb_debug_t *dbg,
-				struct srb_cdmi_desc_s *desc,
-				int send_size, int rcv_size)
-{
-	char *buff = desc->xmit_buff;
-	int strict_rcv = 1;
-	int i;
-	int ret;
-	int rcvd;
-	char *rcvbuf = NULL;
-	int has_epiped = 0;
-
-	if (rcv_size == 0) {
-		strict_rcv = 0;
-		rcv_size = SRB_XMIT_BUFFER_SIZE;
-	}
-	rcvbuf = vmalloc(rcv_size);
-	if (rcvbuf == NULL) {
-		ret = -ENOMEM;
-		goto cleanup;
-	}
-
-	/*
-	 * Check if the connection needs to be restarted:
-	 * Reconnect the socket after a predefined number of HTTP
-	 * requests sent.
-	 */
-	if (desc->nb_requests == SRB_REUSE_LIMIT) {
-		SRB_LOG_DEBUG(dbg->level, "Limit of %u requests reached reconnecting socket", SRB_REUSE_LIMIT);
 		srb_cdmi_disconnect(dbg, desc);
-	}
-	else
-		desc->nb_requests++;
-
-	/*
-	 * Reconnect whether it's been resetted manually (SRB_REUSE_LIMIT) or
-	 * it was left disconnected
-	 */
-	if (desc->state == CDMI_DISCONNECTED) {
-		ret = srb_cdmi_connect(dbg, desc);
-		if (ret)
-			goto cleanup;
-	}
-
-	/* Send buffer */
-retry_once:
-	ret = sock_xmit(dbg, desc, 1, buff, send_size, 0);
-	if (ret == -EPIPE) {
-		SRB_LOG_ERR(dbg->level, "Transmission error (%d), reconnecting...", ret);
-		srb_cdmi_disconnect(dbg, desc);
-		if (has_epiped == 0) {
+		if (ret == -EPIPE && has_epiped == 0) {
 			has_epiped = 1;
 			ret = srb_cdmi_connect(dbg, desc);
 			if (ret)
@@ -490,106 +543,12 @@ retry_once:
 		}
 		goto cleanup;
 	}
-	if (ret != send_size) {
-		SRB_LOG_ERR(dbg->level, "Incomplete transmission (%d of %d), returning", ret, send_size);
-		ret = -EIO;
-		goto cleanup;
-	}
+	rcvd = ret;
+	sock_keepalive(dbg, desc);
 
-	/* Now iterate through the sglist */
-	for (i = 0; i < desc->sgl_size; i++) {
-		char *buff = sg_virt(&desc->sgl[i]);
-		int length = desc->sgl[i].length;
-
-		ret = sock_xmit(dbg, desc, 1, buff, length, 0);
-		if (ret == -EPIPE) {
-			SRB_LOG_ERR(dbg->level, "Transmission error (%d), reconnecting...", ret);
-			srb_cdmi_disconnect(dbg, desc);
-			if (has_epiped == 0) {
-				has_epiped = 1;
-				ret = srb_cdmi_connect(dbg, desc);
-				if (ret)
-					goto cleanup;
-				goto retry_once;
-			}
-			goto cleanup;
-		}
-		if (ret != length) {
-			SRB_LOG_ERR(dbg->level, "Incomplete transmission (%d of %d), returning",
-				ret, length);
-			ret = -EIO;
-			goto cleanup;
-		}
-	}
-	
-	/* Receive response */
-	rcvd = 0;
-	while (!srb_http_check_response_complete(rcvbuf, rcvd))
-	{
-		if (rcvd)
-			SRB_LOG_WARN(dbg->level, "Response not read fully in one go: "
-						  "read %i bytes until now", rcvd);
-
-		ret = sock_xmit(dbg, desc, 0, rcvbuf+rcvd, rcv_size-rcvd, strict_rcv);
-		/* Is the connection to be reopened ? */
-		if (ret < 0) {
-			if (ret == -EPIPE) {
-				srb_cdmi_disconnect(dbg, desc);
-				if (has_epiped == 0) {
-					has_epiped = 1;
-					ret = srb_cdmi_connect(dbg, desc);
-					if (ret)
-						goto cleanup;
-					goto retry_once;
-				}
-			}
-			goto cleanup;
-		}
-		rcvd += ret;
-		ret = rcvd;
-	}
-
-	memcpy(buff, rcvbuf, rcvd);
+	memmove(buff, rcvbuf, rcvd);
 
 cleanup:
-	if (rcvbuf)
-		vfree(rcvbuf);
-	return ret;
-}
-
-static int retried_send_receive(srb_debug_t *dbg,
-				struct srb_cdmi_desc_s *desc,
-				int send_size, int rcv_size,
-				int do_sglist, int attempts)
-{
-	int ret = -1;
-	int i;
-
-	if (attempts < 1)
-		return -EINVAL;
-
-	/*
-	 * TODO: Handle Failover (Issue #20)
-	 *
-	 * This means that in case of EPIPE (only? more?),
-	 * we must switch to another server url. It might require to
-	 * be done within the callees
-	 */
-	for (i = 0; i < attempts; i++) {
-		if (do_sglist) {
-			ret = sock_send_sglist_receive(dbg, desc, send_size, rcv_size);
-		}
-		else {
-			ret = sock_send_receive(dbg, desc, send_size, rcv_size);
-		}
-
-		/* If some data is returned, then the response is whole */
-		if (ret >= 0)
-			break;
-		else if (i < attempts - 1)
-			SRB_LOG_NOTICE(dbg->level, "Retrying CDMI request... %d", (i + 1));
-	}
-
 	return ret;
 }
 
@@ -619,7 +578,7 @@ int srb_cdmi_list(srb_debug_t *dbg,
 		return 0;
 
 	// Construct HTTTP GET (for listing container)
-	len = srb_http_mklist(buff, SRB_XMIT_BUFFER_SIZE,
+	len = srb_http_mklist(buff, desc->xmit_size,
 			       desc->ip_addr, desc->filename);
 	if (len <= 0) return len;
 
@@ -792,49 +751,6 @@ err:
 	return ret;
 }
 
-int srb_cdmi_flush(srb_debug_t *dbg,
-		struct srb_cdmi_desc_s *desc,
-		unsigned long flush_size)
-{
-	char *buff = desc->xmit_buff;
-	uint64_t size;
-	int len;
-	int ret;
-	enum srb_http_statuscode code;
-
-	if (!desc->socket)
-		return 0;
-
-	/* Construct HTTP truncate */
-	len = srb_http_mktruncate(buff, SRB_XMIT_BUFFER_SIZE,
-				desc->ip_addr, desc->filename, flush_size);
-	if (len <= 0) return len;
-	
-	len = sock_send_receive(dbg, desc, len, 0);
-	if (len < 0) return len;
-
-	ret = srb_http_get_status(buff, len, &code);
-	if (ret != 0)
-	{
-		SRB_LOG_ERR(dbg->level, "Cannot get http response status.");
-		return -EIO;
-	}
-	if (srb_http_get_status_range(code) != SRB_HTTP_STATUSRANGE_SUCCESS)
-	{
-		SRB_LOG_ERR(dbg->level, "Http server responded with bad status: %i", code);
-		if (code == SRB_HTTP_STATUS_NOT_FOUND)
-			return -ENODEV;
-		return -EIO;
-	}
-
-	buff[len] = 0;
-	ret = srb_http_header_get_uint64(buff, len, "Content-Length", &size);
-	if (ret)
-		return -EIO;
-
-	return 0;
-}
-
 int srb_cdmi_extend(srb_debug_t *dbg,
 		struct srb_cdmi_desc_s *desc,
 		unsigned long long trunc_size)
@@ -860,7 +776,7 @@ int srb_cdmi_extend(srb_debug_t *dbg,
 	}
 
 	/* Construct/send HTTP truncate */
-	len = srb_http_mktruncate(buff, SRB_XMIT_BUFFER_SIZE,
+	len = srb_http_mktruncate(buff, desc->xmit_size,
 				   desc->ip_addr, desc->filename, trunc_size);
 	if (len <= 0) return len;
 
@@ -894,7 +810,7 @@ int srb_cdmi_create(srb_debug_t *dbg,
 		return -EINVAL;
 
 	/* Construct/send HTTP create */
-	len = srb_http_mkcreate(buff, SRB_XMIT_BUFFER_SIZE,
+	len = srb_http_mkcreate(buff, desc->xmit_size,
 				 desc->ip_addr, desc->filename);
 	if (len <= 0) return len;
 
@@ -913,7 +829,7 @@ int srb_cdmi_create(srb_debug_t *dbg,
 	}
 
 	/* Construct/send HTTP truncate */
-	len = srb_http_mktruncate(buff, SRB_XMIT_BUFFER_SIZE,
+	len = srb_http_mktruncate(buff, desc->xmit_size,
 				   desc->ip_addr, desc->filename, trunc_size);
 	if (len <= 0) return len;
 
@@ -945,7 +861,7 @@ int srb_cdmi_delete(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc)
 		return -EINVAL;
 
 	/* Construct HTTP delete */
-	len = srb_http_mkdelete(buff, SRB_XMIT_BUFFER_SIZE,
+	len = srb_http_mkdelete(buff, desc->xmit_size,
 				desc->ip_addr, desc->filename);
 	if (len <= 0) return len;
 	
@@ -978,7 +894,7 @@ int srb_cdmi_getsize(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
 	int ret, len;
 
 	/* Construct a HEAD command */
-	len = srb_http_mkhead(buff, SRB_XMIT_BUFFER_SIZE,
+	len = srb_http_mkhead(buff, desc->xmit_size,
 			desc->ip_addr, desc->filename);
 	if (len <= 0) return len;
 
@@ -1003,7 +919,7 @@ int srb_cdmi_getsize(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
 	int ret, len;
 
 	/* Construct a GET (?metadata) command */
-	len = srb_http_mkmetadata(buff, SRB_XMIT_BUFFER_SIZE,
+	len = srb_http_mkmetadata(buff, desc->xmit_size,
 			desc->ip_addr, desc->filename);
 	if (len <= 0) return len;
 
@@ -1032,108 +948,6 @@ int srb_cdmi_getsize(srb_debug_t *dbg, struct srb_cdmi_desc_s *desc,
 	return 0;
 }
 
-/*
- * sends a buffer to CDMI server through a CDMI put range at primitive
- * at specified "offset" writing "size" bytes from "buff".
- */
-int srb_cdmi_putrange(srb_debug_t *dbg,
-		struct srb_cdmi_desc_s *desc,
-		uint64_t offset, int size)
-{
-	char *xmit_buff = desc->xmit_buff;
-	int header_size;
-	int ret = -EIO;
-	int len;
-	uint64_t start, end;
-	
-	/* Calculate start, end */
-	start = offset;
-	end   = offset + size - 1;
-
-	/* Construct a PUT request with range info */
-	ret = srb_http_mkrange("PUT", xmit_buff, SRB_XMIT_BUFFER_SIZE,
-				desc->ip_addr, desc->filename,
-				start, end);
-	if (ret <= 0) return ret;
-	
-	xmit_buff += ret;
-	header_size = ret;
-
-	len = retried_send_receive(dbg, desc, header_size, 0, 1/*sglist*/, nb_req_retries);
-	if (len < 0) {
-		SRB_LOG_ERR(dbg->level, "ERROR sending sglist: %d", len);
-		return len;
-	}
-
-	if (strncmp(desc->xmit_buff, "HTTP/1.1 204 No Content",
-			strlen("HTTP/1.1 204 No Content"))) {
-			SRB_LOG_ERR(dbg->level, "Unable to get back HTTP confirmation buffer");
-		ret = -EIO;
-		goto out;
-	}
-
-	ret = 0;
-out:
-	return ret;
-}
-
-/*
- * get a buffer from th CDMI server through a CDMI get range primitive
- * at specified "offset" reading "size" bytes from "buff".
- */
-int srb_cdmi_getrange(srb_debug_t *dbg,
-		struct srb_cdmi_desc_s *desc,
-		uint64_t offset, int size)
-{
-	char *xmit_buff = desc->xmit_buff;
-	int len, rcv;
-	int ret = -EIO;
-	uint64_t start, end;
-	int i;
-
-	/* Calculate start, end */
-	start = offset;
-	end   = offset + size - 1;
-
-	/* Construct a PUT request with range info */
-	len = srb_http_mkrange("GET", xmit_buff, SRB_XMIT_BUFFER_SIZE,
-				desc->ip_addr, desc->filename,
-				start, end);
-	if (len <= 0)
-		goto out;
-	
-	rcv = len = retried_send_receive(dbg, desc, len, 0, 0/*no sglist*/, nb_req_retries);
-	if (len < 0) return len;	
-
-	/* Skip header */
-	ret = srb_http_skipheader(&xmit_buff, &len);
-	if (ret) {
-		SRB_LOG_DEBUG(dbg->level, "getrange: skipheader failed: %d", ret);
-		ret = -EIO;
-		goto out;
-	}
-
-	// sock_send_receive makes sure to read the whole response,
-	// so we shall have the whole data.
-	if (len != size) {
-		SRB_LOG_DEBUG(dbg->level, "getrange error: len: %d size:%d", len, size);
-		ret = -EIO;
-		goto out;
-	}
-
-	for (i = 0; i < desc->sgl_size; i++) {
-		char *buff = sg_virt(&desc->sgl[i]);
-		int length = desc->sgl[i].length;
-
-		memcpy(buff, xmit_buff, length);
-		xmit_buff += length;
-	}
-	ret = 0;
-out:
-
-	return ret;
-}
-
 /* srb_cdmi_sync(desc, start, end) */
 /*
  * asks the CDMI server to sync from start offset to end offset
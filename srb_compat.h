@@ -0,0 +1,486 @@
+/*
+ * Copyright (C) 2014 SCALITY SA - http://www.scality.com
+ *
+ * This file is part of ScalityRestBlock.
+ *
+ * ScalityRestBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ScalityRestBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ScalityRestBlock.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __SRBLOCK_COMPAT_H__
+# define __SRBLOCK_COMPAT_H__
+
+#include <linux/version.h>
+#include <linux/blkdev.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/timer.h>
+#include <linux/tcp.h>
+#include <net/sock.h>
+#include <net/tcp.h>
+
+/* memalloc_noio_save() moved to linux/sched/mm.h in v4.11 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+# include <linux/sched/mm.h>
+#endif
+
+/*
+ * Supported kernels: v3.10 to v6.8. The queue limits are given along with
+ * the disk allocation since v6.9, which the driver does not do yet.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+# error "Kernels from v6.9 on are not supported yet"
+#endif
+
+/*
+ * Block layer
+ *
+ * blk-mq is used as soon as the kernel provides tag sets along with the
+ * queue_rq(hctx, bd) interface (v3.19). Older kernels keep using the
+ * legacy request_fn interface, which does not exist anymore since v5.0.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+# define SRB_BLK_MQ
+# include <linux/blk-mq.h>
+#endif
+
+/* linux/genhd.h was merged into linux/blkdev.h in v5.18 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+# include <linux/genhd.h>
+#endif
+
+/*
+ * Disks
+ *
+ * blk-mq disks are allocated along with their queue since v5.15, where
+ * alloc_disk went away, add_disk may fail and GENHD_FL_UP makes way for
+ * disk_live. Their queue goes along with the disk since v6.0.
+ */
+#ifdef SRB_BLK_MQ
+static inline struct gendisk *srb_mq_alloc_disk(struct blk_mq_tag_set *set,
+						void *queuedata, int minors)
+{
+	struct gendisk *disk;
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+
+	disk = blk_mq_alloc_disk(set, queuedata);
+	if (IS_ERR(disk))
+		return NULL;
+	disk->minors = minors;
+# else
+	struct request_queue *q;
+
+	disk = alloc_disk(minors);
+	if (!disk)
+		return NULL;
+	q = blk_mq_init_queue(set);
+	if (IS_ERR(q)) {
+		put_disk(disk);
+		return NULL;
+	}
+	q->queuedata = queuedata;
+	disk->queue = q;
+# endif
+
+	return disk;
+}
+#endif /* SRB_BLK_MQ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+# define srb_add_disk(disk)		add_disk(disk)
+# define srb_disk_added(disk)		disk_live(disk)
+/* Taken names make add_disk fail */
+# define srb_disk_name_taken(name)	0
+#else
+static inline int srb_add_disk(struct gendisk *disk)
+{
+	add_disk(disk);
+	return 0;
+}
+# define srb_disk_added(disk)		((disk)->flags & GENHD_FL_UP)
+# define srb_disk_name_taken(name)	blk_lookup_devt(name, 0)
+#endif
+
+/*
+ * Deletes a disk if it was added, once its requests all completed: before
+ * v5.15, del_gendisk does not drain the queue but blk_cleanup_queue does.
+ */
+static inline void srb_del_disk(struct gendisk *disk)
+{
+	if (srb_disk_added(disk))
+		del_gendisk(disk);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
+	if (disk->queue) {
+		blk_cleanup_queue(disk->queue);
+		disk->queue = NULL;
+	}
+#endif
+}
+
+/* Releases a disk, along with its queue */
+static inline void srb_put_disk(struct gendisk *disk)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	put_disk(disk);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	blk_cleanup_disk(disk);
+#else
+	if (disk->queue) {
+		blk_cleanup_queue(disk->queue);
+		disk->queue = NULL;
+	}
+	put_disk(disk);
+#endif
+}
+
+/* open and release are given the disk instead of its block device in v6.5 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+# define SRB_OPEN_ARGS			struct gendisk *disk, blk_mode_t mode
+# define SRB_OPEN_DISK			disk
+# define SRB_RELEASE_ARGS		struct gendisk *disk
+#else
+# define SRB_OPEN_ARGS			struct block_device *bdev, fmode_t mode
+# define SRB_OPEN_DISK			(bdev->bd_disk)
+# define SRB_RELEASE_ARGS		struct gendisk *disk, fmode_t mode
+#endif
+
+/* Class callbacks are given constant class and attribute since v6.4 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+typedef const struct class		srb_class_t;
+typedef const struct class_attribute	srb_class_attr_t;
+#else
+typedef struct class			srb_class_t;
+typedef struct class_attribute		srb_class_attr_t;
+# define SRB_CLASS_OWNER
+#endif
+
+#ifdef SRB_BLK_MQ
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+typedef blk_status_t			srb_mq_ret_t;
+#  define SRB_MQ_RQ_QUEUE_OK		BLK_STS_OK
+#  define SRB_MQ_RQ_QUEUE_ERROR		BLK_STS_IOERR
+#  define srb_errno_to_status(err)	errno_to_blk_status(err)
+# else
+typedef int				srb_mq_ret_t;
+#  define SRB_MQ_RQ_QUEUE_OK		BLK_MQ_RQ_QUEUE_OK
+#  define SRB_MQ_RQ_QUEUE_ERROR		BLK_MQ_RQ_QUEUE_ERROR
+#  define srb_errno_to_status(err)	(err)
+# endif
+
+/* Between v4.2 and v4.14, the completion carried an (unused by us) error */
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0) && \
+     LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+#  define srb_mq_complete_request(rq)	blk_mq_complete_request(rq, 0)
+# else
+#  define srb_mq_complete_request(rq)	blk_mq_complete_request(rq)
+# endif
+/*
+ * Requests may be held until the last one of a dispatch batch since v5.0,
+ * along with commit_rqs telling when a batch is cut short. Before that,
+ * each request is taken as the last one.
+ */
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+#  define SRB_MQ_COMMIT_RQS
+#  define srb_mq_last(bd)		((bd)->last)
+# else
+#  define srb_mq_last(bd)		1
+# endif
+#endif /* SRB_BLK_MQ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+# define srb_rq_is_fs(rq)		(!blk_rq_is_passthrough(rq))
+#else
+# define srb_rq_is_fs(rq)		((rq)->cmd_type == REQ_TYPE_FS)
+#endif
+
+/* REQ_FLUSH became REQ_PREFLUSH and bi_rw became bi_opf in v4.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+# define SRB_REQ_FLUSH			REQ_PREFLUSH
+# define srb_bio_flags(bio)		((bio)->bi_opf)
+#else
+# define SRB_REQ_FLUSH			REQ_FLUSH
+# define srb_bio_flags(bio)		((bio)->bi_rw)
+#endif
+
+/* Flush requests got their own operation in v4.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+# define srb_rq_is_flush(rq)		(req_op(rq) == REQ_OP_FLUSH)
+#else
+# define srb_rq_is_flush(rq)		((rq)->cmd_flags & REQ_FLUSH)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+# define srb_rq_is_discard(rq)		(req_op(rq) == REQ_OP_DISCARD)
+#else
+# define srb_rq_is_discard(rq)		((rq)->cmd_flags & REQ_DISCARD)
+#endif
+
+/* Write zeroes appeared in v4.10, write same went away in v5.18 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+# define srb_rq_is_write_zeroes(rq)	(req_op(rq) == REQ_OP_WRITE_ZEROES)
+# define srb_queue_write_zeroes(q, sectors) \
+	blk_queue_max_write_zeroes_sectors(q, sectors)
+#else
+# define srb_rq_is_write_zeroes(rq)	0
+# define srb_queue_write_zeroes(q, sectors)	do { } while (0)
+#endif
+
+/* Before v4.12, zeroing could not tell whether deallocation was allowed */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+# define srb_rq_nounmap(rq)		((rq)->cmd_flags & REQ_NOUNMAP)
+#else
+# define srb_rq_nounmap(rq)		1
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+# define srb_rq_is_write_same(rq)	0
+# define srb_queue_write_same(q, sectors)	do { } while (0)
+#else
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+#  define srb_rq_is_write_same(rq)	(req_op(rq) == REQ_OP_WRITE_SAME)
+# else
+#  define srb_rq_is_write_same(rq)	((rq)->cmd_flags & REQ_WRITE_SAME)
+# endif
+# define srb_queue_write_same(q, sectors) \
+	blk_queue_max_write_same_sectors(q, sectors)
+#endif
+
+/* Discard support is implied by max_discard_sectors since v5.19 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+# define srb_queue_discard(q, sectors)	\
+	blk_queue_max_discard_sectors(q, sectors)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+# define srb_queue_discard(q, sectors)				\
+	do {							\
+		blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);	\
+		blk_queue_max_discard_sectors(q, sectors);	\
+	} while (0)
+#else
+# define srb_queue_discard(q, sectors)				\
+	do {							\
+		queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);	\
+		blk_queue_max_discard_sectors(q, sectors);	\
+	} while (0)
+#endif
+
+/* Advertises a volatile write cache supporting FUA writes */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+# define srb_queue_write_cache(q)	blk_queue_write_cache(q, true, true)
+#else
+# define srb_queue_write_cache(q)	blk_queue_flush(q, REQ_FLUSH | REQ_FUA)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+# define srb_set_capacity(disk, sectors)	set_capacity_and_notify(disk, sectors)
+#else
+# define srb_set_capacity(disk, sectors)	\
+	do {					\
+		set_capacity(disk, sectors);	\
+		revalidate_disk(disk);		\
+	} while (0)
+#endif
+
+/* prandom_u32 went away in v6.2, get_random_u32 is there since v4.11 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+# define srb_random_u32()		get_random_u32()
+#else
+# define srb_random_u32()		prandom_u32()
+#endif
+
+/*
+ * Timers
+ *
+ * Callbacks are given their timer since v4.15, and their data before. The
+ * del_timer* functions were renamed in v6.2.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+typedef struct timer_list		*srb_timer_arg_t;
+# define srb_timer_setup(timer, fn)	timer_setup(timer, fn, 0)
+# define srb_timer_of(arg)		(arg)
+#else
+typedef unsigned long			srb_timer_arg_t;
+# define srb_timer_setup(timer, fn) \
+	setup_timer(timer, fn, (unsigned long)(timer))
+# define srb_timer_of(arg)		((struct timer_list *)(arg))
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+# define srb_del_timer_sync(timer)	timer_delete_sync(timer)
+#else
+# define srb_del_timer_sync(timer)	del_timer_sync(timer)
+#endif
+
+/*
+ * Tasks
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+# define srb_restore_flags(orig, flags)	current_restore_flags(orig, flags)
+#else
+# define srb_restore_flags(orig, flags)	tsk_restore_flags(current, orig, flags)
+#endif
+
+/*
+ * Dequeues the pending signal of the current task, returning its number
+ * when the kernel still lets us know which one it was (0 otherwise).
+ */
+static inline int srb_dequeue_signal(void)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
+	siginfo_t info;
+
+	return dequeue_signal_lock(current, &current->blocked, &info);
+#else
+	flush_signals(current);
+	return 0;
+#endif
+}
+
+/*
+ * Sockets
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+# define srb_sock_create_kern(family, type, proto, res) \
+	sock_create_kern(&init_net, family, type, proto, res)
+#else
+# define srb_sock_create_kern(family, type, proto, res) \
+	sock_create_kern(family, type, proto, res)
+#endif
+
+static inline int srb_sock_set_nodelay(struct socket *sock)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	tcp_sock_set_nodelay(sock->sk);
+	return 0;
+#else
+	int arg = 1;
+
+	return kernel_setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+				 (char *)&arg, sizeof(arg));
+#endif
+}
+
+/*
+ * Requests TCP Fast Open on connect (v4.11), deferring the handshake to the
+ * first send when a cookie of the server is known. No kernel pointer can be
+ * passed to setsockopt in v5.8.
+ */
+static inline int srb_sock_set_fastopen(struct socket *sock)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	int arg = 1;
+
+	return sock->ops->setsockopt(sock, SOL_TCP, TCP_FASTOPEN_CONNECT,
+				     KERNEL_SOCKPTR(&arg), sizeof(arg));
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0) && \
+      LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+	int arg = 1;
+
+	return kernel_setsockopt(sock, SOL_TCP, TCP_FASTOPEN_CONNECT,
+				 (char *)&arg, sizeof(arg));
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+/* sk_data_ready lost its bytes count argument in v3.15 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+# define SRB_DATA_READY_ARGS		struct sock *sk
+#else
+# define SRB_DATA_READY_ARGS		struct sock *sk, int bytes
+#endif
+
+/*
+ * Hands a page range over to the socket without copying it. kernel_sendpage
+ * went away in v6.5 in favor of MSG_SPLICE_PAGES. Slab pages cannot be
+ * referenced by skbs and must be copied instead.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+static inline int srb_sock_sendpage(struct socket *sock, struct page *page,
+				    int offset, size_t size, int flags)
+{
+	struct msghdr msg = { .msg_flags = flags | MSG_SPLICE_PAGES };
+	struct bio_vec bvec;
+
+	bvec_set_page(&bvec, page, size, offset);
+	iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, &bvec, 1, size);
+
+	return sock_sendmsg(sock, &msg);
+}
+#else
+# define srb_sock_sendpage(sock, page, offset, size, flags) \
+	kernel_sendpage(sock, page, offset, size, flags)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+# define srb_sendpage_ok(page)		sendpage_ok(page)
+#else
+# define srb_sendpage_ok(page)		(!PageSlab(page) && page_count(page) >= 1)
+#endif
+
+/*
+ * Shrinkers: a single shrink callback until v3.12, then separate count and
+ * scan ones. They are named since v6.0, and allocated by the shrinker core
+ * since v6.7.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
+# define SRB_SHRINKER_SCAN
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+# define SRB_SHRINKER_ALLOC
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+# define srb_register_shrinker(s, name)	register_shrinker(s, name)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
+# define srb_register_shrinker(s, name)	register_shrinker(s)
+#else
+# define srb_register_shrinker(s, name)	(register_shrinker(s), 0)
+#endif
+
+/*
+ * Reads or writes at a position of a file from the kernel. The position is
+ * passed by reference since v4.14.
+ */
+static inline ssize_t srb_kernel_read(struct file *file, void *buf,
+				      size_t count, loff_t pos)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	return kernel_read(file, buf, count, &pos);
+#else
+	return kernel_read(file, pos, buf, count);
+#endif
+}
+
+static inline ssize_t srb_kernel_write(struct file *file, const void *buf,
+				       size_t count, loff_t pos)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	return kernel_write(file, buf, count, &pos);
+#else
+	return kernel_write(file, buf, count, pos);
+#endif
+}
+
+/* Sets both send and receive timeouts of the socket, in seconds (0: none) */
+static inline void srb_sock_set_timeout(struct socket *sock,
+					unsigned int timeout)
+{
+	struct sock *sk = sock->sk;
+	long t = timeout ? timeout * HZ : MAX_SCHEDULE_TIMEOUT;
+
+	lock_sock(sk);
+	sk->sk_rcvtimeo = t;
+	sk->sk_sndtimeo = t;
+	release_sock(sk);
+}
+
+#endif /* ! __SRBLOCK_COMPAT_H__ */
@@ -33,7 +33,8 @@
 #include <linux/blkdev.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h> // for vmalloc()
-#include <linux/kthread.h>
+#include <linux/timer.h>
+#include <linux/math64.h>
 #include <linux/version.h>
 #include <linux/string.h>
 
@@ -58,6 +59,12 @@ unsigned short req_timeout = SRB_REQ_TIMEOUT_DFLT;
 unsigned short nb_req_retries = SRB_NB_REQ_RETRIES_DFLT;
 unsigned short server_conn_timeout = SRB_CONN_TIMEOUT_DFLT;
 unsigned int thread_pool_size = SRB_THREAD_POOL_SIZE_DFLT;
+unsigned int pipeline_depth = SRB_PIPELINE_DEPTH_DFLT;
+unsigned int max_io_size = SRB_MAX_IO_SIZE_DFLT / kB;
+unsigned short zero_copy = SRB_ZERO_COPY_DFLT;
+unsigned short tcp_fastopen = SRB_TCP_FASTOPEN_DFLT;
+unsigned int split_size = SRB_SPLIT_SIZE_DFLT / kB;
+unsigned int split_fanout = SRB_SPLIT_FANOUT_DFLT;
 MODULE_PARM_DESC(debug, "Global log level for ScalityRestBlock LKM");
 module_param_named(debug, srb_log, ushort, 0644);
 
@@ -70,9 +77,27 @@ module_param(nb_req_retries, ushort, 0644);
 MODULE_PARM_DESC(server_conn_timeout, "Global timeout for connection to server(s)");
 module_param(server_conn_timeout, ushort, 0644);
 
-MODULE_PARM_DESC(thread_pool_size, "Size of the thread pool");
+MODULE_PARM_DESC(thread_pool_size, "Maximum number of connections to each server");
 module_param(thread_pool_size, uint, 0444);
 
+MODULE_PARM_DESC(pipeline_depth, "Number of requests in flight on each server connection");
+module_param(pipeline_depth, uint, 0444);
+
+MODULE_PARM_DESC(max_io_size, "Default maximum request size of new devices (kB)");
+module_param(max_io_size, uint, 0644);
+
+MODULE_PARM_DESC(zero_copy, "Send the written pages to the server without copying them");
+module_param(zero_copy, ushort, 0644);
+
+MODULE_PARM_DESC(tcp_fastopen, "Use TCP Fast Open when connecting to the servers");
+module_param(tcp_fastopen, ushort, 0644);
+
+MODULE_PARM_DESC(split_size, "Smallest piece of a request sent on its own (kB, 0: no split)");
+module_param(split_size, uint, 0644);
+
+MODULE_PARM_DESC(split_fanout, "Maximum number of pieces of a request sent concurrently");
+module_param(split_fanout, uint, 0644);
+
 /* XXX: Request mapping
  */
 static char *req_code_to_str(int code)
@@ -80,9 +105,11 @@ static char *req_code_to_str(int code)
 	switch (code) {
 		case READ: return "READ"; break;
 		case WRITE: return "WRITE"; break;
+#ifdef WRITE_FLUSH /* Gone in 4.10 */
 		case WRITE_FLUSH: return "WRITE_FLUSH"; break;
 		case WRITE_FUA: return "WRITE_FUA"; break;
 		case WRITE_FLUSH_FUA: return "WRITE_FLUSH_FUA"; break;
+#endif
 		default: return "UNKNOWN";
 	}
 }
@@ -93,6 +120,11 @@ static int req_flags_to_str(int flags, char *buff)
 	int size = 0;
 	buff[0] = '\0';
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+	/* Request flags were split between operations and flags in 4.8 */
+	size = snprintf(buff, 256, "0x%x", (unsigned int)flags);
+#else
+
 	// detect common flags
 	if (flags == REQ_COMMON_MASK) {
 		strncpy(buff, "REQ_COMMON_MASK", 15);
@@ -248,214 +280,1109 @@ static int req_flags_to_str(int flags, char *buff)
 #endif
 	if (size != 0)
 		buff[size-1] = '\0';
+#endif
 
 	return size;
 }
 
 
 /*
- * Handle an I/O request.
+ * Free internal disk
  */
-static int srb_xfer_scl(struct srb_device_s *dev,
-		struct srb_cdmi_desc_s *desc,
-		struct request *req)
+static int srb_free_disk(struct srb_device_s *dev)
 {
-	int ret = 0;
-	struct timeval tv_start;
-	struct timeval tv_end;
+	struct gendisk *disk = NULL;
+
+	disk = dev->disk;
+	if (!disk) {
+		SRBDEV_LOG_ERR(dev, "Disk is not available anymore (%s)", dev->name);
+		return -EINVAL;
+	}
+	dev->disk = NULL;
+
+	/* free disk, once its requests all completed */
+	srb_del_disk(disk);
+	dev->q = NULL;
+
+	/* The losing legs of hedged reads may still be on their connections */
+	wait_event(dev->legs_wait, atomic_read(&dev->nb_legs) == 0);
+	/* Requests all completed: the log and extents can be written back */
+	srb_wblog_close(dev);
+	srb_wback_stop(dev);
+	/* So may readaheads, which hold their chunks until then */
+	srb_ra_configure(dev, 0, 0);
+	srb_cache_device_cleanup(dev);
+	srb_zmap_device_cleanup(dev);
+
+	/* The queue goes first, its requests use the tag set or pool */
+	srb_put_disk(disk);
+#ifdef SRB_BLK_MQ
+	if (dev->tag_set.tags)
+		blk_mq_free_tag_set(&dev->tag_set);
+#else
+	if (dev->cmd_pool) {
+		mempool_destroy(dev->cmd_pool);
+		dev->cmd_pool = NULL;
+	}
+#endif
+
+	return 0;
+}
+
+/* Size of a command, along with its scatterlist */
+static inline size_t srb_cmd_size(struct srb_device_s *dev)
+{
+	return sizeof(struct srb_cmd_s) +
+		dev->max_segs * sizeof(struct scatterlist);
+}
 
-	SRBDEV_LOG_DEBUG(dev, "CDMI request %p (%s) with cdmi_desc %p",
-			 req, req_code_to_str(rq_data_dir(req)), desc);
+/*
+ * Flushes
+ *
+ * Writes are completed once the server acknowledged them, so a single
+ * server-side sync makes them all durable. Each flush closes the current
+ * epoch of writes: its sync is only sent once the writes of its epoch (and
+ * of the earlier ones) completed, without waiting for the writes submitted
+ * after it.
+ */
 
-	if (SRB_DEBUG <= dev->debug.level)
-		do_gettimeofday(&tv_start);
+/* Commands a flush must wait for */
+static inline int srb_cmd_is_write(struct srb_cmd_s *cmd)
+{
+	return cmd->op != SRB_CMD_READ && cmd->op != SRB_CMD_SYNC;
+}
 
-	if (rq_data_dir(req) == WRITE) {
-		ret = srb_cdmi_putrange(&dev->debug,
-					desc,
-					blk_rq_pos(req) * 512ULL,
-					blk_rq_sectors(req) * 512ULL);
+/*
+ * Picks the path of a request among the device's servers: the least loaded
+ * of two drawn at random, which spreads the load without herding all the
+ * devices onto the same server.
+ *
+ * Servers deemed down are left out, along with the avoid path (-1 for none)
+ * the request just failed on, as long as another path remains.
+ */
+static int srb_pick_path(struct srb_device_s *dev, int avoid)
+{
+	int cand[DEV_MAX_PATHS];
+	int healthy;
+	int nb = 0;
+	int a, b;
+	int i;
+
+	for (healthy = 1; healthy >= 0 && nb == 0; healthy--) {
+		for (i = 0; i < dev->nb_paths; i++) {
+			if (i != avoid && (!healthy ||
+			    srb_engine_pool_healthy(dev->paths[i].pool)))
+				cand[nb++] = i;
+		}
+		if (nb == 0 && avoid >= 0 && (!healthy ||
+		    srb_engine_pool_healthy(dev->paths[avoid].pool)))
+			return avoid;
 	}
-	else {
-		ret = srb_cdmi_getrange(&dev->debug,
-					desc,
-					blk_rq_pos(req) * 512ULL,
-					blk_rq_sectors(req) * 512ULL);
+
+	if (nb <= 1)
+		return nb ? cand[0] : 0;
+
+	a = srb_random_u32() % nb;
+	b = srb_random_u32() % (nb - 1);
+	if (b >= a)
+		b++;
+	a = cand[a];
+	b = cand[b];
+
+	return srb_engine_pool_load(dev->paths[a].pool) <=
+		srb_engine_pool_load(dev->paths[b].pool) ? a : b;
+}
+
+static void srb_path_submit(struct srb_device_s *dev, struct srb_cmd_s *cmd,
+			    int path)
+{
+	cmd->path = path;
+	cmd->tmpl = &dev->paths[path].http_tmpl;
+	/* Whether the server's hole hint still holds (see srb_zmap_hint) */
+	if (cmd->op == SRB_CMD_READ)
+		cmd->zmap_wseq = srb_zmap_seq(dev);
+	srb_engine_submit(dev->paths[path].pool, cmd);
+}
+
+/*
+ * Sends a command of the driver's own (see srb_ra_read) through a path of
+ * the device, or the one srb_pick_path picks if path is -1 or its server is
+ * down.
+ */
+void srb_send(struct srb_device_s *dev, struct srb_cmd_s *cmd, int path)
+{
+	if (path < 0 || !srb_engine_pool_healthy(dev->paths[path].pool))
+		path = srb_pick_path(dev, path);
+	srb_path_submit(dev, cmd, path);
+}
+
+/*
+ * Sends a command of the driver's own like srb_send, and waits for it to
+ * complete: the I/O of the write-back tiers, into or from the pages of sgl
+ * (nr_sgl entries).
+ */
+int srb_send_wait(struct srb_device_s *dev, enum srb_cmd_op op, int fua,
+		  uint64_t offset, int size, struct scatterlist *sgl, int nr_sgl,
+		  int path)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct srb_cmd_s *cmd;
+	int ret;
+
+	cmd = kzalloc(sizeof(*cmd), GFP_NOIO);
+	if (!cmd)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&cmd->list);
+	cmd->kind	= SRB_CMD_WAITED;
+	cmd->dev	= dev;
+	cmd->op		= op;
+	cmd->fua	= fua;
+	cmd->offset	= offset;
+	cmd->size	= size;
+	cmd->done	= &done;
+	cmd->sgl	= sgl;
+	cmd->sgl_size	= nr_sgl;
+
+	srb_zmap_write_start(dev, cmd);
+	srb_send(dev, cmd, path);
+	wait_for_completion(&done);
+	ret = cmd->error;
+	srb_zmap_write_end(dev, cmd, ret);
+	kfree(cmd);
+
+	return ret;
+}
+
+/*
+ * Hedged reads
+ *
+ * A read still waiting for its response after the device's hedge_threshold
+ * is sent a second time, to another server if possible. Both legs race for
+ * the request's pages: the first one to get its response header fills them
+ * and completes the request, the other one throws its body away, or is not
+ * sent at all if it is still queued. Legs are commands of their own, so the
+ * request does not wait for the losing leg to leave its connection.
+ */
+static struct srb_cmd_s *srb_leg_alloc(struct srb_cmd_s *cmd)
+{
+	struct srb_cmd_s *leg;
+
+	/* Hedging is best effort: requests are submitted in atomic context */
+	leg = kzalloc(sizeof(*leg), GFP_NOWAIT | __GFP_NOWARN);
+	if (!leg)
+		return NULL;
+
+	INIT_LIST_HEAD(&leg->list);
+	leg->kind	= SRB_CMD_LEG;
+	leg->dev	= cmd->dev;
+	leg->parent	= cmd;
+	leg->op		= SRB_CMD_READ;
+	leg->offset	= cmd->offset;
+	leg->size	= cmd->size;
+	leg->sgl	= cmd->sgl;
+	leg->sgl_size	= cmd->sgl_size;
+	leg->path	= -1;
+	atomic_inc(&cmd->dev->nb_legs);
+
+	return leg;
+}
+
+static void srb_leg_free(struct srb_cmd_s *leg)
+{
+	struct srb_device_s *dev = leg->dev;
+
+	kfree(leg);
+	if (atomic_dec_and_test(&dev->nb_legs))
+		wake_up(&dev->legs_wait);
+}
+
+/*
+ * Ends a leg: the request completes along with the leg owning its pages, or
+ * with the last leg left when they all failed. Other legs are just freed.
+ *
+ * If retry is set, the leg's connection failed, and the leg is only freed
+ * if the request does not depend on it.
+ *
+ * Returns 1 if the leg is to be sent again, 0 if it was ended.
+ */
+static int srb_leg_end(struct srb_cmd_s *leg, int error, int retry)
+{
+	struct srb_device_s *dev = leg->dev;
+	struct srb_cmd_s *cmd;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&dev->hedge_lock, flags);
+	cmd = leg->parent;
+	if (cmd && (cmd->owner == leg || (error && cmd->nb_legs == 1))) {
+		if (retry) {
+			spin_unlock_irqrestore(&dev->hedge_lock, flags);
+			return 1;
+		}
+		if (!error && leg == cmd->legs[1])
+			dev->hedges_won++;
+		for (i = 0; i < 2; i++) {
+			if (cmd->legs[i] && cmd->legs[i] != leg) {
+				cmd->legs[i]->parent = NULL;
+				cmd->legs[i]->cancelled = 1;
+			}
+			cmd->legs[i] = NULL;
+		}
+		cmd->nb_legs = 0;
+	} else {
+		for (i = 0; cmd && i < 2; i++) {
+			if (cmd->legs[i] == leg) {
+				cmd->legs[i] = NULL;
+				cmd->nb_legs--;
+			}
+		}
+		cmd = NULL;
 	}
+	spin_unlock_irqrestore(&dev->hedge_lock, flags);
 
-	if (SRB_DEBUG <= dev->debug.level) {
-		do_gettimeofday(&tv_end);
-		SRBDEV_LOG_DEBUG(dev, "Request took %ldms",
-				 (tv_end.tv_sec - tv_start.tv_sec)*1000 +
-				 (tv_end.tv_usec - tv_start.tv_usec)/1000);
+	srb_leg_free(leg);
+	if (cmd) {
+		srb_del_timer_sync(&cmd->hedge_timer);
+		srb_end_request(cmd->req, error);
 	}
 
-	if (ret) {
-		SRBDEV_LOG_ERR(dev, "CDMI Request using scatterlist failed"
-			       " with IO error: %d", ret);
-		return -EIO;
+	return 0;
+}
+
+/* Sends the hedge leg of a read which did not get its response in time */
+static void srb_hedge_timeout(srb_timer_arg_t arg)
+{
+	struct srb_cmd_s *cmd = container_of(srb_timer_of(arg),
+					     struct srb_cmd_s, hedge_timer);
+	struct srb_device_s *dev = cmd->dev;
+	struct srb_cmd_s *leg = NULL;
+	unsigned long flags;
+	int path = -1;
+
+	spin_lock_irqsave(&dev->hedge_lock, flags);
+	if (cmd->nb_legs == 1 && !cmd->owner &&
+	    dev->window_hedges * 100 < dev->hedge_budget * dev->window_reads) {
+		leg = srb_leg_alloc(cmd);
+		if (leg) {
+			path = cmd->legs[0]->path;
+			cmd->legs[1] = leg;
+			cmd->nb_legs++;
+			dev->window_hedges++;
+			dev->hedges_issued++;
+		}
 	}
+	spin_unlock_irqrestore(&dev->hedge_lock, flags);
 
-	return ret;
+	if (leg) {
+		SRBDEV_LOG_DEBUG(dev, "Hedging read of %d bytes at %llu away from server %d",
+				 cmd->size, (unsigned long long)cmd->offset, path);
+		srb_path_submit(dev, leg, srb_pick_path(dev, path));
+	}
 }
 
 /*
- * Free internal disk
+ * Sends a read through its primary leg, with the timer sending the hedge
+ * one. Returns 0 if the read is not to be hedged.
  */
-static int srb_free_disk(struct srb_device_s *dev)
+static int srb_hedge_arm(struct srb_device_s *dev, struct srb_cmd_s *cmd)
 {
-	struct gendisk *disk = NULL;
+	unsigned int threshold = dev->hedge_threshold;
+	struct srb_cmd_s *leg;
+
+	if (!threshold)
+		return 0;
+	leg = srb_leg_alloc(cmd);
+	if (!leg)
+		return 0;
+
+	cmd->legs[0] = leg;
+	cmd->legs[1] = NULL;
+	cmd->owner = NULL;
+	cmd->nb_legs = 1;
+	srb_timer_setup(&cmd->hedge_timer, srb_hedge_timeout);
+	mod_timer(&cmd->hedge_timer, jiffies + usecs_to_jiffies(threshold));
+	srb_path_submit(dev, leg, srb_pick_path(dev, -1));
+
+	return 1;
+}
 
-	disk = dev->disk;
-	if (!disk) {
-		SRBDEV_LOG_ERR(dev, "Disk is not available anymore (%s)", dev->name);
-		return -EINVAL;
+/*
+ * Tells whether a read whose response header arrived may fill the pages of
+ * its request: the first leg of a hedged read getting there keeps them, and
+ * the other one is not sent anymore if it is still queued.
+ */
+int srb_read_claim(struct srb_cmd_s *cmd)
+{
+	struct srb_device_s *dev = cmd->dev;
+	struct srb_cmd_s *parent;
+	unsigned long flags;
+	int claimed;
+	int i;
+
+	if (cmd->kind != SRB_CMD_LEG)
+		return 1;
+
+	spin_lock_irqsave(&dev->hedge_lock, flags);
+	parent = cmd->parent;
+	claimed = parent && (!parent->owner || parent->owner == cmd);
+	if (claimed && !parent->owner) {
+		parent->owner = cmd;
+		for (i = 0; i < 2; i++) {
+			if (parent->legs[i] && parent->legs[i] != cmd)
+				parent->legs[i]->cancelled = 1;
+		}
 	}
-	dev->disk = NULL;
+	spin_unlock_irqrestore(&dev->hedge_lock, flags);
+
+	return claimed;
+}
 
-	/* free disk */
-	if (disk->flags & GENHD_FL_UP) {
-		del_gendisk(disk);
-		if (disk->queue)
-			blk_cleanup_queue(disk->queue);
+/*
+ * Threshold following the hedge_percentile of the read latency histogram,
+ * interpolated within its bucket. hedge_lock held.
+ */
+static unsigned int __srb_hedge_threshold(struct srb_device_s *dev)
+{
+	unsigned int total = 0;
+	unsigned int below = 0;
+	unsigned int target;
+	unsigned int lo, hi;
+	int i;
+
+	for (i = 0; i < SRB_HEDGE_BUCKETS; i++)
+		total += dev->lat_hist[i];
+	target = total * dev->hedge_percentile / 100;
+
+	for (i = 0; i < SRB_HEDGE_BUCKETS - 1; i++) {
+		if (below + dev->lat_hist[i] > target)
+			break;
+		below += dev->lat_hist[i];
 	}
+	if (!dev->lat_hist[i])
+		return 1U << i;
 
-	put_disk(disk);
+	/* Bucket i holds the latencies of [2^(i-1), 2^i[ us */
+	lo = i ? 1U << (i - 1) : 0;
+	hi = 1U << i;
 
-	return 0;
+	return max_t(unsigned int, 1, lo + div_u64((u64)(hi - lo) *
+				(target - below), dev->lat_hist[i]));
 }
 
 /*
- * Thread for srb
+ * Accounts for a completed read: it widens the hedge budget, and its latency
+ * moves the threshold when it follows a percentile. The histogram is halved
+ * at each update, so that it forgets the old latencies.
  */
-static int srb_thread(void *data)
+static void srb_hedge_account(struct srb_device_s *dev, s64 latency)
 {
-	struct srb_device_s *dev;
-	struct request *req;
 	unsigned long flags;
-	int th_id;
-	int th_ret = 0;
-	char buff[256];
-	struct req_iterator iter;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-	struct bio_vec *bvec;
-#else
-	struct bio_vec bvec;
-#endif
-	struct srb_cdmi_desc_s *cdmi_desc;
+	int i;
 
-	SRBDEV_LOG_DEBUG(((struct srb_device_s *)data), "Thread started with device %p", data);
+	spin_lock_irqsave(&dev->hedge_lock, flags);
+	if (++dev->window_reads >= SRB_HEDGE_WINDOW) {
+		dev->window_reads /= 2;
+		dev->window_hedges /= 2;
+	}
+	if (dev->hedge_percentile) {
+		i = latency > 0 ? fls((u32)min_t(s64, latency, UINT_MAX)) : 0;
+		dev->lat_hist[min(i, SRB_HEDGE_BUCKETS - 1)]++;
+		if (++dev->lat_samples >= SRB_HEDGE_SAMPLES) {
+			dev->hedge_threshold = __srb_hedge_threshold(dev);
+			dev->lat_samples = 0;
+			for (i = 0; i < SRB_HEDGE_BUCKETS; i++)
+				dev->lat_hist[i] -= dev->lat_hist[i] / 2;
+		}
+	}
+	spin_unlock_irqrestore(&dev->hedge_lock, flags);
+}
 
-	dev = data;
+/* Pins the hedge threshold (in us, 0 disables hedging) */
+void srb_hedge_set_threshold(struct srb_device_s *dev, unsigned int threshold)
+{
+	unsigned long flags;
 
-	/* Init thread specific values */
-	spin_lock(&devtab_lock);
-	th_id = dev->nb_threads;
-	dev->nb_threads++;
-	spin_unlock(&devtab_lock);
+	spin_lock_irqsave(&dev->hedge_lock, flags);
+	dev->hedge_percentile = 0;
+	dev->hedge_threshold = threshold;
+	spin_unlock_irqrestore(&dev->hedge_lock, flags);
+}
 
-	set_user_nice(current, -20);
-	while (!kthread_should_stop() || !list_empty(&dev->waiting_queue)) {
-		/* wait for something to do */
-		wait_event_interruptible(dev->waiting_wq,
-					kthread_should_stop() ||
-					!list_empty(&dev->waiting_queue));
-
-		/* TODO: improve kthread termination, otherwise calling we can not
-		  terminate a kthread calling kthread_stop() */
-		/* if (kthread_should_stop()) {
-			printk(KERN_INFO "srb_thread: immediate kthread exit\n");
-			do_exit(0);
-		} */
-
-		spin_lock_irqsave(&dev->waiting_lock, flags);
-		/* extract request */
-		if (list_empty(&dev->waiting_queue)) {
-			spin_unlock_irqrestore(&dev->waiting_lock, flags);
-			continue;
+/*
+ * Makes the hedge threshold follow a percentile of the read latency (0
+ * disables hedging). Hedging stops until enough reads were observed.
+ */
+void srb_hedge_set_percentile(struct srb_device_s *dev, unsigned int percentile)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->hedge_lock, flags);
+	dev->hedge_percentile = percentile;
+	dev->hedge_threshold = 0;
+	memset(dev->lat_hist, 0, sizeof(dev->lat_hist));
+	dev->lat_samples = 0;
+	spin_unlock_irqrestore(&dev->hedge_lock, flags);
+}
+
+/*
+ * Striped requests
+ *
+ * A read or write larger than split_size is cut into up to split_fanout
+ * pieces, each a ranged GET or PUT of its own. The pieces are spread over
+ * the device's servers and their connections like any request, so that a
+ * single large request is not bound to one TCP stream, and each piece is
+ * retried on its own. The request completes along with its last piece.
+ */
+
+/*
+ * Fills sgl with the segments of the request holding its payload bytes
+ * [start, start + size[, if sgl is set.
+ *
+ * Returns the number of segments.
+ */
+static int srb_split_sgl(struct srb_cmd_s *cmd, int start, int size,
+			 struct scatterlist *sgl)
+{
+	struct scatterlist *sg;
+	int pos = 0;
+	int nr = 0;
+	int skip;
+	int len;
+	int i;
+
+	for (i = 0; i < cmd->sgl_size && pos < start + size; i++) {
+		sg = &cmd->sgl[i];
+		if (pos + sg->length > start) {
+			skip = pos < start ? start - pos : 0;
+			len = min_t(int, sg->length - skip, start + size - pos - skip);
+			if (sgl)
+				sg_set_page(&sgl[nr], sg_page(sg), len,
+					    sg->offset + skip);
+			nr++;
 		}
-		req = list_entry(dev->waiting_queue.next, struct request,
-				queuelist);
-		list_del_init(&req->queuelist);
-		spin_unlock_irqrestore(&dev->waiting_lock, flags);
-		
-		if (blk_rq_sectors(req) == 0) {
-			blk_end_request_all(req, 0);
-			continue;
+		pos += sg->length;
+	}
+
+	return nr;
+}
+
+static struct srb_cmd_s *srb_piece_alloc(struct srb_cmd_s *cmd, int start,
+					 int size)
+{
+	struct srb_cmd_s *piece;
+	int nr = srb_split_sgl(cmd, start, size, NULL);
+
+	piece = kzalloc(sizeof(*piece) + nr * sizeof(struct scatterlist),
+			GFP_NOWAIT | __GFP_NOWARN);
+	if (!piece)
+		return NULL;
+
+	INIT_LIST_HEAD(&piece->list);
+	piece->dev	= cmd->dev;
+	piece->parent	= cmd;
+	piece->kind	= SRB_CMD_PIECE;
+	piece->op	= cmd->op;
+	piece->fua	= cmd->fua;
+	piece->offset	= cmd->offset + start;
+	piece->size	= size;
+	piece->sgl	= (struct scatterlist *)(piece + 1);
+	piece->sgl_size	= nr;
+	sg_init_table(piece->sgl, nr);
+	srb_split_sgl(cmd, start, size, piece->sgl);
+
+	return piece;
+}
+
+static void srb_piece_end(struct srb_cmd_s *piece, int error)
+{
+	struct srb_cmd_s *cmd = piece->parent;
+
+	if (error) {
+		SRBDEV_LOG_DEBUG(piece->dev, "Piece of %d bytes at %llu failed: %d",
+				 piece->size, (unsigned long long)piece->offset,
+				 error);
+		cmd->split_error = error;
+	}
+	kfree(piece);
+	if (atomic_dec_and_test(&cmd->nb_pieces))
+		srb_end_request(cmd->req, cmd->split_error);
+}
+
+/*
+ * Sends a large read or write as pieces of at least split_size bytes, all
+ * of them at once. Returns 0 if the request is to be sent as a whole.
+ */
+static int srb_split_submit(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	struct srb_cmd_s *pieces[SRB_SPLIT_FANOUT_MAX];
+	unsigned int fanout = min_t(unsigned int, split_fanout,
+				    SRB_SPLIT_FANOUT_MAX);
+	unsigned long min_size = (unsigned long)split_size * kB;
+	int piece_size;
+	int nb;
+	int i;
+
+	if (!min_size || fanout < 2 || cmd->size <= min_size)
+		return 0;
+
+	piece_size = max_t(unsigned long, min_size,
+			   ALIGN(DIV_ROUND_UP(cmd->size, fanout), PAGE_SIZE));
+	nb = DIV_ROUND_UP(cmd->size, piece_size);
+	if (nb < 2)
+		return 0;
+
+	for (i = 0; i < nb; i++) {
+		pieces[i] = srb_piece_alloc(cmd, i * piece_size,
+					    min(piece_size,
+						cmd->size - i * piece_size));
+		if (!pieces[i]) {
+			while (i-- > 0)
+				kfree(pieces[i]);
+			return 0;
 		}
+	}
 
-		req_flags_to_str(req->cmd_flags, buff);
-		SRBDEV_LOG_DEBUG(dev, "thread %d: New REQ of type %s (%d) flags: %s (%llu)",
-				 th_id, req_code_to_str(rq_data_dir(req)), rq_data_dir(req), buff,
-                                 (unsigned long long)req->cmd_flags);
-		if (req->cmd_flags & REQ_FLUSH) {
-			SRBDEV_LOG_DEBUG(dev, "DEBUG CMD REQ_FLUSH\n");
+	SRBDEV_LOG_DEBUG(dev, "Splitting request of %d bytes at %llu in %d pieces",
+			 cmd->size, (unsigned long long)cmd->offset, nb);
+	cmd->split_error = 0;
+	atomic_set(&cmd->nb_pieces, nb);
+	for (i = 0; i < nb; i++)
+		srb_path_submit(dev, pieces[i], srb_pick_path(dev, -1));
+
+	return 1;
+}
+
+/*
+ * Sends the sync of the flush's current leg to its server, or to another
+ * one if it is down: the servers hold the same repository.
+ */
+static void srb_sync_submit(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	int path = cmd->sync_leg;
+
+	if (!srb_engine_pool_healthy(dev->paths[path].pool))
+		path = srb_pick_path(dev, path);
+	srb_path_submit(dev, cmd, path);
+}
+
+/*
+ * Sends a command again after its connection failed, through another of
+ * the device's servers if possible.
+ */
+void srb_resubmit(struct srb_cmd_s *cmd)
+{
+	struct srb_device_s *dev = cmd->dev;
+
+	/* Hedged reads only retry the leg their request depends on */
+	if (cmd->kind == SRB_CMD_LEG && !srb_leg_end(cmd, -EIO, 1))
+		return;
+
+	SRBDEV_LOG_DEBUG(dev, "Resubmitting request (attempt %d) away from server %d",
+			 cmd->attempts, cmd->path);
+	srb_path_submit(dev, cmd, srb_pick_path(dev, cmd->path));
+}
+
+/* Moves the flushes not waiting for any write anymore. flush_lock held. */
+static void __srb_flush_ready(struct srb_device_s *dev, struct list_head *ready)
+{
+	struct srb_cmd_s *cmd;
+
+	while (!list_empty(&dev->flushes)) {
+		cmd = list_first_entry(&dev->flushes, struct srb_cmd_s, list);
+		if (cmd->wait_writes > 0)
+			break;
+		list_move_tail(&cmd->list, ready);
+	}
+}
+
+static void srb_flush_dispatch(struct srb_device_s *dev, struct list_head *ready)
+{
+	struct srb_cmd_s *cmd, *tmp;
+
+	list_for_each_entry_safe(cmd, tmp, ready, list) {
+		list_del_init(&cmd->list);
+		SRBDEV_LOG_DEBUG(dev, "Sending sync of flush epoch %lu", cmd->epoch);
+		/* Each server is synced in turn (see srb_end_request) */
+		cmd->sync_leg = 0;
+		srb_sync_submit(dev, cmd);
+	}
+}
+
+void srb_flush_submit(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	unsigned long flags;
+	LIST_HEAD(ready);
+
+	spin_lock_irqsave(&dev->flush_lock, flags);
+	cmd->epoch = dev->flush_epoch++;
+	cmd->wait_writes = dev->epoch_writes;
+	dev->epoch_writes = 0;
+	list_add_tail(&cmd->list, &dev->flushes);
+	__srb_flush_ready(dev, &ready);
+	spin_unlock_irqrestore(&dev->flush_lock, flags);
+
+	srb_flush_dispatch(dev, &ready);
+}
+
+static void srb_flush_write_start(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->flush_lock, flags);
+	cmd->epoch = dev->flush_epoch;
+	dev->epoch_writes++;
+	spin_unlock_irqrestore(&dev->flush_lock, flags);
+}
+
+static void srb_flush_write_end(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	struct srb_cmd_s *flush;
+	unsigned long flags;
+	LIST_HEAD(ready);
+
+	spin_lock_irqsave(&dev->flush_lock, flags);
+	if (cmd->epoch == dev->flush_epoch) {
+		dev->epoch_writes--;
+	} else {
+		list_for_each_entry(flush, &dev->flushes, list) {
+			if (flush->epoch == cmd->epoch) {
+				flush->wait_writes--;
+				break;
+			}
 		}
-		/* XXX: Use iterator instead of internal function (cf linux/blkdev.h)
-		 *  __rq_for_each_bio(bio, req) {
-		 */
-		rq_for_each_segment(bvec, req, iter) {
-			if (iter.bio->bi_rw & REQ_FLUSH) {
-				SRBDEV_LOG_DEBUG(dev, "DEBUG VR BIO REQ_FLUSH\n");
+		__srb_flush_ready(dev, &ready);
+	}
+	spin_unlock_irqrestore(&dev->flush_lock, flags);
+
+	srb_flush_dispatch(dev, &ready);
+}
+
+/*
+ * Completes a request. With blk-mq, the completion is bounced back to the
+ * CPU which submitted the request (see srb_mq_complete).
+ *
+ * The writes of a device go to all of its servers, so a flush completes
+ * once each of them was synced.
+ */
+void srb_end_request(struct request *req, int error)
+{
+	struct srb_device_s *dev = req->q->queuedata;
+#ifdef SRB_BLK_MQ
+	struct srb_cmd_s *cmd = blk_mq_rq_to_pdu(req);
+#else
+	struct srb_cmd_s *cmd = req->special;
+#endif
+
+	if (cmd->op == SRB_CMD_SYNC && !error &&
+	    ++cmd->sync_leg < dev->nb_paths) {
+		srb_sync_submit(dev, cmd);
+		return;
+	}
+
+	if (srb_cmd_is_write(cmd)) {
+		/* Even failed, the write may have reached the servers */
+		srb_ra_invalidate(dev, cmd->offset, cmd->size);
+		srb_cache_write(dev, cmd, error);
+		srb_zmap_write_end(dev, cmd, error);
+		srb_flush_write_end(dev, cmd);
+	} else if (cmd->op == SRB_CMD_READ && !error && blk_rq_bytes(req) &&
+		   !cmd->local) {
+		srb_cache_fill(dev, cmd);
+		if (dev->hedge_threshold || dev->hedge_percentile)
+			srb_hedge_account(dev, ktime_us_delta(ktime_get(),
+							      cmd->submitted));
+	}
+#ifdef SRB_BLK_MQ
+	cmd->error = error;
+	srb_mq_complete_request(req);
+#else
+	blk_end_request_all(req, error);
+	mempool_free(cmd, dev->cmd_pool);
+#endif
+}
+
+/*
+ * Coalescing
+ *
+ * The reads and writes a blk-mq batch (or a run of the legacy request_fn)
+ * hands over are held on their queue until its end. Contiguous ones of the
+ * same direction, which the block layer did not merge (past its request
+ * size limit, or from different submitters), are then sent as a single
+ * ranged GET or PUT, up to the size of a request piece (see split_size) or
+ * the device's max_io_size. Each request is completed on its own, along
+ * with the batch.
+ */
+static void srb_batch_end(struct srb_cmd_s *batch, int error)
+{
+	struct srb_cmd_s *cmd, *tmp;
+
+	list_for_each_entry_safe(cmd, tmp, &batch->members, list) {
+		list_del_init(&cmd->list);
+		srb_end_request(cmd->req, error);
+	}
+	kfree(batch);
+}
+
+/*
+ * Sends coalesced requests as one command, whose scatterlist chains theirs.
+ * Returns 0 if they are to be sent one by one.
+ */
+static int srb_batch_submit(struct srb_device_s *dev, struct list_head *members,
+			    int size, int nr_sgl)
+{
+	struct srb_cmd_s *first = list_first_entry(members, struct srb_cmd_s, list);
+	struct srb_cmd_s *batch;
+	struct srb_cmd_s *cmd;
+	int nr = 0;
+	int i;
+
+	batch = kzalloc(sizeof(*batch) + nr_sgl * sizeof(struct scatterlist),
+			GFP_NOWAIT | __GFP_NOWARN);
+	if (!batch)
+		return 0;
+
+	INIT_LIST_HEAD(&batch->list);
+	batch->kind	= SRB_CMD_BATCH;
+	batch->dev	= dev;
+	batch->op	= first->op;
+	batch->offset	= first->offset;
+	batch->size	= size;
+	batch->sgl	= (struct scatterlist *)(batch + 1);
+	batch->sgl_size	= nr_sgl;
+	sg_init_table(batch->sgl, nr_sgl);
+	list_for_each_entry(cmd, members, list) {
+		batch->fua |= cmd->fua;
+		for (i = 0; i < cmd->sgl_size; i++, nr++)
+			sg_set_page(&batch->sgl[nr], sg_page(&cmd->sgl[i]),
+				    cmd->sgl[i].length, cmd->sgl[i].offset);
+	}
+	INIT_LIST_HEAD(&batch->members);
+	list_splice_init(members, &batch->members);
+
+	SRBDEV_LOG_DEBUG(dev, "Coalesced requests into %d bytes at %llu",
+			 size, (unsigned long long)batch->offset);
+	srb_path_submit(dev, batch, srb_pick_path(dev, -1));
+
+	return 1;
+}
+
+/*
+ * Ends a command of the engine: a request's, a leg of a hedged read, a piece
+ * of a striped request, coalesced requests, or a readahead.
+ */
+void srb_end_cmd(struct srb_cmd_s *cmd, int error)
+{
+	switch (cmd->kind) {
+	case SRB_CMD_REQUEST:
+		srb_end_request(cmd->req, error);
+		break;
+	case SRB_CMD_LEG:
+		srb_leg_end(cmd, error, 0);
+		break;
+	case SRB_CMD_PIECE:
+		srb_piece_end(cmd, error);
+		break;
+	case SRB_CMD_BATCH:
+		srb_batch_end(cmd, error);
+		break;
+	case SRB_CMD_PREFETCH:
+		srb_ra_end(cmd, error);
+		break;
+	case SRB_CMD_WAITED:
+		cmd->error = error;
+		complete(cmd->done);
+		break;
+	}
+}
+
+/* Sends a request's command on its own */
+void srb_dispatch(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	if ((cmd->op == SRB_CMD_READ || cmd->op == SRB_CMD_WRITE) &&
+	    srb_split_submit(dev, cmd))
+		return;
+	if (cmd->op == SRB_CMD_READ && srb_hedge_arm(dev, cmd))
+		return;
+	srb_path_submit(dev, cmd, srb_pick_path(dev, -1));
+}
+
+/* Holds a read or write on its queue, keeping them sorted by offset */
+static void srb_plug(struct srb_queue_s *queue, struct srb_cmd_s *cmd)
+{
+	struct srb_cmd_s *prev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->plug_lock, flags);
+	list_for_each_entry_reverse(prev, &queue->plugged, list) {
+		if (prev->offset <= cmd->offset)
+			break;
+	}
+	list_add(&cmd->list, &prev->list);
+	spin_unlock_irqrestore(&queue->plug_lock, flags);
+}
+
+/* Sends the requests held on the queue, coalescing the contiguous ones */
+static void srb_unplug(struct srb_queue_s *queue)
+{
+	struct srb_device_s *dev = queue->dev;
+	struct srb_cmd_s *cmd, *next;
+	unsigned long flags;
+	LIST_HEAD(plugged);
+	LIST_HEAD(members);
+	unsigned long max;
+	int nr_sgl;
+	int size;
+
+	spin_lock_irqsave(&queue->plug_lock, flags);
+	list_splice_init(&queue->plugged, &plugged);
+	spin_unlock_irqrestore(&queue->plug_lock, flags);
+
+	max = dev->max_io_size;
+	if (split_size)
+		max = min_t(unsigned long, max, (unsigned long)split_size * kB);
+
+	while (!list_empty(&plugged)) {
+		cmd = list_first_entry(&plugged, struct srb_cmd_s, list);
+		list_move_tail(&cmd->list, &members);
+		size = cmd->size;
+		nr_sgl = cmd->sgl_size;
+
+		while (!list_empty(&plugged)) {
+			next = list_first_entry(&plugged, struct srb_cmd_s, list);
+			if (next->op != cmd->op ||
+			    next->offset != cmd->offset + size ||
+			    size + next->size > max ||
+			    nr_sgl + next->sgl_size > dev->max_segs)
+				break;
+			list_move_tail(&next->list, &members);
+			size += next->size;
+			nr_sgl += next->sgl_size;
+		}
+
+		if (list_is_singular(&members) ||
+		    !srb_batch_submit(dev, &members, size, nr_sgl)) {
+			list_for_each_entry_safe(cmd, next, &members, list) {
+				list_del_init(&cmd->list);
+				srb_dispatch(dev, cmd);
 			}
 		}
+	}
+}
 
-		/* Create scatterlist */
-		cdmi_desc = dev->thread_cdmi_desc[th_id];
-		sg_init_table(dev->thread_cdmi_desc[th_id]->sgl, DEV_NB_PHYS_SEGS);
-		dev->thread_cdmi_desc[th_id]->sgl_size = blk_rq_map_sg(dev->q, req, dev->thread_cdmi_desc[th_id]->sgl);
+/*
+ * Hands a request over to the connections of one of the device's servers.
+ * Reads and writes wait on their queue for srb_unplug.
+ */
+static void srb_submit(struct srb_queue_s *queue, struct request *req,
+		       struct srb_cmd_s *cmd)
+{
+	struct srb_device_s *dev = queue->dev;
+	char buff[256];
 
-		SRBDEV_LOG_DEBUG(dev, "scatter_list size %d [nb_seg = %d,"
-		                 " sector = %lu, nr_sectors=%u w=%d]",
-		                 DEV_NB_PHYS_SEGS,
-		                 dev->thread_cdmi_desc[th_id]->sgl_size,
-		                 blk_rq_pos(req), blk_rq_sectors(req),
-		                 rq_data_dir(req) == WRITE);
-
-		/* Call scatter function */
-		th_ret = srb_xfer_scl(dev, dev->thread_cdmi_desc[th_id], req);
-
-		SRBDEV_LOG_DEBUG(dev, "thread %d: REQ done with returned code %d",
-		                 th_id, th_ret);
-	
-		if (th_ret < 0) {
-			blk_end_request_all(req, -EIO);
+	if (SRB_DEBUG <= dev->debug.level) {
+		req_flags_to_str(req->cmd_flags, buff);
+		SRBDEV_LOG_DEBUG(dev, "queue %d: New REQ of type %s (%d) flags: %s (%llu)",
+				 queue->id, req_code_to_str(rq_data_dir(req)), rq_data_dir(req), buff,
+				 (unsigned long long)req->cmd_flags);
+	}
+
+	cmd->kind	= SRB_CMD_REQUEST;
+	cmd->req	= req;
+	cmd->dev	= dev;
+	cmd->submitted	= ktime_get();
+	cmd->sgl	= (struct scatterlist *)(cmd + 1);
+	cmd->offset	= blk_rq_pos(req) << 9;
+	cmd->size	= blk_rq_bytes(req);
+	cmd->fua	= 0;
+	cmd->sgl_size	= 0;
+	cmd->attempts	= 0;
+	cmd->cancelled	= 0;
+	cmd->local	= 0;
+	cmd->cache_wseq	= 0;
+
+	if (srb_rq_is_flush(req)) {
+		cmd->op = SRB_CMD_SYNC;
+		/* Written back first in volatile write-back mode */
+		if (srb_wback_submit(dev, cmd))
+			return;
+		srb_flush_submit(dev, cmd);
+		return;
+	}
+
+	if (srb_rq_is_discard(req)) {
+		/*
+		 * No payload: contiguous discards were merged by the block
+		 * layer up to DEV_DISCARD_MAX_SECTORS already.
+		 */
+		cmd->op = SRB_CMD_DISCARD;
+		SRBDEV_LOG_DEBUG(dev, "discard [sector = %lu, nr_sectors=%u]",
+				 (unsigned long)blk_rq_pos(req), blk_rq_sectors(req));
+	} else if (srb_rq_is_write_zeroes(req)) {
+		/* A deallocated range reads as zeroes too */
+		cmd->op = srb_rq_nounmap(req) ? SRB_CMD_ZERO : SRB_CMD_DISCARD;
+		SRBDEV_LOG_DEBUG(dev, "write zeroes [sector = %lu, nr_sectors=%u]",
+				 (unsigned long)blk_rq_pos(req), blk_rq_sectors(req));
+	} else if (srb_rq_is_write_same(req)) {
+		/* The payload is a single logical block */
+		sg_init_table(cmd->sgl, dev->max_segs);
+		cmd->sgl_size = blk_rq_map_sg(req->q, req, cmd->sgl);
+		if (memchr_inv(sg_virt(&cmd->sgl[0]), 0, cmd->sgl[0].length))
+			cmd->op = SRB_CMD_WRITE_SAME;
+		else
+			cmd->op = SRB_CMD_ZERO;
+		SRBDEV_LOG_DEBUG(dev, "write same [sector = %lu, nr_sectors=%u zero=%d]",
+				 (unsigned long)blk_rq_pos(req), blk_rq_sectors(req),
+				 cmd->op == SRB_CMD_ZERO);
+	} else {
+		if (rq_data_dir(req) == WRITE) {
+			cmd->op = SRB_CMD_WRITE;
+			cmd->fua = !!(req->cmd_flags & REQ_FUA);
 		} else {
-			blk_end_request_all(req, 0);
+			cmd->op = SRB_CMD_READ;
 		}
+		sg_init_table(cmd->sgl, dev->max_segs);
+		cmd->sgl_size	= blk_rq_map_sg(req->q, req, cmd->sgl);
+
+		SRBDEV_LOG_DEBUG(dev, "scatter_list size %d [nb_seg = %d,"
+				 " sector = %lu, nr_sectors=%u w=%d fua=%d]",
+				 dev->max_segs, cmd->sgl_size,
+				 (unsigned long)blk_rq_pos(req), blk_rq_sectors(req),
+				 cmd->op == SRB_CMD_WRITE, cmd->fua);
+	}
+
+	if (srb_cmd_is_write(cmd)) {
+		srb_flush_write_start(dev, cmd);
+		/* Before the write-back tiers: the range is not zeroes anymore */
+		srb_zmap_write_start(dev, cmd);
+	}
+	/* Writes go to the write-back log, and so do reads of its data */
+	if (dev->wblog && srb_wblog_submit(dev, cmd))
+		return;
+	/* Or to memory in volatile write-back mode */
+	if (srb_wback_submit(dev, cmd))
+		return;
+#ifdef SRB_BLK_MQ
+	/*
+	 * Reads may be served with zeroes if never written, from the cache,
+	 * or a stream's readahead
+	 */
+	if (cmd->op == SRB_CMD_READ &&
+	    (srb_zmap_read(dev, cmd) || srb_cache_read(dev, cmd) ||
+	     srb_ra_read(dev, cmd)))
+		return;
+#endif
+	if (cmd->op == SRB_CMD_READ || cmd->op == SRB_CMD_WRITE)
+		srb_plug(queue, cmd);
+	else
+		srb_dispatch(dev, cmd);
+}
+
+#ifdef SRB_BLK_MQ
+static srb_mq_ret_t srb_queue_rq(struct blk_mq_hw_ctx *hctx,
+				 const struct blk_mq_queue_data *bd)
+{
+	struct srb_queue_s *queue = hctx->driver_data;
+	struct request *req = bd->rq;
+	struct srb_cmd_s *cmd = blk_mq_rq_to_pdu(req);
+
+	if (!srb_rq_is_fs(req)) {
+		SRBDEV_LOG_DEBUG(queue->dev, "Skip non-CMD request");
+		if (srb_mq_last(bd))
+			srb_unplug(queue);
+		return SRB_MQ_RQ_QUEUE_ERROR;
+	}
+
+	blk_mq_start_request(req);
+	if (blk_rq_sectors(req) == 0 && !srb_rq_is_flush(req)) {
+		/* The PDU may still describe a former request */
+		cmd->op = SRB_CMD_READ;
+		srb_end_request(req, 0);
+	} else {
+		srb_submit(queue, req, cmd);
 	}
+	if (srb_mq_last(bd))
+		srb_unplug(queue);
 
-	return 0;
+	return SRB_MQ_RQ_QUEUE_OK;
 }
 
+#ifdef SRB_MQ_COMMIT_RQS
+/* The batch was cut short, before its last request */
+static void srb_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+	srb_unplug(hctx->driver_data);
+}
+#endif
+
+static void srb_mq_complete(struct request *req)
+{
+	struct srb_cmd_s *cmd = blk_mq_rq_to_pdu(req);
+
+	blk_mq_end_request(req, srb_errno_to_status(cmd->error));
+}
+
+static int srb_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			 unsigned int hctx_idx)
+{
+	struct srb_device_s *dev = data;
 
+	hctx->driver_data = &dev->queues[hctx_idx];
+
+	return 0;
+}
+
+static struct blk_mq_ops srb_mq_ops = {
+	.queue_rq	= srb_queue_rq,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)
+	.map_queue	= blk_mq_map_queue,
+#endif
+#ifdef SRB_MQ_COMMIT_RQS
+	.commit_rqs	= srb_commit_rqs,
+#endif
+	.init_hctx	= srb_init_hctx,
+	.complete	= srb_mq_complete,
+};
+#else
 static void srb_rq_fn(struct request_queue *q)
 {
 	struct srb_device_s *dev = q->queuedata;	
+	struct srb_cmd_s *cmd;
 	struct request *req;
-	unsigned long flags;
 
 	while ((req = blk_fetch_request(q)) != NULL) {
-		if (req->cmd_type != REQ_TYPE_FS) {
+		if (!srb_rq_is_fs(req)) {
 			SRBDEV_LOG_DEBUG(dev, "Skip non-CMD request");
 
 			__blk_end_request_all(req, -EIO);
 			continue;
 		}
 
-		spin_lock_irqsave(&dev->waiting_lock, flags);
-		list_add_tail(&req->queuelist, &dev->waiting_queue);
-		spin_unlock_irqrestore(&dev->waiting_lock, flags);
-		wake_up_nr(&dev->waiting_wq, 1);
+		if (blk_rq_sectors(req) == 0 && !srb_rq_is_flush(req)) {
+			__blk_end_request_all(req, 0);
+			continue;
+		}
+
+		/* Called with the queue lock held: no sleeping allocation */
+		cmd = mempool_alloc(dev->cmd_pool, GFP_ATOMIC);
+		if (cmd == NULL) {
+			blk_requeue_request(q, req);
+			blk_delay_queue(q, SRB_REQUEUE_DELAY_MS);
+			break;
+		}
+		req->special = cmd;
+		srb_submit(&dev->queues[0], req, cmd);
 	}
+	srb_unplug(&dev->queues[0]);
 }
+#endif
 
-static int srb_open(struct block_device *bdev, fmode_t mode)
+static int srb_open(SRB_OPEN_ARGS)
 {
-	srb_device_t *dev = (srb_device_t*)bdev->bd_disk->private_data;
+	srb_device_t *dev = (srb_device_t*)SRB_OPEN_DISK->private_data;
 	int ret = 0;
 
-	SRBDEV_LOG_INFO(dev, "Opening device (%s)", bdev->bd_disk->disk_name);
+	SRBDEV_LOG_INFO(dev, "Opening device (%s)", SRB_OPEN_DISK->disk_name);
 
 	/* Need to check if a detach command is in progress for this
 	   device*/	
@@ -463,7 +1390,7 @@ static int srb_open(struct block_device *bdev, fmode_t mode)
 	if (dev->state == DEV_IN_USE) {
 	      SRBDEV_LOG_INFO(dev, 
 			      "Tried to open device (%s) while a detach command is in progress", 
-			      bdev->bd_disk->disk_name);
+			      SRB_OPEN_DISK->disk_name);
 	      ret = -ENOENT;
 	      goto out;
 	}
@@ -478,7 +1405,7 @@ static int srb_open(struct block_device *bdev, fmode_t mode)
  * After linux kernel v3.10, this function stops returning anything
  * (becomes void). For simplicity, we currently don't support earlier kernels.
  */
-static void srb_release(struct gendisk *disk, fmode_t mode)
+static void srb_release(SRB_RELEASE_ARGS)
 {
 	srb_device_t *dev;
 
@@ -496,37 +1423,66 @@ static const struct block_device_operations srb_fops =
 	.release =	srb_release,
 };
 
-static int srb_init_disk(struct srb_device_s *dev)
+static int srb_init_disk(struct srb_device_s *dev,
+			 struct srb_cdmi_desc_s *cdmi_desc)
 {
 	struct gendisk *disk = NULL;
 	struct request_queue *q;
-	int i;
 	int ret = 0;
 
 	SRB_LOG_INFO(srb_log, "srb_init_disk: initializing disk for device: %s", dev->name);
 
 	/* Check for existing device nodes */
-	if (blk_lookup_devt(dev->name, 0)) {
+	if (srb_disk_name_taken(dev->name)) {
 		SRB_LOG_ERR(srb_log, "Device already exists: %s", dev->name);
 		return -EINVAL;
 	}
 
-	/* create gendisk info */
+	/* init rq, along with the gendisk info with blk-mq */
+#ifdef SRB_BLK_MQ
+	memset(&dev->tag_set, 0, sizeof(dev->tag_set));
+	dev->tag_set.ops		= &srb_mq_ops;
+	dev->tag_set.nr_hw_queues	= dev->nb_queues;
+	dev->tag_set.queue_depth	= DEV_MQ_QUEUE_DEPTH;
+	dev->tag_set.numa_node		= NUMA_NO_NODE;
+	dev->tag_set.cmd_size		= srb_cmd_size(dev);
+	dev->tag_set.flags		= BLK_MQ_F_SHOULD_MERGE;
+	dev->tag_set.driver_data	= dev;
+
+	ret = blk_mq_alloc_tag_set(&dev->tag_set);
+	if (ret) {
+		SRB_LOG_WARN(srb_log, "srb_init_disk: unable to allocate tag set for device: %p",
+			dev);
+		return ret;
+	}
+
+	disk = srb_mq_alloc_disk(&dev->tag_set, dev, DEV_MINORS);
+	if (!disk) {
+		SRB_LOG_WARN(srb_log, "srb_init_disk: unable to allocate disk and queue for device: %s",
+			dev->name);
+		blk_mq_free_tag_set(&dev->tag_set);
+		return -ENOMEM;
+	}
+	dev->disk	   = disk;
+#else
 	disk = alloc_disk(DEV_MINORS);
 	if (!disk) {
 		SRB_LOG_WARN(srb_log, "srb_init_disk: unable to allocate memory for disk for device: %s",
 			dev->name);
 		return -ENOMEM;
 	}
-	SRB_LOG_DEBUG(srb_log, "Creating new disk: %p", disk);
+	dev->disk	   = disk;
 
-	strcpy(disk->disk_name, dev->name);
-	disk->major	   = dev->major;
-	disk->first_minor  = 0;
-	disk->fops	   = &srb_fops;
-	disk->private_data = dev;
+	dev->cmd_pool = mempool_create_kmalloc_pool(thread_pool_size * pipeline_depth,
+						    srb_cmd_size(dev));
+	if (!dev->cmd_pool) {
+		SRB_LOG_WARN(srb_log, "srb_init_disk: unable to allocate commands for device: %p, disk: %p",
+			dev, disk);
+		srb_free_disk(dev);
+		return -ENOMEM;
+	}
 
-	/* init rq */
+	spin_lock_init(&dev->rq_lock);
 	q = blk_init_queue(srb_rq_fn, &dev->rq_lock);
 	if (!q) {
 		SRB_LOG_WARN(srb_log, "srb_init_disk: unable to init block queue for device: %p, disk: %p",
@@ -534,30 +1490,44 @@ static int srb_init_disk(struct srb_device_s *dev)
 		srb_free_disk(dev);
 		return -ENOMEM;
 	}
-
-	blk_queue_max_hw_sectors(q, DEV_NB_PHYS_SEGS);
 	q->queuedata	= dev;
+	disk->queue	= q;
+#endif
+	SRB_LOG_DEBUG(srb_log, "Creating new disk: %p", disk);
 
-	dev->disk	= disk;
-	dev->q		= disk->queue = q;
-	dev->nb_threads = 0;
-	//blk_queue_flush(q, REQ_FLUSH | REQ_FUA);
-	//blk_queue_max_phys_segments(q, DEV_NB_PHYS_SEGS);
-
-	//TODO: Enable flush and bio (Issue #21)
-	//blk_queue_flush(q, REQ_FLUSH);
-
-	for (i = 0; i < thread_pool_size; i++) {
-		//if ((ret = srb_cdmi_connect(&dev->debug, &dev->thread_cdmi_desc[i]))) {
-		if ((ret = srb_cdmi_connect(&dev->debug, dev->thread_cdmi_desc[i]))) {
-			SRB_LOG_ERR(srb_log, "Unable to connect to CDMI endpoint: %d",
-				ret);
-			srb_free_disk(dev);
-			return -EIO;
-		}
+	strcpy(disk->disk_name, dev->name);
+	disk->major	   = dev->major;
+	disk->first_minor  = 0;
+	disk->fops	   = &srb_fops;
+	disk->private_data = dev;
+
+	q		= disk->queue;
+	dev->q		= q;
+
+	/* A request becomes a single ranged GET or PUT, whatever its size */
+	blk_queue_max_hw_sectors(q, dev->max_io_size >> 9);
+	blk_queue_max_segments(q, dev->max_segs);
+	blk_queue_max_segment_size(q, dev->max_io_size);
+	blk_queue_io_opt(q, dev->max_io_size);
+
+	/* Flushes and FUA writes are backed by server-side syncs */
+	srb_queue_write_cache(q);
+
+	/* Discards deallocate the range on the server */
+	srb_queue_discard(q, DEV_DISCARD_MAX_SECTORS);
+
+	/* Zeroing and write same do not send the range's worth of data */
+	srb_queue_write_zeroes(q, DEV_ZEROES_MAX_SECTORS);
+	srb_queue_write_same(q, DEV_ZEROES_MAX_SECTORS);
+
+	if ((ret = srb_cdmi_connect(&dev->debug, cdmi_desc))) {
+		SRB_LOG_ERR(srb_log, "Unable to connect to CDMI endpoint: %d",
+			ret);
+		srb_free_disk(dev);
+		return -EIO;
 	}
-	/* Caution: be sure to call this before spawning threads */
-	ret = srb_cdmi_getsize(&dev->debug, dev->thread_cdmi_desc[0], &dev->disk_size);
+	ret = srb_cdmi_getsize(&dev->debug, cdmi_desc, &dev->disk_size);
+	srb_cdmi_disconnect(&dev->debug, cdmi_desc);
 	if (ret != 0) {
 		SRB_LOG_ERR(srb_log, "Could not retrieve volume size.");
 		srb_free_disk(dev);
@@ -566,31 +1536,22 @@ static int srb_init_disk(struct srb_device_s *dev)
 
 	set_capacity(disk, dev->disk_size / 512ULL);
 
-	for (i = 0; i < thread_pool_size; i++) {
-		dev->thread[i] = kthread_create(srb_thread, dev, "%s",
-						dev->disk->disk_name);
-		if (IS_ERR(dev->thread[i])) {
-			SRB_LOG_ERR(srb_log, "Unable to create worker thread (id %d)", i);
-			dev->thread[i] = NULL;
-			srb_free_disk(dev);
-			goto err_kthread;
-		}
-		wake_up_process(dev->thread[i]);
+#ifdef SRB_BLK_MQ
+	/* Not fatal: the device just does not read ahead */
+	srb_ra_configure(dev, SRB_RA_WINDOW_DFLT, SRB_RA_STREAMS_DFLT);
+#endif
+
+	ret = srb_add_disk(disk);
+	if (ret) {
+		SRB_LOG_ERR(srb_log, "Could not add disk %s: %d", dev->name, ret);
+		srb_free_disk(dev);
+		return ret;
 	}
-	add_disk(disk);
 
 	SRBDEV_LOG_INFO(dev, "Attached volume %s of size 0x%llx",
 	                disk->disk_name, (unsigned long long)dev->disk_size);
 
 	return 0;
-
-err_kthread:
-	for (i = 0; i < thread_pool_size; i++) {
-		if (dev->thread[i] != NULL)
-			kthread_stop(dev->thread[i]);
-	}
-
-	return -EIO;
 }
 #define device_free_slot(X) ((X)->name[0] == 0)
 
@@ -605,8 +1566,8 @@ static int srb_device_new(const char *devname, srb_device_t *dev)
 	int ret = -EINVAL;
 	int i;
 
-	SRB_LOG_INFO(srb_log, "srb_device_new: creating new device %s"
-		      " with %d threads", devname, thread_pool_size);
+	SRB_LOG_INFO(srb_log, "srb_device_new: creating new device %s",
+		      devname);
 
 	if (NULL == dev) {
 		ret = -EINVAL;
@@ -629,42 +1590,61 @@ static int srb_device_new(const char *devname, srb_device_t *dev)
 	dev->users = 0;
 	strncpy(dev->name, devname, strlen(devname));
 
-	/* XXX: dynamic allocation of thread pool and cdmi connection pool
-	 * NB: The memory allocation for the thread is an array of pointer
-	 *     whereas the allocation for the cdmi connection pool is an array
-	 *     of cdmi connection structure
-	 */
-	dev->thread_cdmi_desc = vmalloc(thread_pool_size * sizeof(struct srb_cdmi_desc_s *));
-	if (dev->thread_cdmi_desc == NULL) {
-		SRB_LOG_CRIT(srb_log, "srb_device_new: Unable to allocate memory for CDMI struct pointer");
-		ret = -ENOMEM;
-		goto err_mem;
-	}
-	for (i = 0; i < thread_pool_size; i++) {
-	    dev->thread_cdmi_desc[i] = vmalloc(sizeof(struct srb_cdmi_desc_s));
-		if (dev->thread_cdmi_desc[i] == NULL) {
-			SRB_LOG_CRIT(srb_log, "srb_device_new: Unable to allocate memory for CDMI struct, step %d", i);
-			ret = -ENOMEM;
-			goto err_mem;
-		}
-	}
-	dev->thread = vmalloc(thread_pool_size * sizeof(struct task_struct *));
-	if (dev->thread == NULL) {
-		SRB_LOG_CRIT(srb_log, "srb_device_new: Unable to allocate memory for kernel thread struct");
+	/* One queue per blk-mq hardware context (at most one per CPU) */
+#ifdef SRB_BLK_MQ
+	dev->nb_queues = min_t(int, thread_pool_size, nr_cpu_ids);
+#else
+	dev->nb_queues = 1;
+#endif
+	dev->queues = vmalloc(dev->nb_queues * sizeof(struct srb_queue_s));
+	if (dev->queues == NULL) {
+		SRB_LOG_CRIT(srb_log, "srb_device_new: Unable to allocate memory for request queues");
 		ret = -ENOMEM;
-		goto err_mem;
+		goto out;
 	}
+	for (i = 0; i < dev->nb_queues; i++) {
+		dev->queues[i].dev = dev;
+		dev->queues[i].id = i;
+		spin_lock_init(&dev->queues[i].plug_lock);
+		INIT_LIST_HEAD(&dev->queues[i].plugged);
+	}
+
+	spin_lock_init(&dev->flush_lock);
+	dev->flush_epoch = 0;
+	dev->epoch_writes = 0;
+	INIT_LIST_HEAD(&dev->flushes);
+
+	spin_lock_init(&dev->hedge_lock);
+	dev->hedge_threshold = 0;
+	dev->hedge_percentile = 0;
+	dev->hedge_budget = SRB_HEDGE_BUDGET_DFLT;
+	memset(dev->lat_hist, 0, sizeof(dev->lat_hist));
+	dev->lat_samples = 0;
+	dev->window_reads = 0;
+	dev->window_hedges = 0;
+	dev->hedges_issued = 0;
+	dev->hedges_won = 0;
+	atomic_set(&dev->nb_legs, 0);
+	init_waitqueue_head(&dev->legs_wait);
+
+	spin_lock_init(&dev->ra_lock);
+	mutex_init(&dev->ra_mutex);
+	dev->ra_streams = NULL;
+	dev->ra_nb_streams = 0;
+	dev->ra_window = 0;
+	dev->ra_chunk_size = 0;
+	dev->ra_hits = 0;
+	dev->ra_misses = 0;
+	atomic_set(&dev->ra_refs, 0);
+	init_waitqueue_head(&dev->ra_wait);
+
+	srb_cache_device_init(dev);
+	dev->wblog = NULL;
+	srb_wback_device_init(dev);
+	srb_zmap_device_init(dev);
 
 	return 0;
 
-err_mem:
-	if (NULL != dev && NULL != dev->thread_cdmi_desc) {
-		for (i = 0; i < thread_pool_size; i++) {
-			if (dev->thread_cdmi_desc[i])
-				vfree(dev->thread_cdmi_desc[i]);
-		}
-		vfree(dev->thread_cdmi_desc);
-	}
 out:
 	return ret;
 }
@@ -681,27 +1661,30 @@ static void __srb_device_free(srb_device_t *dev)
 	dev->id = -1;
 }
 
-static void srb_device_free(srb_device_t *dev)
+/* Releases the connections to the device's servers (see srb_device_get_paths) */
+static void srb_device_put_paths(srb_device_t *dev)
 {
-	int i = 0;
+	int i;
+
+	for (i = 0; i < dev->nb_paths; i++) {
+		srb_engine_pool_put(dev->paths[i].pool);
+		dev->paths[i].pool = NULL;
+	}
+	dev->nb_paths = 0;
+}
 
+static void srb_device_free(srb_device_t *dev)
+{
 	SRB_LOG_INFO(srb_log, "srb_device_free: freeing device: %s", dev->name);
 
 	__srb_device_free(dev);
 
-	if (dev->thread_cdmi_desc) {
-		for (i = 0; i < thread_pool_size; i++) {
-			if (dev->thread_cdmi_desc[i])
-			{
-				srb_cdmi_disconnect(&dev->debug,
-				                    dev->thread_cdmi_desc[i]);
-				vfree(dev->thread_cdmi_desc[i]);
-			}
-		}
-		vfree(dev->thread_cdmi_desc);
-	}
-	if (dev->thread)
-		vfree(dev->thread);
+	srb_device_put_paths(dev);
+	if (dev->queues)
+		vfree(dev->queues);
+	dev->queues = NULL;
+	dev->url[0] = 0;
+	dev->filename[0] = 0;
 }
 
 static int _srb_reconstruct_url(char *url, char *name,
@@ -738,7 +1721,6 @@ static int _srb_reconstruct_url(char *url, char *name,
 
 static int __srb_device_detach(srb_device_t *dev)
 {
-	int i;
 	int ret = 0;
 
 	SRB_LOG_DEBUG(srb_log, "detaching device (%p)", dev);
@@ -760,18 +1742,15 @@ static int __srb_device_detach(srb_device_t *dev)
 		return -EINVAL;
 	}
 
-	SRBDEV_LOG_INFO(dev, "Stopping device's background processes");
-	for (i = 0; i < thread_pool_size; i++) {
-		if (dev->thread[i])
-			kthread_stop(dev->thread[i]);
-	}
-
-	/* free disk */
+	/* free disk, draining the requests still in progress */
 	ret = srb_free_disk(dev);
 	if (0 != ret) {
 		SRBDEV_LOG_WARN(dev, "Failed to remove device: %d", ret);
 	}
 
+	/* The servers' connections are stopped with their last device */
+	srb_device_put_paths(dev);
+
 	SRB_LOG_INFO(srb_log, "Unregistering device from BLOCK Subsystem");
 
 	/* Remove device */
@@ -817,10 +1796,8 @@ static int _srb_detach_devices(void)
 				        "Cannot remove device %s for volume %s"
 				        " on module unload: %i",
 				        devtab[i].name,
-				        devtab[i].thread_cdmi_desc ?
-				                devtab[i].thread_cdmi_desc[0]->filename
-				                : "NULL",
-				         ret);
+				        devtab[i].filename,
+				        ret);
 				errcount++;
 			}
 		}
@@ -884,10 +1861,11 @@ end:
 
 
 /*
- * XXX NOTE XXX: #13 This function picks only one server that has enough free
- * space in the URL buffer to append the filename.
+ * Picks the nth server that has enough free space in the URL buffer to
+ * append the filename.
  */
-static int _srb_server_pick(const char *filename, struct srb_cdmi_desc_s *pick)
+static int _srb_server_pick_nth(const char *filename, int nth,
+				struct srb_cdmi_desc_s *pick)
 {
 	char url[SRB_URL_SIZE];
 	char name[SRB_URL_SIZE];
@@ -895,7 +1873,7 @@ static int _srb_server_pick(const char *filename, struct srb_cdmi_desc_s *pick)
 	int found = 0;
 	srb_server_t *server = NULL;
 
-	SRB_LOG_DEBUG(srb_log, "_srb_server_pick: picking server with filename: %s, with CDMI pick %p", filename, pick);
+	SRB_LOG_DEBUG(srb_log, "_srb_server_pick_nth: picking server #%d with filename: %s, with CDMI pick %p", nth, filename, pick);
 
 	spin_lock(&devtab_lock);
 	server = servers;
@@ -906,8 +1884,8 @@ static int _srb_server_pick(const char *filename, struct srb_cdmi_desc_s *pick)
 					    server->cdmi_desc.filename,
 					    filename);
 		SRB_LOG_INFO(srb_log, "Dewb reconstruct url yielded %s, %i", url, ret);
-		if (ret == 0) {
-			memcpy(pick, &server->cdmi_desc, sizeof(struct srb_cdmi_desc_s));
+		if (ret == 0 && nth-- == 0) {
+			srb_cdmi_desc_copy(pick, &server->cdmi_desc);
 			strncpy(pick->url, url, SRB_URL_SIZE);
 			strncpy(pick->filename, name, SRB_URL_SIZE);
 			SRB_LOG_INFO(srb_log, "Copied into pick: url=%s, name=%s", pick->url, pick->filename);
@@ -920,15 +1898,62 @@ static int _srb_server_pick(const char *filename, struct srb_cdmi_desc_s *pick)
 
 	SRB_LOG_INFO(srb_log, "Browsed all servers");
 
-	if (!found) {
+	// No such device or adress seems to match 'missing server'
+	return found ? 0 : -ENXIO;
+}
+
+static int _srb_server_pick(const char *filename, struct srb_cdmi_desc_s *pick)
+{
+	int ret;
+
+	ret = _srb_server_pick_nth(filename, 0, pick);
+	if (ret)
 		SRB_LOG_ERR(srb_log, "Could not match any server for filename %s", filename);
-		// No such device or adress seems to match 'missing server'
-		ret = -ENXIO;
-		goto end;
+
+	return ret;
+}
+
+/*
+ * Gets the connections to every server able to serve the volume, up to
+ * DEV_MAX_PATHS, the device's requests being spread over them (see
+ * srb_pick_path). cdmi_desc is the server picked first.
+ */
+static int srb_device_get_paths(srb_device_t *dev, const char *filename,
+				struct srb_cdmi_desc_s *cdmi_desc)
+{
+	struct srb_cdmi_desc_s *pick;
+	struct srb_path_s *path;
+	int ret = 0;
+	int i;
+
+	pick = srb_cdmi_desc_alloc(SRB_HTTP_HEADER_SIZE);
+	if (pick == NULL)
+		return -ENOMEM;
+	srb_cdmi_desc_copy(pick, cdmi_desc);
+
+	for (i = 0; i < DEV_MAX_PATHS; i++) {
+		if (i > 0 && _srb_server_pick_nth(filename, i, pick) != 0)
+			break;
+
+		path = &dev->paths[i];
+		ret = srb_http_mktemplate(&path->http_tmpl, pick->ip_addr,
+					  pick->filename);
+		if (ret)
+			break;
+		path->pool = srb_engine_pool_get(pick->ip_addr, pick->port,
+						 dev->max_segs);
+		if (path->pool == NULL) {
+			SRB_LOG_ERR(srb_log, "Unable to get connections to server %s:%u",
+				    pick->ip_addr, pick->port);
+			ret = -ENOMEM;
+			break;
+		}
+		dev->nb_paths++;
+		SRBDEV_LOG_INFO(dev, "Using server %s", pick->url);
 	}
 
-	ret = 0;
-end:
+	srb_cdmi_desc_free(pick);
+
 	return ret;
 }
 
@@ -1148,7 +2173,7 @@ int srb_volumes_dump(char *buf, size_t max_size)
 
 	SRB_LOG_INFO(srb_log, "srb_volumes_dump: dumping volumes: buf: %p, max_size: %ld", buf, max_size);
 
-	cdmi_desc = vmalloc(sizeof(*cdmi_desc));
+	cdmi_desc = srb_cdmi_desc_alloc(SRB_XMIT_BUFFER_SIZE);
 	if (cdmi_desc == NULL) {
 		ret = -ENOMEM;
 		goto cleanup;
@@ -1186,7 +2211,7 @@ cleanup:
 	{
 		if (connected)
 			srb_cdmi_disconnect(&debug, cdmi_desc);
-		vfree(cdmi_desc);
+		srb_cdmi_desc_free(cdmi_desc);
 	}
 
 	return ret < 0 ? ret : cb_data.printed;
@@ -1249,9 +2274,29 @@ int srb_device_detach(const char *devname)
 	return ret;
 }
 
+/*
+ * Sets the request size limits of a device being attached. max_io is in
+ * bytes, 0 picking the max_io_size module parameter.
+ */
+static void srb_device_set_io_size(srb_device_t *dev, unsigned long long max_io)
+{
+	if (max_io == 0)
+		max_io = (unsigned long long)max_io_size * kB;
+	if (max_io < PAGE_SIZE || max_io > SRB_MAX_IO_SIZE_MAX) {
+		SRBDEV_LOG_WARN(dev, "Invalid maximum request size %llu, using %u",
+				max_io, SRB_MAX_IO_SIZE_DFLT);
+		max_io = SRB_MAX_IO_SIZE_DFLT;
+	}
+
+	/* Each page of a request may end up in its own segment */
+	dev->max_io_size = round_down(max_io, PAGE_SIZE);
+	dev->max_segs = dev->max_io_size >> PAGE_SHIFT;
+}
+
 /* TODO: Remove useless memory allocation (cdmi_desc)
  */
-int srb_device_attach(const char *filename, const char *devname)
+int srb_device_attach(const char *filename, const char *devname,
+		unsigned long long max_io, const char *wblog)
 {
 	srb_device_t *dev = NULL;
 	int rc = 0;
@@ -1269,7 +2314,7 @@ int srb_device_attach(const char *filename, const char *devname)
 	spin_lock(&devtab_lock);
 	for (i = 0; i < DEV_MAX; ++i) {
 		if (!device_free_slot(&devtab[i])) {
-			fname = kbasename(devtab[i].thread_cdmi_desc[0]->filename);
+			fname = kbasename(devtab[i].filename);
 			if (strlen(fname) == strlen(filename) && strncmp(fname, filename, strlen(filename)) == 0) {
 				found = 1;
 				dev = &devtab[i];
@@ -1307,7 +2352,7 @@ int srb_device_attach(const char *filename, const char *devname)
 
 	SRB_LOG_INFO(srb_log, "Volume %s not attached yet, using device slot %d", filename, dev->id);
 
-	cdmi_desc = vmalloc(sizeof(struct srb_cdmi_desc_s));
+	cdmi_desc = srb_cdmi_desc_alloc(SRB_XMIT_BUFFER_SIZE);
 	if (cdmi_desc == NULL) {
 		SRB_LOG_ERR(srb_log, "Unable to allocate memory for cdmi struct");
 		rc = -ENOMEM;
@@ -1322,13 +2367,10 @@ int srb_device_attach(const char *filename, const char *devname)
 	} else {
 		SRB_LOG_INFO(srb_log, "New device created for %s", devname);
 	}
+	srb_device_set_io_size(dev, max_io);
 
-	init_waitqueue_head(&dev->waiting_wq);
-	INIT_LIST_HEAD(&dev->waiting_queue);
-	spin_lock_init(&dev->waiting_lock);
-
-	/* Pick a convenient server to get srb_cdmi_desc
-	 * TODO: #13 We need to manage failover by using every server
+	/* Pick a convenient server to get srb_cdmi_desc, the others
+	 * serving the volume are looked up by srb_device_get_paths
 	 * NB: _srb_server_pick fills the cdmi_desc sruct
 	 */
 	rc = _srb_server_pick(filename, cdmi_desc);
@@ -1342,13 +2384,11 @@ int srb_device_attach(const char *filename, const char *devname)
 		      cdmi_desc->filename);
 
 	/* set timeout value */
-	cdmi_desc->timeout.tv_sec = req_timeout;
-	cdmi_desc->timeout.tv_usec = 0;
+	cdmi_desc->timeout = req_timeout;
+
+	strncpy(dev->url, cdmi_desc->url, SRB_URL_SIZE);
+	strncpy(dev->filename, cdmi_desc->filename, SRB_URL_SIZE);
 
-	for (i = 0; i < thread_pool_size; i++) {	
-		memcpy(dev->thread_cdmi_desc[i], cdmi_desc,
-		       sizeof(struct srb_cdmi_desc_s));
-	}
 	rc = register_blkdev(0, DEV_NAME);
 	if (rc < 0) {
 		SRB_LOG_ERR(srb_log, "Could not register_blkdev()");
@@ -1356,8 +2396,25 @@ int srb_device_attach(const char *filename, const char *devname)
 	}
 	dev->major = rc;
 
-	rc = srb_init_disk(dev);
+	/* The I/O goes through the connections shared by the servers' devices */
+	rc = srb_device_get_paths(dev, filename, cdmi_desc);
+	if (rc < 0) {
+		do_unregister = 1;
+		goto cleanup;
+	}
+
+	/* Its data is more recent than the servers', so it comes first */
+	if (wblog) {
+		rc = srb_wblog_open(dev, wblog);
+		if (rc < 0) {
+			do_unregister = 1;
+			goto cleanup;
+		}
+	}
+
+	rc = srb_init_disk(dev, cdmi_desc);
 	if (rc < 0) {
+		srb_wblog_close(dev);
 		do_unregister = 1;
 		goto cleanup;
 	}
@@ -1365,9 +2422,9 @@ int srb_device_attach(const char *filename, const char *devname)
 	srb_sysfs_device_init(dev);
 
 	SRBDEV_LOG_INFO(dev, "Attached device %s (id: %d) for server "
-		      "[ip=%s port=%d fullpath=%s]",
+		      "[ip=%s port=%d fullpath=%s] and %d other(s)",
 		      dev->name, dev->id, cdmi_desc->ip_addr,
-		      cdmi_desc->port, cdmi_desc->filename);
+		      cdmi_desc->port, cdmi_desc->filename, dev->nb_paths - 1);
 
 	/* mark device as unsued == available */
 	spin_lock(&devtab_lock);
@@ -1391,7 +2448,7 @@ cleanup:
 		spin_unlock(&devtab_lock);
 	}
 	if (NULL != cdmi_desc)
-		vfree(cdmi_desc);
+		srb_cdmi_desc_free(cdmi_desc);
 
 	if (rc < 0)
 		SRB_LOG_ERR(srb_log, "Error adding device %s", filename);
@@ -1410,7 +2467,7 @@ int srb_device_create(const char *filename, unsigned long long size)
 	debug.name = NULL;
 	debug.level = srb_log;
 
-	cdmi_desc = vmalloc(sizeof(struct srb_cdmi_desc_s));
+	cdmi_desc = srb_cdmi_desc_alloc(SRB_XMIT_BUFFER_SIZE);
 	if (cdmi_desc == NULL) {
 		rc = -ENOMEM;
 		goto err_out_mod;
@@ -1434,7 +2491,7 @@ int srb_device_create(const char *filename, unsigned long long size)
 	SRB_LOG_INFO(srb_log, "Created volume with filename %s", filename);
 
 	if (cdmi_desc)
-		vfree(cdmi_desc);
+		srb_cdmi_desc_free(cdmi_desc);
 
 	return rc;
 
@@ -1442,7 +2499,7 @@ err_out_cdmi:
 	srb_cdmi_disconnect(&debug, cdmi_desc);
 err_out_alloc:
 	if (cdmi_desc)
-		vfree(cdmi_desc);
+		srb_cdmi_desc_free(cdmi_desc);
 err_out_mod:
 	SRB_LOG_ERR(srb_log, "Error creating volume %s", filename);
 
@@ -1466,7 +2523,7 @@ int srb_device_extend(const char *filename, unsigned long long size)
 	spin_lock(&devtab_lock);
 	for (i = 0; i < DEV_MAX; ++i) {
 		if (!device_free_slot(&devtab[i])) {
-			const char *fname = kbasename(devtab[i].thread_cdmi_desc[0]->filename);
+			const char *fname = kbasename(devtab[i].filename);
 			if (strlen(fname) == strlen(filename) && strncmp(fname, filename, strlen(filename)) == 0) {
 				dev = &devtab[i];
 				if (dev->state == DEV_IN_USE)
@@ -1484,12 +2541,11 @@ int srb_device_extend(const char *filename, unsigned long long size)
 		return rc;
 	}
 
-	cdmi_desc = vmalloc(sizeof(struct srb_cdmi_desc_s));
+	cdmi_desc = srb_cdmi_desc_alloc(SRB_XMIT_BUFFER_SIZE);
 	if (cdmi_desc == NULL) {
 		rc = -ENOMEM;
 		goto err_out_mod;
 	}
-	memset(cdmi_desc, 0, sizeof(struct srb_cdmi_desc_s));
 
 	/* Now, setup a cdmi connection then Truncate(create) the file. */
 	rc = _srb_server_pick(filename, cdmi_desc);
@@ -1509,14 +2565,15 @@ int srb_device_extend(const char *filename, unsigned long long size)
 		goto err_out_cdmi;
 
 	if (cdmi_desc)
-		vfree(cdmi_desc);
+		srb_cdmi_desc_free(cdmi_desc);
 
 	// Find device (normally only 1) associated to filename and update their size
 	spin_lock(&devtab_lock);
 	if (dev) {
+		/* Before the device can read its new end */
+		srb_zmap_resize(dev, devtab[i].disk_size, size);
 		devtab[i].disk_size = size;
-		set_capacity(devtab[i].disk, devtab[i].disk_size / 512ULL);
-		revalidate_disk(devtab[i].disk);
+		srb_set_capacity(devtab[i].disk, devtab[i].disk_size / 512ULL);
 		dev->state = DEV_UNUSED;
 	}
 	spin_unlock(&devtab_lock);
@@ -1529,7 +2586,7 @@ err_out_cdmi:
 	srb_cdmi_disconnect(&debug, cdmi_desc);
 err_out_alloc:
 	if (cdmi_desc)
-		vfree(cdmi_desc);
+		srb_cdmi_desc_free(cdmi_desc);
 err_out_mod:
 	SRB_LOG_ERR(srb_log, "Error extending device %s", filename);
 
@@ -1554,7 +2611,7 @@ int srb_device_destroy(const char *filename)
 	for (i = 0; i < DEV_MAX; ++i) {
 		if (!device_free_slot(&devtab[i])) {
 			const char *fname = kbasename(
-				devtab[i].thread_cdmi_desc[0]->filename);
+				devtab[i].filename);
 			if (strlen(fname) == strlen(filename) && strncmp(fname, filename, strlen(fname)) == 0) {
 				found = 1;
 				break;
@@ -1569,7 +2626,7 @@ int srb_device_destroy(const char *filename)
 		goto err_out_mod;
 	}
 
-	cdmi_desc = vmalloc(sizeof(struct srb_cdmi_desc_s));
+	cdmi_desc = srb_cdmi_desc_alloc(SRB_XMIT_BUFFER_SIZE);
 	if (cdmi_desc == NULL) {
 		SRB_LOG_ERR(srb_log, "Unable to allocate memory for temporary CDMI");
 		rc = -ENOMEM;
@@ -1592,7 +2649,7 @@ int srb_device_destroy(const char *filename)
 	srb_cdmi_disconnect(&debug, cdmi_desc);
 
 	if (cdmi_desc)
-		vfree(cdmi_desc);
+		srb_cdmi_desc_free(cdmi_desc);
 
 	SRB_LOG_INFO(srb_log, "Destroyed volume %s", filename);
 
@@ -1602,7 +2659,7 @@ err_out_cdmi:
 	srb_cdmi_disconnect(&debug, cdmi_desc);
 err_out_alloc:
 	if (cdmi_desc)
-		vfree(cdmi_desc);
+		srb_cdmi_desc_free(cdmi_desc);
 err_out_mod:
 	SRB_LOG_ERR(srb_log, "Error destroying volume %s", filename);
 
@@ -1618,9 +2675,36 @@ static int __init srb_init(void)
 	/* Zeroing device tab */
 	memset(devtab, 0, sizeof(devtab));
 
+	if (thread_pool_size < 1) {
+		SRB_LOG_WARN(srb_log, "Invalid thread_pool_size %u, using %u",
+			     thread_pool_size, SRB_THREAD_POOL_SIZE_DFLT);
+		thread_pool_size = SRB_THREAD_POOL_SIZE_DFLT;
+	}
+
+	if (pipeline_depth < 1 || pipeline_depth > SRB_PIPELINE_DEPTH_MAX) {
+		SRB_LOG_WARN(srb_log, "Invalid pipeline_depth %u, using %u",
+			     pipeline_depth, SRB_PIPELINE_DEPTH_DFLT);
+		pipeline_depth = SRB_PIPELINE_DEPTH_DFLT;
+	}
+
+	rc = srb_engine_init();
+	if (rc) {
+		SRB_LOG_ERR(srb_log, "Failed to create workqueue: %d", rc);
+		return rc;
+	}
+
+	rc = srb_cache_init();
+	if (rc) {
+		SRB_LOG_ERR(srb_log, "Failed to register cache shrinker: %d", rc);
+		srb_engine_cleanup();
+		return rc;
+	}
+
 	rc = srb_sysfs_init();
 	if (rc) {
 		SRB_LOG_ERR(srb_log, "Failed to initialize with code: %d", rc);
+		srb_cache_cleanup();
+		srb_engine_cleanup();
 		return rc;
 	}
 
@@ -1634,6 +2718,8 @@ static void __exit srb_cleanup(void)
 	_srb_detach_devices();
 
 	srb_sysfs_cleanup();
+	srb_cache_cleanup();
+	srb_engine_cleanup();
 }
 
 module_init(srb_init);
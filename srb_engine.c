@@ -0,0 +1,1247 @@
+/*
+ * Copyright (C) 2014 SCALITY SA - http://www.scality.com
+ *
+ * This file is part of ScalityRestBlock.
+ *
+ * ScalityRestBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ScalityRestBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ScalityRestBlock.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Asynchronous request engine
+ *
+ * Each connection of an attached device owns a FIFO of commands to send and
+ * a FIFO of commands waiting for their response. The socket callbacks only
+ * schedule the connection's work item on the module-wide workqueue, which
+ * then moves the commands through their send and receive states using
+ * non-blocking socket operations, until the socket would block.
+ *
+ * Sending and receiving are independent, so up to pipeline_depth commands
+ * are in flight on each connection whatever their direction.
+ *
+ * The connections to a server are pooled and shared by all the devices of
+ * its volumes: a command goes to the least loaded connection, and a new
+ * one is created in the background when they are all full, up to
+ * thread_pool_size connections per server.
+ *
+ * Sockets are renewed according to the keep-alive terms of the server's
+ * responses: a connection stops sending once the server's max number of
+ * requests is reached, and switches to the spare socket the pool keeps
+ * connected as soon as its pipeline drained. Connections idle for most of
+ * the server's timeout are closed before the server does it.
+ *
+ * When a connection fails, the commands it was transmitting are handed back
+ * to their device, which sends them again through another of its servers
+ * (see srb_resubmit). After ENGINE_BREAKER_THRESHOLD consecutive failures,
+ * a server is deemed down and the devices avoid it, until its keep-alive
+ * manager manages to connect to it again.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/sched.h>
+#include <linux/socket.h>
+#include <linux/tcp.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include "srb.h"
+
+/* The connection's xmit_buff holds the request header, then the response */
+#define ENGINE_RECV_AREA(desc)	((desc)->xmit_buff + SRB_HTTP_HEADER_SIZE)
+#define ENGINE_RECV_SIZE	SRB_HTTP_HEADER_SIZE
+#define ENGINE_XMIT_SIZE	(SRB_HTTP_HEADER_SIZE + ENGINE_RECV_SIZE)
+
+#define ENGINE_WATCHDOG_DELAY	HZ
+#define ENGINE_KEEPALIVE_DELAY	HZ
+#define ENGINE_PROBE_DELAY	(5 * HZ)	/* While the server is down */
+#define ENGINE_BREAKER_THRESHOLD 3
+
+static struct workqueue_struct *srb_wq;
+
+/* Connection pools, one per server in use */
+static LIST_HEAD(srb_pools);
+static DEFINE_MUTEX(srb_pools_lock);
+
+/*
+ * Socket callbacks, called in softirq context: the actual work is deferred
+ * to the connection's work item.
+ */
+static void conn_schedule(struct sock *sk)
+{
+	struct srb_cdmi_desc_s *desc;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	desc = sk->sk_user_data;
+	if (desc)
+		queue_work(srb_wq, &desc->work);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void conn_data_ready(SRB_DATA_READY_ARGS)
+{
+	conn_schedule(sk);
+}
+
+static void conn_write_space(struct sock *sk)
+{
+	conn_schedule(sk);
+}
+
+static void conn_state_change(struct sock *sk)
+{
+	conn_schedule(sk);
+}
+
+static void conn_hook(struct srb_cdmi_desc_s *desc)
+{
+	struct sock *sk = desc->socket->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	desc->saved_data_ready = sk->sk_data_ready;
+	desc->saved_write_space = sk->sk_write_space;
+	desc->saved_state_change = sk->sk_state_change;
+	sk->sk_user_data = desc;
+	sk->sk_data_ready = conn_data_ready;
+	sk->sk_write_space = conn_write_space;
+	sk->sk_state_change = conn_state_change;
+	sk->sk_allocation = GFP_NOIO | __GFP_MEMALLOC;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void conn_unhook(struct srb_cdmi_desc_s *desc)
+{
+	struct sock *sk;
+
+	if (!desc->socket)
+		return;
+
+	sk = desc->socket->sk;
+	write_lock_bh(&sk->sk_callback_lock);
+	if (sk->sk_user_data == desc) {
+		sk->sk_user_data = NULL;
+		sk->sk_data_ready = desc->saved_data_ready;
+		sk->sk_write_space = desc->saved_write_space;
+		sk->sk_state_change = desc->saved_state_change;
+	}
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+/* Tells whether the socket can still be used (or is being connected) */
+static int sock_alive(struct socket *sock)
+{
+	return (1 << sock->sk->sk_state) & (TCPF_ESTABLISHED | TCPF_SYN_SENT);
+}
+
+/*
+ * Circuit breaker of the pool: the server is deemed down after
+ * ENGINE_BREAKER_THRESHOLD consecutive failures, and up again as soon as a
+ * command completes or a connection could be established.
+ */
+static void pool_failed(struct srb_conn_pool_s *pool)
+{
+	unsigned long flags;
+	int down = 0;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (++pool->failures >= ENGINE_BREAKER_THRESHOLD && !pool->down) {
+		pool->down = 1;
+		pool->probe_at = jiffies + ENGINE_PROBE_DELAY;
+		down = 1;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (down)
+		SRB_LOG_WARN(pool->debug.level, "Server unavailable, failing over");
+}
+
+static void pool_succeeded(struct srb_conn_pool_s *pool)
+{
+	unsigned long flags;
+	int up = 0;
+
+	if (pool->failures == 0)
+		return;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	pool->failures = 0;
+	if (pool->down) {
+		pool->down = 0;
+		up = 1;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (up)
+		SRB_LOG_NOTICE(pool->debug.level, "Server available again");
+}
+
+/* Tells whether the devices should send their requests to the server */
+int srb_engine_pool_healthy(struct srb_conn_pool_s *pool)
+{
+	return !pool->down;
+}
+
+/*
+ * Takes the spare socket of the pool, if it is still usable, and has the
+ * keep-alive manager connect the next one right away.
+ */
+static struct socket *pool_take_spare(struct srb_conn_pool_s *pool)
+{
+	struct socket *sock;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	sock = pool->spare;
+	pool->spare = NULL;
+	if (!pool->stopping)
+		mod_delayed_work(srb_wq, &pool->keepalive, 0);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (sock && !sock_alive(sock)) {
+		srb_cdmi_sock_close(sock);
+		sock = NULL;
+	}
+
+	return sock;
+}
+
+/* Connects through the pool's spare socket, or a new one if there is none */
+static int conn_connect(struct srb_cdmi_desc_s *desc)
+{
+	struct socket *sock;
+	int ret;
+
+	sock = pool_take_spare(desc->pool);
+	if (sock) {
+		srb_cdmi_adopt(desc->dbg, desc, sock);
+	} else {
+		ret = srb_cdmi_connect(desc->dbg, desc);
+		if (ret)
+			return ret;
+	}
+
+	conn_hook(desc);
+	desc->deadline = jiffies + req_timeout * HZ;
+	desc->idle_since = jiffies;
+	desc->nb_answered = 0;
+	desc->max_requests = ULLONG_MAX;
+
+	return 0;
+}
+
+static void conn_disconnect(struct srb_cdmi_desc_s *desc)
+{
+	conn_unhook(desc);
+	srb_cdmi_disconnect(desc->dbg, desc);
+	desc->rcvd = 0;
+	srb_http_parser_init(&desc->parser);
+}
+
+/*
+ * Fills the connection's iov with the bytes of the command's stream
+ * starting at pos: the first hdr_len bytes come from hdr, then from the
+ * first nr_sgl segments of the command's scatterlist. The iov has room for
+ * a whole command, so that it goes through a single socket call.
+ *
+ * Returns the number of vectors used, their total length in *len.
+ */
+static int cmd_iov(struct srb_cdmi_desc_s *desc, struct srb_cmd_s *cmd,
+		   char *hdr, int hdr_len, int pos, int nr_sgl, size_t *len)
+{
+	struct kvec *iov = desc->iov;
+	int nr = 0;
+	int i;
+
+	*len = 0;
+	if (pos < hdr_len) {
+		iov[0].iov_base = hdr + pos;
+		iov[0].iov_len = hdr_len - pos;
+		*len = iov[0].iov_len;
+		nr = 1;
+		pos = 0;
+	} else {
+		pos -= hdr_len;
+	}
+
+	for (i = 0; i < nr_sgl && nr < desc->nr_iov; i++) {
+		int length = cmd->sgl[i].length;
+
+		if (pos >= length) {
+			pos -= length;
+			continue;
+		}
+		iov[nr].iov_base = (char *)sg_virt(&cmd->sgl[i]) + pos;
+		iov[nr].iov_len = length - pos;
+		*len += iov[nr].iov_len;
+		nr++;
+		pos = 0;
+	}
+
+	return nr;
+}
+
+/*
+ * Non-blocking send or receive. With more set, the data is corked until the
+ * next send instead of being pushed right away (TCP_NODELAY is set).
+ *
+ * Returns the number of bytes transferred, -EAGAIN if the socket would
+ * block, or a negative value depending the error.
+ */
+static int conn_xmit(struct srb_cdmi_desc_s *desc, int send, int more,
+		     struct kvec *iov, int nr, size_t len)
+{
+	struct msghdr msg;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+	if (more)
+		msg.msg_flags |= MSG_MORE;
+
+	if (send)
+		ret = kernel_sendmsg(desc->socket, &msg, iov, nr, len);
+	else
+		ret = kernel_recvmsg(desc->socket, &msg, iov, nr, len,
+				     msg.msg_flags);
+	if (ret == 0)
+		return -EPIPE;
+	/* The handshake of a Fast Open connection is not over yet */
+	if (ret == -EINPROGRESS)
+		return -EAGAIN;
+	if (ret > 0)
+		desc->deadline = jiffies + req_timeout * HZ;
+
+	return ret;
+}
+
+/*
+ * Sends the payload of the command from cmd->sent on, handing its pages
+ * over to the socket without copying them. TCP takes its own reference on
+ * each page until the data is acknowledged, and the request is completed
+ * once the server answered, so the pages stay untouched meanwhile.
+ *
+ * Returns the number of bytes sent, -EAGAIN if the socket would block
+ * before anything was sent, or a negative value depending the error.
+ */
+static int conn_send_pages(struct srb_cdmi_desc_s *desc, struct srb_cmd_s *cmd,
+			   int nr_sgl, int total, int more)
+{
+	int pos = cmd->sent - cmd->hdr_len;
+	int done = 0;
+	int i;
+
+	for (i = 0; i < nr_sgl; i++) {
+		struct scatterlist *sg = &cmd->sgl[i];
+
+		if (pos >= sg->length) {
+			pos -= sg->length;
+			continue;
+		}
+		while (pos < sg->length) {
+			unsigned int off = sg->offset + pos;
+			struct page *page = nth_page(sg_page(sg), off >> PAGE_SHIFT);
+			size_t len = min_t(size_t, PAGE_SIZE - (off & ~PAGE_MASK),
+					   sg->length - pos);
+			int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+			int ret;
+
+			if (more || cmd->sent + done + len < total)
+				flags |= MSG_MORE;
+			if (srb_sendpage_ok(page)) {
+				ret = srb_sock_sendpage(desc->socket, page,
+							off & ~PAGE_MASK, len,
+							flags);
+				if (ret == 0)
+					ret = -EPIPE;
+				if (ret > 0)
+					desc->deadline = jiffies + req_timeout * HZ;
+			} else {
+				struct kvec iov = {
+					.iov_base = (char *)sg_virt(sg) + pos,
+					.iov_len = len,
+				};
+
+				ret = conn_xmit(desc, 1, flags & MSG_MORE,
+						&iov, 1, len);
+			}
+			if (ret < 0)
+				return done ? done : ret;
+			done += ret;
+			pos += ret;
+			if (ret < len)
+				return done;
+		}
+		pos = 0;
+	}
+
+	return done;
+}
+
+/* Builds the command's request header in the send area */
+static int cmd_mkheader(struct srb_cdmi_desc_s *desc, struct srb_cmd_s *cmd)
+{
+	const struct srb_http_tmpl_s *tmpl = cmd->tmpl;
+	uint64_t end = cmd->offset + cmd->size - 1;
+
+	switch (cmd->op) {
+	case SRB_CMD_READ:
+		return srb_http_mkrange_tmpl(tmpl, desc->xmit_buff,
+					     SRB_HTTP_HEADER_SIZE, 0,
+					     cmd->offset, end, 0);
+	case SRB_CMD_WRITE:
+		return srb_http_mkrange_tmpl(tmpl, desc->xmit_buff,
+					     SRB_HTTP_HEADER_SIZE, 1,
+					     cmd->offset, end, cmd->fua);
+	case SRB_CMD_SYNC:
+		return srb_http_mksync(tmpl, desc->xmit_buff,
+				       SRB_HTTP_HEADER_SIZE);
+	case SRB_CMD_DISCARD:
+		return srb_http_mkdiscard(tmpl, desc->xmit_buff,
+					  SRB_HTTP_HEADER_SIZE,
+					  cmd->offset, end);
+	case SRB_CMD_ZERO:
+		return srb_http_mkzero(tmpl, desc->xmit_buff,
+				       SRB_HTTP_HEADER_SIZE, cmd->offset, end);
+	case SRB_CMD_WRITE_SAME:
+		return srb_http_mkwritesame(tmpl, desc->xmit_buff,
+					    SRB_HTTP_HEADER_SIZE, cmd->offset,
+					    end, cmd->sgl[0].length);
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Tells whether the command is to be followed right away by the next one of
+ * the send queue. desc->lock held.
+ */
+static int __conn_send_more(struct srb_cdmi_desc_s *desc,
+			    struct srb_cmd_s *cmd)
+{
+	return !list_is_last(&cmd->list, &desc->send_queue) &&
+		desc->nb_inflight + 1 < pipeline_depth &&
+		desc->nb_requests < desc->max_requests;
+}
+
+/*
+ * Accounts for a command leaving the pool, along with its latency when it
+ * succeeded: the average weighs the last command for 1/8.
+ */
+static void pool_cmd_done(struct srb_conn_pool_s *pool, struct srb_cmd_s *cmd,
+			  int error)
+{
+	unsigned long latency;
+
+	atomic_dec(&pool->nb_queued);
+	if (error)
+		return;
+	latency = ktime_us_delta(ktime_get(), cmd->start);
+	pool->latency = pool->latency - (pool->latency >> 3) + (latency >> 3);
+}
+
+/*
+ * Sends the commands of the send queue, as long as the pipeline is not full.
+ * Each command is sent with one socket call when the socket has room for
+ * it, and is corked with the next one if that one is sent right after.
+ *
+ * Returns 1 if anything was sent, 0 if not, or a negative value depending
+ * the error.
+ */
+static int conn_send(struct srb_cdmi_desc_s *desc)
+{
+	struct srb_cmd_s *cmd;
+	unsigned long flags;
+	int progress = 0;
+	size_t len;
+	int nr_sgl;
+	int total;
+	int more;
+	int zc;
+	int nr;
+	int ret;
+
+	for (;;) {
+		spin_lock_irqsave(&desc->lock, flags);
+		cmd = list_first_entry_or_null(&desc->send_queue,
+					       struct srb_cmd_s, list);
+		if (desc->nb_inflight >= pipeline_depth)
+			cmd = NULL;
+		spin_unlock_irqrestore(&desc->lock, flags);
+		if (!cmd)
+			break;
+
+		if (cmd->hdr_len == 0 && cmd->cancelled) {
+			/* A hedged read already completed by its other leg */
+			spin_lock_irqsave(&desc->lock, flags);
+			list_del_init(&cmd->list);
+			desc->nb_queued--;
+			spin_unlock_irqrestore(&desc->lock, flags);
+			pool_cmd_done(desc->pool, cmd, -ECANCELED);
+			srb_end_cmd(cmd, -ECANCELED);
+			continue;
+		}
+
+		if (cmd->hdr_len == 0) {
+			/* The connection is renewed once the pipeline drained */
+			if (desc->nb_requests >= desc->max_requests)
+				break;
+			ret = cmd_mkheader(desc, cmd);
+			if (ret <= 0)
+				return -EIO;
+			cmd->hdr_len = ret;
+			cmd->sent = 0;
+			desc->nb_requests++;
+		}
+
+		total = cmd->hdr_len;
+		nr_sgl = 0;
+		if (cmd->op == SRB_CMD_WRITE) {
+			total += cmd->size;
+			nr_sgl = cmd->sgl_size;
+		} else if (cmd->op == SRB_CMD_WRITE_SAME) {
+			/* A single logical block */
+			total += cmd->sgl[0].length;
+			nr_sgl = 1;
+		}
+
+		spin_lock_irqsave(&desc->lock, flags);
+		more = __conn_send_more(desc, cmd);
+		spin_unlock_irqrestore(&desc->lock, flags);
+
+		/* Only the header is copied when the pages go as they are */
+		zc = zero_copy && nr_sgl > 0;
+		while (cmd->sent < total) {
+			if (zc && cmd->sent >= cmd->hdr_len) {
+				ret = conn_send_pages(desc, cmd, nr_sgl, total,
+						      more);
+			} else {
+				nr = cmd_iov(desc, cmd, desc->xmit_buff,
+					     cmd->hdr_len, cmd->sent,
+					     zc ? 0 : nr_sgl, &len);
+				ret = conn_xmit(desc, 1,
+						more || cmd->sent + len < total,
+						desc->iov, nr, len);
+			}
+			if (ret == -EAGAIN)
+				return progress;
+			if (ret < 0)
+				return ret;
+			cmd->sent += ret;
+			progress = 1;
+		}
+
+		spin_lock_irqsave(&desc->lock, flags);
+		list_move_tail(&cmd->list, &desc->inflight);
+		desc->nb_inflight++;
+		spin_unlock_irqrestore(&desc->lock, flags);
+	}
+
+	return progress;
+}
+
+/*
+ * Receives and checks the header of the oldest command's response, along
+ * with the whole response if it is an acknowledgement (anything but a
+ * GET). Bytes received past the response belong to the next ones and stay
+ * in the receive area.
+ *
+ * Returns 1 once done, 0 if the socket would block, or a negative value
+ * depending the error.
+ */
+static int conn_receive_header(struct srb_cdmi_desc_s *desc,
+			       struct srb_cmd_s *cmd)
+{
+	struct srb_http_parser_s *parser = &desc->parser;
+	char *rcvbuf = ENGINE_RECV_AREA(desc);
+	struct kvec iov;
+	int consumed;
+	int extra;
+	int need;
+	int ret;
+
+	need = srb_http_parse_response(parser, rcvbuf, desc->rcvd);
+	while (need != 0 &&
+	       (parser->state != SRB_HTTP_PARSE_BODY || cmd->op != SRB_CMD_READ)) {
+		if (need < 0) {
+			SRB_LOG_ERR(desc->dbg->level, "Malformed HTTP response");
+			return -EIO;
+		}
+		if (desc->rcvd == ENGINE_RECV_SIZE) {
+			SRB_LOG_ERR(desc->dbg->level, "HTTP response too large");
+			return -EIO;
+		}
+		iov.iov_base = rcvbuf + desc->rcvd;
+		iov.iov_len = ENGINE_RECV_SIZE - desc->rcvd;
+		ret = conn_xmit(desc, 0, 0, &iov, 1, iov.iov_len);
+		if (ret == -EAGAIN)
+			return 0;
+		if (ret < 0)
+			return ret;
+		desc->rcvd += ret;
+		need = srb_http_parse_response(parser, rcvbuf, desc->rcvd);
+	}
+
+	if (cmd->op != SRB_CMD_READ) {
+		if (parser->code != SRB_HTTP_STATUS_NOCONTENT) {
+			SRB_LOG_ERR(desc->dbg->level, "Unable to get back HTTP confirmation buffer"
+				    " (status %i)", parser->code);
+			return -EIO;
+		}
+		consumed = parser->hdr_size + parser->content_length;
+		cmd->body_rcvd = 0;
+	} else {
+		if (srb_http_get_status_range(parser->code) != SRB_HTTP_STATUSRANGE_SUCCESS) {
+			SRB_LOG_ERR(desc->dbg->level, "Http server responded with bad status: %i",
+				    parser->code);
+			return -EIO;
+		}
+		if (parser->content_length != cmd->size) {
+			SRB_LOG_ERR(desc->dbg->level, "Unexpected response length: %llu (expected %d)",
+				    (unsigned long long)parser->content_length, cmd->size);
+			return -EIO;
+		}
+
+		/* A hole of the volume reads as zeroes (see srb_zmap_hint) */
+		if (parser->hole)
+			srb_zmap_hint(cmd->dev, cmd->offset, cmd->size,
+				      cmd->zmap_wseq);
+
+		/* The losing leg of a hedged read throws its body away */
+		cmd->discard = !srb_read_claim(cmd);
+
+		/* Part of the body may have been received along with the header */
+		extra = SRB_MIN(desc->rcvd - parser->hdr_size, cmd->size);
+		if (extra > 0 && !cmd->discard &&
+		    sg_copy_from_buffer(cmd->sgl, cmd->sgl_size,
+					rcvbuf + parser->hdr_size, extra) != extra)
+			return -EIO;
+		consumed = parser->hdr_size + extra;
+		cmd->body_rcvd = extra;
+	}
+
+	desc->rcvd -= consumed;
+	if (desc->rcvd > 0)
+		memmove(rcvbuf, rcvbuf + consumed, desc->rcvd);
+
+	return 1;
+}
+
+/*
+ * Receives the rest of a GET response's body straight into the request's
+ * pages, or into the receive area (empty until the body is received) when
+ * it is discarded.
+ */
+static int conn_receive_body(struct srb_cdmi_desc_s *desc,
+			     struct srb_cmd_s *cmd)
+{
+	struct kvec iov;
+	size_t len;
+	int nr;
+	int ret;
+
+	while (cmd->body_rcvd < cmd->size) {
+		if (cmd->discard) {
+			iov.iov_base = ENGINE_RECV_AREA(desc);
+			iov.iov_len = SRB_MIN(cmd->size - cmd->body_rcvd,
+					      ENGINE_RECV_SIZE);
+			ret = conn_xmit(desc, 0, 0, &iov, 1, iov.iov_len);
+		} else {
+			nr = cmd_iov(desc, cmd, NULL, 0, cmd->body_rcvd,
+				     cmd->sgl_size, &len);
+			ret = conn_xmit(desc, 0, 0, desc->iov, nr, len);
+		}
+		if (ret == -EAGAIN)
+			return 0;
+		if (ret < 0)
+			return ret;
+		cmd->body_rcvd += ret;
+	}
+
+	return 1;
+}
+
+/*
+ * Records the keep-alive terms of the response just received: how many more
+ * requests the server accepts on this connection, and how long it keeps an
+ * idle one.
+ */
+static void conn_keepalive(struct srb_cdmi_desc_s *desc)
+{
+	struct srb_http_parser_s *parser = &desc->parser;
+
+	desc->nb_answered++;
+	desc->idle_since = jiffies;
+	if (parser->ka_close)
+		desc->max_requests = desc->nb_answered;
+	else if (parser->ka_max >= 0)
+		desc->max_requests = desc->nb_answered + parser->ka_max;
+	if (parser->ka_timeout > 0)
+		desc->pool->ka_timeout = parser->ka_timeout * HZ;
+}
+
+/*
+ * Receives the responses of the in-flight commands, completing them in
+ * order.
+ *
+ * Returns 1 if any command completed, 0 if not, or a negative value
+ * depending the error.
+ */
+static int conn_receive(struct srb_cdmi_desc_s *desc)
+{
+	struct srb_cmd_s *cmd;
+	unsigned long flags;
+	int progress = 0;
+	int ret;
+
+	for (;;) {
+		spin_lock_irqsave(&desc->lock, flags);
+		cmd = list_first_entry_or_null(&desc->inflight,
+					       struct srb_cmd_s, list);
+		spin_unlock_irqrestore(&desc->lock, flags);
+		if (!cmd)
+			break;
+
+		if (cmd->body_rcvd < 0) {
+			ret = conn_receive_header(desc, cmd);
+			if (ret <= 0)
+				return ret < 0 ? ret : progress;
+		}
+		if (cmd->op == SRB_CMD_READ) {
+			ret = conn_receive_body(desc, cmd);
+			if (ret <= 0)
+				return ret < 0 ? ret : progress;
+		}
+
+		spin_lock_irqsave(&desc->lock, flags);
+		list_del_init(&cmd->list);
+		desc->nb_inflight--;
+		desc->nb_queued--;
+		spin_unlock_irqrestore(&desc->lock, flags);
+
+		conn_keepalive(desc);
+		srb_http_parser_init(&desc->parser);
+		pool_cmd_done(desc->pool, cmd, 0);
+		pool_succeeded(desc->pool);
+		srb_end_cmd(cmd, 0);
+		progress = 1;
+	}
+
+	/* Nothing may come from the server while no request is in flight */
+	if (desc->rcvd > 0) {
+		SRB_LOG_ERR(desc->dbg->level, "Unexpected data received from server");
+		return -EIO;
+	}
+
+	return progress;
+}
+
+/*
+ * Drops the connection after an error. The commands which were (even
+ * partially) transmitted are handed back to their device to be sent again
+ * from scratch, possibly to another server, unless they exhausted their
+ * nb_req_retries attempts. If all is set, every queued command counts an
+ * attempt (the connection could not be established). Once the server is
+ * deemed down, the commands not sent yet are handed back as well. When the
+ * connection is being stopped, every command fails.
+ */
+static void conn_reset(struct srb_cdmi_desc_s *desc, int error, int all)
+{
+	struct srb_cmd_s *cmd, *tmp;
+	unsigned long flags;
+	LIST_HEAD(failed);
+	LIST_HEAD(resubmit);
+	int failover;
+	int sent;
+
+	SRB_LOG_NOTICE(desc->dbg->level, "Connection error %d, %d requests pending",
+		       error, desc->nb_queued);
+
+	conn_disconnect(desc);
+	if (!desc->stopping)
+		pool_failed(desc->pool);
+	failover = !srb_engine_pool_healthy(desc->pool);
+
+	spin_lock_irqsave(&desc->lock, flags);
+	list_splice_init(&desc->inflight, &desc->send_queue);
+	desc->nb_inflight = 0;
+	list_for_each_entry_safe(cmd, tmp, &desc->send_queue, list) {
+		sent = cmd->hdr_len > 0 || all;
+		if (!sent && !failover)
+			break;
+		cmd->hdr_len = 0;
+		cmd->sent = 0;
+		cmd->body_rcvd = -1;
+		if (desc->stopping || (sent && ++cmd->attempts >= nb_req_retries))
+			list_move_tail(&cmd->list, &failed);
+		else
+			list_move_tail(&cmd->list, &resubmit);
+		desc->nb_queued--;
+	}
+	spin_unlock_irqrestore(&desc->lock, flags);
+
+	list_for_each_entry_safe(cmd, tmp, &failed, list) {
+		list_del_init(&cmd->list);
+		SRB_LOG_ERR(desc->dbg->level, "CDMI Request using scatterlist failed"
+			    " with IO error: %d", error);
+		pool_cmd_done(desc->pool, cmd, -EIO);
+		srb_end_cmd(cmd, -EIO);
+	}
+	list_for_each_entry_safe(cmd, tmp, &resubmit, list) {
+		list_del_init(&cmd->list);
+		pool_cmd_done(desc->pool, cmd, error);
+		srb_resubmit(cmd);
+	}
+}
+
+/* Tells whether a command is being transmitted on the connection */
+static int conn_busy(struct srb_cdmi_desc_s *desc)
+{
+	struct srb_cmd_s *cmd;
+	unsigned long flags;
+	int busy;
+
+	spin_lock_irqsave(&desc->lock, flags);
+	cmd = list_first_entry_or_null(&desc->send_queue,
+				       struct srb_cmd_s, list);
+	busy = desc->nb_inflight > 0 || (cmd && cmd->hdr_len > 0);
+	spin_unlock_irqrestore(&desc->lock, flags);
+
+	return busy;
+}
+
+static void conn_work(struct work_struct *work)
+{
+	struct srb_cdmi_desc_s *desc = container_of(work, struct srb_cdmi_desc_s,
+						    work);
+	unsigned long pflags = current->flags;
+	unsigned long flags;
+	int progress;
+	int retire;
+	int error;
+	int ret;
+
+	current->flags |= PF_MEMALLOC;
+	for (;;) {
+		spin_lock_irqsave(&desc->lock, flags);
+		error = desc->error;
+		desc->error = 0;
+		retire = desc->retire && desc->nb_queued == 0;
+		desc->retire = 0;
+		spin_unlock_irqrestore(&desc->lock, flags);
+		if (error)
+			conn_reset(desc, error, 0);
+		if (retire && desc->socket) {
+			SRB_LOG_DEBUG(desc->dbg->level, "Closing idle connection");
+			conn_disconnect(desc);
+		}
+
+		if (!desc->socket) {
+			if (desc->nb_queued == 0 || desc->stopping)
+				break;
+			ret = conn_connect(desc);
+			if (ret) {
+				conn_reset(desc, ret, 1);
+				continue;
+			}
+		}
+
+		do {
+			progress = 0;
+			ret = conn_send(desc);
+			if (ret < 0)
+				break;
+			progress |= ret;
+			ret = conn_receive(desc);
+			if (ret < 0)
+				break;
+			progress |= ret;
+			cond_resched();
+		} while (progress);
+		if (ret < 0) {
+			conn_reset(desc, ret, 0);
+			continue;
+		}
+
+		/*
+		 * Renew the connection once the server closed it, or once it
+		 * served the number of requests the server allows, as soon as
+		 * nothing is in flight.
+		 */
+		if (!sock_alive(desc->socket)) {
+			if (conn_busy(desc)) {
+				conn_reset(desc, -EPIPE, 0);
+				continue;
+			}
+			conn_disconnect(desc);
+			continue;
+		}
+		if (desc->nb_requests >= desc->max_requests && !conn_busy(desc)) {
+			SRB_LOG_DEBUG(desc->dbg->level, "Server ends the connection after %llu requests, renewing it",
+				      (unsigned long long)desc->nb_requests);
+			conn_disconnect(desc);
+			continue;
+		}
+		break;
+	}
+	srb_restore_flags(pflags, PF_MEMALLOC);
+}
+
+/*
+ * Resets the connection when it made no progress for req_timeout seconds
+ * while commands were being transmitted.
+ */
+static void conn_watchdog(struct work_struct *work)
+{
+	struct srb_cdmi_desc_s *desc = container_of(to_delayed_work(work),
+						    struct srb_cdmi_desc_s,
+						    watchdog);
+	struct srb_cmd_s *cmd;
+	unsigned long flags;
+	int expired = 0;
+
+	spin_lock_irqsave(&desc->lock, flags);
+	cmd = list_first_entry_or_null(&desc->send_queue,
+				       struct srb_cmd_s, list);
+	if ((desc->nb_inflight > 0 || (cmd && cmd->hdr_len > 0)) &&
+	    time_after(jiffies, desc->deadline)) {
+		desc->error = -ETIMEDOUT;
+		expired = 1;
+	}
+	if (desc->nb_queued > 0 && !desc->stopping)
+		queue_delayed_work(srb_wq, &desc->watchdog,
+				   ENGINE_WATCHDOG_DELAY);
+	spin_unlock_irqrestore(&desc->lock, flags);
+
+	if (expired) {
+		SRB_LOG_WARN(desc->dbg->level, "Request timed out after %us",
+			     req_timeout);
+		queue_work(srb_wq, &desc->work);
+	}
+}
+
+/* Queues a command on the connection */
+static void conn_queue(struct srb_cdmi_desc_s *desc, struct srb_cmd_s *cmd)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&desc->lock, flags);
+	list_add_tail(&cmd->list, &desc->send_queue);
+	if (desc->nb_queued++ == 0)
+		queue_delayed_work(srb_wq, &desc->watchdog,
+				   ENGINE_WATCHDOG_DELAY);
+	spin_unlock_irqrestore(&desc->lock, flags);
+
+	queue_work(srb_wq, &desc->work);
+}
+
+/*
+ * Creates a connection of the pool, with room for the largest command of
+ * its devices in a single socket call. It connects on its first command.
+ */
+static struct srb_cdmi_desc_s *conn_create(struct srb_conn_pool_s *pool)
+{
+	struct srb_cdmi_desc_s *desc;
+
+	desc = srb_cdmi_desc_alloc(ENGINE_XMIT_SIZE);
+	if (!desc)
+		return NULL;
+
+	desc->nr_iov = pool->max_segs + 1;
+	desc->iov = vmalloc(desc->nr_iov * sizeof(struct kvec));
+	if (!desc->iov) {
+		srb_cdmi_desc_free(desc);
+		return NULL;
+	}
+
+	strcpy(desc->ip_addr, pool->ip_addr);
+	desc->port = pool->port;
+	desc->timeout = req_timeout;
+	desc->fastopen = tcp_fastopen;
+	desc->pool = pool;
+	desc->dbg = &pool->debug;
+	spin_lock_init(&desc->lock);
+	INIT_LIST_HEAD(&desc->send_queue);
+	INIT_LIST_HEAD(&desc->inflight);
+	desc->deadline = jiffies;
+	srb_http_parser_init(&desc->parser);
+	INIT_WORK(&desc->work, conn_work);
+	INIT_DELAYED_WORK(&desc->watchdog, conn_watchdog);
+
+	return desc;
+}
+
+/*
+ * Stops the connection's engine, disconnects and frees it. The devices'
+ * queues must have been drained already: any command left is failed.
+ */
+static void conn_destroy(struct srb_cdmi_desc_s *desc)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&desc->lock, flags);
+	desc->stopping = 1;
+	spin_unlock_irqrestore(&desc->lock, flags);
+
+	conn_unhook(desc);
+	cancel_delayed_work_sync(&desc->watchdog);
+	cancel_work_sync(&desc->work);
+
+	conn_disconnect(desc);
+	if (desc->nb_queued > 0)
+		conn_reset(desc, -ESHUTDOWN, 1);
+
+	vfree(desc->iov);
+	srb_cdmi_desc_free(desc);
+}
+
+/* Adds a connection to the pool, out of the submission path */
+static void pool_grow(struct work_struct *work)
+{
+	struct srb_conn_pool_s *pool = container_of(work, struct srb_conn_pool_s,
+						    grow);
+	struct srb_cdmi_desc_s *desc;
+	unsigned long flags;
+
+	desc = conn_create(pool);
+	if (!desc)
+		SRB_LOG_WARN(pool->debug.level, "Unable to add a connection"
+			     " (%d open)", pool->nb_conns);
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (desc)
+		pool->conns[pool->nb_conns++] = desc;
+	pool->growing = 0;
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+/*
+ * Keep-alive manager of the pool, run every ENGINE_KEEPALIVE_DELAY. It keeps
+ * a spare socket connected, so that renewing a connection does not wait for
+ * a handshake, and closes the connections idle for three quarters of the
+ * server's keep-alive timeout. The spare is renewed as often.
+ *
+ * Connecting the spare also probes the health of the server: failures
+ * count towards its circuit breaker, and once the server is down, a
+ * connection attempt every ENGINE_PROBE_DELAY tells when it is back. Fast
+ * Open is not used then, as it would not reach the server.
+ */
+static void pool_keepalive(struct work_struct *work)
+{
+	struct srb_conn_pool_s *pool = container_of(to_delayed_work(work),
+						    struct srb_conn_pool_s,
+						    keepalive);
+	unsigned long expiry = pool->ka_timeout - pool->ka_timeout / 4;
+	struct srb_cdmi_desc_s *desc;
+	struct socket *sock;
+	unsigned long flags;
+	int nb_conns;
+	int retire;
+	int i;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	sock = pool->spare;
+	if (sock && (!sock_alive(sock) ||
+		     (expiry && time_after(jiffies, pool->spare_since + expiry))))
+		pool->spare = NULL;
+	else
+		sock = NULL;
+	nb_conns = pool->nb_conns;
+	spin_unlock_irqrestore(&pool->lock, flags);
+	if (sock)
+		srb_cdmi_sock_close(sock);
+
+	/* Only this work sets the spare, its first connection gives the server */
+	if (!pool->spare &&
+	    (!pool->down || time_after(jiffies, pool->probe_at))) {
+		if (srb_cdmi_sock_open(&pool->debug, pool->conns[0],
+				       tcp_fastopen && !pool->down,
+				       &sock) == 0) {
+			spin_lock_irqsave(&pool->lock, flags);
+			pool->spare = sock;
+			pool->spare_since = jiffies;
+			spin_unlock_irqrestore(&pool->lock, flags);
+			pool_succeeded(pool);
+		} else {
+			pool_failed(pool);
+			pool->probe_at = jiffies + ENGINE_PROBE_DELAY;
+		}
+	}
+
+	for (i = 0; expiry && i < nb_conns; i++) {
+		desc = pool->conns[i];
+		spin_lock_irqsave(&desc->lock, flags);
+		retire = desc->socket && desc->nb_queued == 0 &&
+			time_after(jiffies, desc->idle_since + expiry);
+		if (retire)
+			desc->retire = 1;
+		spin_unlock_irqrestore(&desc->lock, flags);
+		if (retire)
+			queue_work(srb_wq, &desc->work);
+	}
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (!pool->stopping)
+		queue_delayed_work(srb_wq, &pool->keepalive,
+				   ENGINE_KEEPALIVE_DELAY);
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+/*
+ * Queues a command on the least loaded connection of the pool, preferably
+ * an open one. It is completed through srb_end_cmd, unless it is handed
+ * back through srb_resubmit.
+ */
+void srb_engine_submit(struct srb_conn_pool_s *pool, struct srb_cmd_s *cmd)
+{
+	struct srb_cdmi_desc_s *desc = NULL;
+	unsigned long flags;
+	int i;
+
+	cmd->error = 0;
+	cmd->hdr_len = 0;
+	cmd->sent = 0;
+	cmd->body_rcvd = -1;
+	cmd->start = ktime_get();
+	atomic_inc(&pool->nb_queued);
+
+	spin_lock_irqsave(&pool->lock, flags);
+	for (i = 0; i < pool->nb_conns; i++) {
+		struct srb_cdmi_desc_s *conn = pool->conns[i];
+
+		if (desc == NULL || conn->nb_queued < desc->nb_queued ||
+		    (conn->nb_queued == desc->nb_queued &&
+		     conn->socket && !desc->socket))
+			desc = conn;
+	}
+	if (desc->nb_queued >= pipeline_depth && !pool->growing &&
+	    pool->nb_conns < thread_pool_size) {
+		pool->growing = 1;
+		queue_work(srb_wq, &pool->grow);
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	conn_queue(desc, cmd);
+}
+
+/*
+ * Load of the server, for the devices to balance their requests: the
+ * expected time for one more command to complete, in arbitrary units.
+ */
+unsigned long srb_engine_pool_load(struct srb_conn_pool_s *pool)
+{
+	return (pool->latency + 1) * (atomic_read(&pool->nb_queued) + 1);
+}
+
+/*
+ * Returns the connection pool of the server, creating it along with its
+ * first connection if no device uses it yet. max_segs is the largest
+ * number of segments of the caller's commands.
+ */
+struct srb_conn_pool_s *srb_engine_pool_get(const char *ip_addr,
+					    uint16_t port, int max_segs)
+{
+	struct srb_conn_pool_s *pool;
+
+	mutex_lock(&srb_pools_lock);
+	list_for_each_entry(pool, &srb_pools, list) {
+		if (pool->port == port && !strcmp(pool->ip_addr, ip_addr)) {
+			pool->refs++;
+			pool->max_segs = max(pool->max_segs, max_segs);
+			goto out;
+		}
+	}
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		goto out;
+	pool->conns = kcalloc(thread_pool_size, sizeof(*pool->conns),
+			      GFP_KERNEL);
+	if (!pool->conns)
+		goto err;
+
+	strcpy(pool->ip_addr, ip_addr);
+	pool->port = port;
+	snprintf(pool->name, sizeof(pool->name), "%s:%u", ip_addr, port);
+	pool->debug.name = pool->name;
+	pool->debug.level = srb_log;
+	spin_lock_init(&pool->lock);
+	atomic_set(&pool->nb_queued, 0);
+	pool->max_segs = max_segs;
+	INIT_WORK(&pool->grow, pool_grow);
+	INIT_DELAYED_WORK(&pool->keepalive, pool_keepalive);
+
+	pool->conns[0] = conn_create(pool);
+	if (!pool->conns[0])
+		goto err;
+	pool->nb_conns = 1;
+	pool->refs = 1;
+	list_add_tail(&pool->list, &srb_pools);
+	queue_delayed_work(srb_wq, &pool->keepalive, 0);
+	goto out;
+
+err:
+	kfree(pool->conns);
+	kfree(pool);
+	pool = NULL;
+out:
+	mutex_unlock(&srb_pools_lock);
+
+	return pool;
+}
+
+/* Releases the pool, stopping its connections along with its last device */
+void srb_engine_pool_put(struct srb_conn_pool_s *pool)
+{
+	unsigned long flags;
+	int i;
+
+	mutex_lock(&srb_pools_lock);
+	if (--pool->refs > 0) {
+		mutex_unlock(&srb_pools_lock);
+		return;
+	}
+	list_del(&pool->list);
+	mutex_unlock(&srb_pools_lock);
+
+	spin_lock_irqsave(&pool->lock, flags);
+	pool->stopping = 1;
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	cancel_delayed_work_sync(&pool->keepalive);
+	cancel_work_sync(&pool->grow);
+	for (i = 0; i < pool->nb_conns; i++)
+		conn_destroy(pool->conns[i]);
+	if (pool->spare)
+		srb_cdmi_sock_close(pool->spare);
+	kfree(pool->conns);
+	kfree(pool);
+}
+
+int srb_engine_init(void)
+{
+	srb_wq = alloc_workqueue(DEV_NAME, WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if (!srb_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void srb_engine_cleanup(void)
+{
+	destroy_workqueue(srb_wq);
+	srb_wq = NULL;
+}
@@ -20,6 +20,7 @@
 
 #include <linux/string.h>
 #include <linux/errno.h>
+#include <linux/math64.h>
 
 #include "srb.h"
 
@@ -30,6 +31,11 @@
 #define HTTP_KEEPALIVE	"Connection: keep-alive" CRLF \
 	                "Keep-Alive: timeout=3600 "
 #define HTTP_TRUNCATE	"X-Scal-Truncate"
+#define HTTP_SYNC	"X-Scal-Sync: 1"	/* Durable before answering */
+#define HTTP_PUNCH_HOLE	"X-Scal-Punch-Hole: 1"	/* Deallocate the range */
+#define HTTP_ZERO_RANGE	"X-Scal-Zero-Range: 1"	/* Zero, keep allocated */
+#define HTTP_WRITE_SAME	"X-Scal-Write-Same: 1"	/* Repeat the payload */
+#define HTTP_HOLE	"X-Scal-Hole"		/* Response: range is a hole */
 #define HTTP_USER_AGENT	"User-Agent: srb/" DEV_REL_VERSION
 #define HTTP_CDMI_VERS	"X-CDMI-Specification-Version: 1.0.1"
 
@@ -53,6 +59,24 @@ static int add_buffer(char **buff, int *len, char *str)
 	return 0;
 }
 
+// Known codes have their values fixed to the enum, so keep them
+// Otherwise, consider it as an unknown extension.
+static enum srb_http_statuscode http_status_code(long status)
+{
+	switch (status)
+	{
+	case 100: case 101:
+	case 200: case 201: case 202: case 203: case 204: case 205: case 206:
+	case 300: case 301: case 302: case 303: case 304: case 305: case 307:
+	case 400: case 401: case 402: case 403: case 404: case 405: case 406: case 407: case 408: case 409:
+	case 410: case 411: case 412: case 413: case 414: case 415: case 416: case 417:
+	case 500: case 501: case 502: case 503: case 504: case 505:
+		return status;
+	default:
+		return SRB_HTTP_STATUS_EXTENSION;
+	}
+}
+
 int srb_http_get_status(char *buf, int len, enum srb_http_statuscode *code)
 {
 	int ret;
@@ -86,22 +110,7 @@ int srb_http_get_status(char *buf, int len, enum srb_http_statuscode *code)
 			return -1;
 		}
 
-		// Known codes have their values fixed to the enum, so keep them
-		// Otherwise, consider it as an unknown extension.
-		switch (status)
-		{
-		case 100: case 101:
-		case 200: case 201: case 202: case 203: case 204: case 205: case 206:
-		case 300: case 301: case 302: case 303: case 304: case 305: case 307:
-		case 400: case 401: case 402: case 403: case 404: case 405: case 406: case 407: case 408: case 409:
-		case 410: case 411: case 412: case 413: case 414: case 415: case 416: case 417:
-		case 500: case 501: case 502: case 503: case 504: case 505:
-			*code = status;
-			break ;
-		default:
-			*code = SRB_HTTP_STATUS_EXTENSION;
-			break ;
-		}
+		*code = http_status_code(status);
 
 		return 0;
 	}
@@ -143,38 +152,171 @@ static int finish_buffer(char **buff, int *len)
 }
 #endif
 
-int srb_http_check_response_complete(char *buff, int len)
+/*
+ * Incremental HTTP response parser
+ *
+ * The parser is fed the whole receive buffer each time new data was appended
+ * to it, but only looks at the bytes it has not seen yet: each header line is
+ * parsed once, as soon as its LF is received. The status code, the header
+ * size, the Content-Length, the keep-alive terms of the server and its hole
+ * hint are recorded along the way.
+ */
+void srb_http_parser_init(struct srb_http_parser_s *parser)
+{
+	memset(parser, 0, sizeof(*parser));
+	parser->state = SRB_HTTP_PARSE_STATUS;
+	parser->ka_timeout = -1;
+	parser->ka_max = -1;
+}
+
+static int parse_status_line(struct srb_http_parser_s *parser,
+			     char *line, int len)
 {
-	int hdr_end = 0;
-	int ret = 1;
-	uint64_t contentlen = 0;
+	long status = 0;
+	int i;
 
-	while (hdr_end < len && ret != 0)
-	{
-		if (len - hdr_end >= 4)
-			ret = strncmp(buff+hdr_end, CRLF CRLF, 4);
+	/* Accept any HTTP/1.x server */
+	i = strlen(HTTP_VER);
+	if (len < i || strncmp(line, HTTP_VER, i - 1))
+		return -1;
 
-		if (ret != 0)
-		{
-			hdr_end += 1;
-			while (hdr_end < len && buff[hdr_end] != CR)
-				hdr_end += 1;
+	while (i < len && line[i] == ' ')
+		i++;
+	if (i + 3 > len)
+		return -1;
+	for (; i < len && line[i] >= '0' && line[i] <= '9'; i++)
+		status = status * 10 + line[i] - '0';
+
+	parser->code = http_status_code(status);
+
+	return 0;
+}
+
+/*
+ * Looks for "name=<value>" among the comma separated parameters of a header
+ * line, from position i on.
+ *
+ * Returns the value, or -1 if the parameter is not there.
+ */
+static int parse_header_param(char *line, int len, int i, const char *name)
+{
+	int nlen = strlen(name);
+	int value;
+
+	while (i < len) {
+		while (i < len && (line[i] == ' ' || line[i] == ','))
+			i++;
+		if (len - i > nlen && !strncasecmp(line + i, name, nlen) &&
+		    line[i + nlen] == '=') {
+			i += nlen + 1;
+			if (i == len || line[i] < '0' || line[i] > '9')
+				return -1;
+			for (value = 0; i < len && line[i] >= '0' && line[i] <= '9'; i++)
+				value = value * 10 + line[i] - '0';
+			return value;
 		}
+		while (i < len && line[i] != ',')
+			i++;
 	}
-	
-	if (hdr_end == len)
+
+	return -1;
+}
+
+static int parse_header_line(struct srb_http_parser_s *parser,
+			     char *line, int len)
+{
+	static const char key[] = "Content-Length:";
+	static const char ka_key[] = "Keep-Alive:";
+	static const char conn_key[] = "Connection:";
+	static const char hole_key[] = HTTP_HOLE ":";
+	uint64_t value = 0;
+	int i = sizeof(key) - 1;
+
+	/* How long and for how many requests the server keeps the connection */
+	if (len >= sizeof(ka_key) - 1 &&
+	    !strncasecmp(line, ka_key, sizeof(ka_key) - 1)) {
+		i = sizeof(ka_key) - 1;
+		parser->ka_timeout = parse_header_param(line, len, i, "timeout");
+		parser->ka_max = parse_header_param(line, len, i, "max");
+		return 0;
+	}
+	if (len >= sizeof(conn_key) - 1 &&
+	    !strncasecmp(line, conn_key, sizeof(conn_key) - 1)) {
+		for (i = sizeof(conn_key) - 1; i + 5 <= len; i++) {
+			if (!strncasecmp(line + i, "close", 5))
+				parser->ka_close = 1;
+		}
 		return 0;
+	}
+	/* The range of a GET is a hole of the volume (see srb_zmap_hint) */
+	if (len >= sizeof(hole_key) - 1 &&
+	    !strncasecmp(line, hole_key, sizeof(hole_key) - 1)) {
+		for (i = sizeof(hole_key) - 1; i < len && line[i] == ' '; i++)
+			;
+		parser->hole = i < len && line[i] == '1';
+		return 0;
+	}
+
+	if (len < i || strncasecmp(line, key, i))
+		return 0;
+
+	while (i < len && line[i] == ' ')
+		i++;
+	if (i == len || line[i] < '0' || line[i] > '9')
+		return -1;
+	for (; i < len && line[i] >= '0' && line[i] <= '9'; i++)
+		value = value * 10 + line[i] - '0';
+
+	parser->content_length = value;
+
+	return 0;
+}
 
-	// Go over CRLFCRLF
-	hdr_end += 4;
+/*
+ * Parses the bytes of buff received since the last call.
+ *
+ * Returns the number of bytes still missing to complete the response: the
+ * exact amount once the header is parsed, or 1 while it is incomplete.
+ * Returns 0 when the response is complete and -1 if it is malformed.
+ */
+int srb_http_parse_response(struct srb_http_parser_s *parser,
+			    char *buff, int len)
+{
+	char *lf;
+	int line_len;
+
+	while (parser->state != SRB_HTTP_PARSE_BODY) {
+		lf = memchr(buff + parser->scanned, LF, len - parser->scanned);
+		if (lf == NULL) {
+			parser->scanned = len;
+			return 1;
+		}
+		parser->scanned = lf - buff + 1;
+
+		/* Current line, without its CRLF */
+		line_len = lf - (buff + parser->line_start);
+		if (line_len > 0 && buff[parser->line_start + line_len - 1] == CR)
+			line_len--;
+
+		if (parser->state == SRB_HTTP_PARSE_STATUS) {
+			if (parse_status_line(parser, buff + parser->line_start,
+					      line_len))
+				return -1;
+			parser->state = SRB_HTTP_PARSE_HEADERS;
+		} else if (line_len == 0) {
+			parser->hdr_size = parser->scanned;
+			parser->state = SRB_HTTP_PARSE_BODY;
+		} else if (parse_header_line(parser, buff + parser->line_start,
+					     line_len)) {
+			return -1;
+		}
+		parser->line_start = parser->scanned;
+	}
 
-	// NOTE: Ignore return status, we actually only need contentlen in case of
-	// success, the default value of 0 being as useful to us as the proper
-	// value.
-	(void)srb_http_header_get_uint64(buff, len,
-	                                  "Content-Length", &contentlen);
+	if (parser->hdr_size + parser->content_length <= len)
+		return 0;
 
-	return hdr_end + contentlen <= len;
+	return parser->hdr_size + parser->content_length - len;
 }
 
 int srb_http_mkhead(char *buff, int len, char *host, char *page)
@@ -406,19 +548,69 @@ int srb_http_mkmetadata(char *buff, int len, char *host, char *page)
 	return (len - mylen);
 }
 
-int srb_http_mkrange(char *cmd, char *buff, int len, char *host, char *page,
-		uint64_t start, uint64_t end)
+/*
+ * Request header templates
+ *
+ * The requests of the I/O path only differ by their method and a few
+ * numbers. Everything else is built once per connection into a template,
+ * which is then copied as is in front of the variable fields.
+ */
+
+/* Longest variable part of a templated request */
+#define HTTP_TMPL_EXTRA	192
+
+/* Copies a string literal */
+#define HTTP_COPY(p, str)					\
+	do {							\
+		memcpy(p, str, sizeof(str) - 1);		\
+		(p) += sizeof(str) - 1;				\
+	} while (0)
+
+static const char http_digits[] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+/*
+ * Formats val in decimal at p, two digits at a time.
+ *
+ * Returns the position following the last digit.
+ */
+static char *http_fmt_u64(char *p, uint64_t val)
 {
-	char *bufp = buff;
-	char range_str[64];
-	int mylen = len;
-	int ret = 0;
+	char tmp[20];
+	char *t = tmp + sizeof(tmp);
+	unsigned int r;
+
+	while (val >= 100) {
+		r = do_div(val, 100);
+		t -= 2;
+		memcpy(t, &http_digits[r * 2], 2);
+	}
+	if (val >= 10) {
+		t -= 2;
+		memcpy(t, &http_digits[val * 2], 2);
+	} else {
+		*--t = '0' + val;
+	}
 
-	*buff = 0;
-	ret = add_buffer(&bufp, &mylen, cmd);
-	if (ret)
-		return -ENOMEM;
+	memcpy(p, t, tmp + sizeof(tmp) - t);
+
+	return p + (tmp + sizeof(tmp) - t);
+}
 
+/*
+ * Builds the invariant part of the requests sent for the volume page on
+ * host: everything from the space following the method to the Host header.
+ */
+int srb_http_mktemplate(struct srb_http_tmpl_s *tmpl, char *host, char *page)
+{
+	char *bufp = tmpl->buff;
+	int mylen = sizeof(tmpl->buff);
+	int ret;
+
+	tmpl->len = 0;
 	ret = add_buffer(&bufp, &mylen, " ");
 	if (ret)
 		return -ENOMEM;
@@ -438,7 +630,7 @@ int srb_http_mkrange(char *cmd, char *buff, int len, char *host, char *page,
 	ret = add_buffer(&bufp, &mylen, HTTP_USER_AGENT CRLF);
 	if (ret)
 		return -ENOMEM;
-	
+
 	ret = add_buffer(&bufp, &mylen, "Host: ");
 	if (ret)
 		return -ENOMEM;
@@ -447,36 +639,150 @@ int srb_http_mkrange(char *cmd, char *buff, int len, char *host, char *page,
 	if (ret)
 		return -ENOMEM;
 
-	ret = add_buffer(&bufp, &mylen,  CRLF);
+	ret = add_buffer(&bufp, &mylen, CRLF);
 	if (ret)
 		return -ENOMEM;
 
-	ret = add_buffer(&bufp, &mylen, "Range: bytes=");
-	if (ret)
+	tmpl->len = sizeof(tmpl->buff) - mylen;
+
+	return 0;
+}
+
+/* Starts a request with its method and template */
+static char *tmpl_start(const struct srb_http_tmpl_s *tmpl, char *p, int put)
+{
+	if (put)
+		HTTP_COPY(p, "PUT");
+	else
+		HTTP_COPY(p, "GET");
+	memcpy(p, tmpl->buff, tmpl->len);
+
+	return p + tmpl->len;
+}
+
+static char *tmpl_range(char *p, uint64_t start, uint64_t end)
+{
+	HTTP_COPY(p, "Range: bytes=");
+	p = http_fmt_u64(p, start);
+	*p++ = '-';
+	p = http_fmt_u64(p, end);
+	HTTP_COPY(p, CRLF);
+
+	return p;
+}
+
+/* Ends the header of a request with a payload of length bytes */
+static char *tmpl_end(char *p, uint64_t length)
+{
+	HTTP_COPY(p, "Content-Length: ");
+	p = http_fmt_u64(p, length);
+	HTTP_COPY(p, CRLF CRLF);
+
+	return p;
+}
+
+/*
+ * Builds a range request from the template: a GET, or a PUT of the range's
+ * bytes. With sync set, the PUT is made durable by the server before it
+ * answers (FUA write).
+ */
+int srb_http_mkrange_tmpl(const struct srb_http_tmpl_s *tmpl, char *buff,
+		int len, int put, uint64_t start, uint64_t end, int sync)
+{
+	char *p = buff;
+
+	if (len < tmpl->len + HTTP_TMPL_EXTRA)
 		return -ENOMEM;
 
-	/* Construct range info */
-	sprintf(range_str, "%lu-%lu",
-		(unsigned long) start, (unsigned long) end);
+	p = tmpl_start(tmpl, p, put);
+	p = tmpl_range(p, start, end);
+	if (!put) {
+		HTTP_COPY(p, CRLF);
+		return p - buff;
+	}
+	if (sync)
+		HTTP_COPY(p, HTTP_SYNC CRLF);
+	p = tmpl_end(p, end - start + 1);
 
-	ret = add_buffer(&bufp, &mylen, range_str);
-	if (ret)
+	return p - buff;
+}
+
+/*
+ * Builds a PUT asking the server to make all the data it acknowledged so
+ * far for the volume durable, before answering.
+ */
+int srb_http_mksync(const struct srb_http_tmpl_s *tmpl, char *buff, int len)
+{
+	char *p = buff;
+
+	if (len < tmpl->len + HTTP_TMPL_EXTRA)
 		return -ENOMEM;
 
-	if (!strncmp("PUT", cmd, 3)) {
-		sprintf(range_str, CRLF "Content-Length: %lu",
-			(unsigned long)(end - start + 1UL));
+	p = tmpl_start(tmpl, p, 1);
+	HTTP_COPY(p, HTTP_SYNC CRLF);
+	p = tmpl_end(p, 0);
 
-		ret = add_buffer(&bufp, &mylen, range_str);
-		if (ret)
-			return -ENOMEM;
-	}
+	return p - buff;
+}
 
-	ret = add_buffer(&bufp, &mylen, CRLF CRLF);
-	if (ret)
+/*
+ * Builds a PUT deallocating the range [start, end] of the volume, which
+ * then reads as zeroes. No payload is sent.
+ */
+int srb_http_mkdiscard(const struct srb_http_tmpl_s *tmpl, char *buff,
+		int len, uint64_t start, uint64_t end)
+{
+	char *p = buff;
+
+	if (len < tmpl->len + HTTP_TMPL_EXTRA)
 		return -ENOMEM;
 
-	return (len - mylen);
+	p = tmpl_start(tmpl, p, 1);
+	p = tmpl_range(p, start, end);
+	HTTP_COPY(p, HTTP_PUNCH_HOLE CRLF);
+	p = tmpl_end(p, 0);
+
+	return p - buff;
+}
+
+/*
+ * Builds a PUT zeroing the range [start, end] of the volume, keeping it
+ * allocated. No payload is sent.
+ */
+int srb_http_mkzero(const struct srb_http_tmpl_s *tmpl, char *buff,
+		int len, uint64_t start, uint64_t end)
+{
+	char *p = buff;
+
+	if (len < tmpl->len + HTTP_TMPL_EXTRA)
+		return -ENOMEM;
+
+	p = tmpl_start(tmpl, p, 1);
+	p = tmpl_range(p, start, end);
+	HTTP_COPY(p, HTTP_ZERO_RANGE CRLF);
+	p = tmpl_end(p, 0);
+
+	return p - buff;
+}
+
+/*
+ * Builds a PUT filling the range [start, end] of the volume with copies of
+ * its payload of block_size bytes.
+ */
+int srb_http_mkwritesame(const struct srb_http_tmpl_s *tmpl, char *buff,
+		int len, uint64_t start, uint64_t end, unsigned long block_size)
+{
+	char *p = buff;
+
+	if (len < tmpl->len + HTTP_TMPL_EXTRA)
+		return -ENOMEM;
+
+	p = tmpl_start(tmpl, p, 1);
+	p = tmpl_range(p, start, end);
+	HTTP_COPY(p, HTTP_WRITE_SAME CRLF);
+	p = tmpl_end(p, block_size);
+
+	return p - buff;
 }
 
 int srb_http_mklist(char *buff, int len, char *host, char *page)
@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2014 SCALITY SA - http://www.scality.com
+ *
+ * This file is part of ScalityRestBlock.
+ *
+ * ScalityRestBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ScalityRestBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ScalityRestBlock.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Readahead
+ *
+ * Each device tracks up to ra_nb_streams streams of reads: a read starting
+ * where one ended extends its stream, any other one takes over the least
+ * recently used stream. Once a stream saw SRB_RA_MIN_SEQ sequential reads,
+ * the ra_window following it is fetched ahead of the reader by ranged GETs
+ * of half the window each, into the two chunks of pages of the stream.
+ * A chunk gets its pages when it is first loaded, and gives them back when
+ * its stream is recycled, so idle streams do not pin memory.
+ *
+ * Reads falling within a loaded chunk are copied from it and completed
+ * without going to a server, those falling within a chunk being loaded wait
+ * for it. A chunk the reader went past is reloaded further ahead, so the
+ * stream always has a window's worth of data in flight or ready.
+ *
+ * Chunks only hold what the servers stored when they were fetched: writes
+ * throw away the chunks they overlap once they completed, and chunks being
+ * loaded while they were written are not served from.
+ *
+ * Completing a read from the submission path is only possible with blk-mq
+ * (the legacy request_fn holds the queue lock), so only blk-mq devices read
+ * ahead.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/scatterlist.h>
+#include <linux/jiffies.h>
+#include <linux/wait.h>
+
+#include "srb.h"
+
+enum srb_ra_state {
+	SRB_RA_EMPTY = 0,
+	SRB_RA_LOADING,		/* Its prefetch is in flight */
+	SRB_RA_READY,
+};
+
+struct srb_ra_chunk_s {
+	enum srb_ra_state	state;
+	int			stale;		/* Written while loading */
+	int			busy;		/* Reads copying from it */
+	uint64_t		start;
+	int			len;
+	struct list_head	waiters;	/* Reads waiting for its load */
+	struct page		**pages;
+	int			nr_pages;
+	struct srb_cmd_s	*cmd;		/* Its prefetch, one page per
+						 * segment */
+};
+
+struct srb_ra_stream_s {
+	uint64_t		next;		/* Offset following its reads */
+	unsigned int		seq;		/* Sequential reads, 0: unused */
+	unsigned long		last_used;	/* jiffies */
+	struct srb_ra_chunk_s	chunks[2];
+};
+
+/* Gives back the pages of a chunk which is neither loading nor copied from */
+static void ra_release_pages(struct srb_ra_chunk_s *c)
+{
+	int k;
+
+	if (!c->pages)
+		return;
+
+	for (k = 0; k < c->nr_pages; k++) {
+		if (c->pages[k]) {
+			__free_page(c->pages[k]);
+			c->pages[k] = NULL;
+		}
+	}
+}
+
+/*
+ * Allocates the pages the first nr_pages of a chunk are loaded into, those
+ * of its previous loads being kept. Called from the submission path.
+ */
+static int ra_alloc_pages(struct srb_ra_chunk_s *c, int nr_pages)
+{
+	int k;
+
+	for (k = 0; k < nr_pages; k++) {
+		if (c->pages[k])
+			continue;
+		c->pages[k] = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+		if (!c->pages[k])
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void ra_free(struct srb_ra_stream_s *streams, unsigned int nb_streams)
+{
+	struct srb_ra_chunk_s *c;
+	unsigned int i;
+	int j;
+
+	if (!streams)
+		return;
+
+	for (i = 0; i < nb_streams; i++) {
+		for (j = 0; j < 2; j++) {
+			c = &streams[i].chunks[j];
+			ra_release_pages(c);
+			kfree(c->pages);
+			kfree(c->cmd);
+		}
+	}
+	kfree(streams);
+}
+
+static struct srb_ra_stream_s *ra_alloc(unsigned int nb_streams,
+					unsigned int chunk_size)
+{
+	struct srb_ra_stream_s *streams;
+	struct srb_ra_chunk_s *c;
+	int nr_pages = chunk_size >> PAGE_SHIFT;
+	unsigned int i;
+	int j;
+
+	streams = kcalloc(nb_streams, sizeof(*streams), GFP_KERNEL);
+	if (!streams)
+		return NULL;
+
+	for (i = 0; i < nb_streams; i++) {
+		for (j = 0; j < 2; j++) {
+			c = &streams[i].chunks[j];
+			INIT_LIST_HEAD(&c->waiters);
+			c->nr_pages = nr_pages;
+			c->pages = kcalloc(nr_pages, sizeof(struct page *),
+					   GFP_KERNEL);
+			c->cmd = kzalloc(sizeof(struct srb_cmd_s) +
+					 nr_pages * sizeof(struct scatterlist),
+					 GFP_KERNEL);
+			if (!c->pages || !c->cmd)
+				goto err;
+			INIT_LIST_HEAD(&c->cmd->list);
+			c->cmd->sgl = (struct scatterlist *)(c->cmd + 1);
+			sg_init_table(c->cmd->sgl, nr_pages);
+		}
+	}
+
+	return streams;
+
+err:
+	ra_free(streams, nb_streams);
+	return NULL;
+}
+
+/*
+ * Sets the readahead window (in bytes, 0 to disable) and the number of
+ * streams of a device, dropping its current chunks. May sleep.
+ */
+int srb_ra_configure(struct srb_device_s *dev, unsigned int window,
+		     unsigned int nb_streams)
+{
+	struct srb_ra_stream_s *streams = NULL;
+	unsigned int chunk_size;
+	unsigned long flags;
+	int ret = 0;
+
+	mutex_lock(&dev->ra_mutex);
+
+	spin_lock_irqsave(&dev->ra_lock, flags);
+	streams = dev->ra_streams;
+	dev->ra_streams = NULL;
+	spin_unlock_irqrestore(&dev->ra_lock, flags);
+
+	/* Chunks still loading or being copied from are not ours to free */
+	wait_event(dev->ra_wait, atomic_read(&dev->ra_refs) == 0);
+	ra_free(streams, dev->ra_nb_streams);
+	streams = NULL;
+
+	/* A chunk is fetched by a single request */
+	chunk_size = min_t(unsigned int, PAGE_ALIGN(window / 2),
+			   dev->max_io_size);
+	if (chunk_size && nb_streams) {
+		streams = ra_alloc(nb_streams, chunk_size);
+		if (!streams) {
+			SRBDEV_LOG_WARN(dev, "Unable to allocate %u readahead "
+					"streams of %u bytes", nb_streams,
+					2 * chunk_size);
+			ret = -ENOMEM;
+			window = 0;
+		}
+	}
+
+	spin_lock_irqsave(&dev->ra_lock, flags);
+	dev->ra_window = window;
+	dev->ra_nb_streams = nb_streams;
+	dev->ra_chunk_size = chunk_size;
+	dev->ra_streams = streams;
+	spin_unlock_irqrestore(&dev->ra_lock, flags);
+
+	mutex_unlock(&dev->ra_mutex);
+
+	return ret;
+}
+
+static void ra_put(struct srb_device_s *dev)
+{
+	if (atomic_dec_and_test(&dev->ra_refs))
+		wake_up(&dev->ra_wait);
+}
+
+/* Copies the part of a loaded chunk a read asked for into its pages */
+static void ra_copy(struct srb_ra_chunk_s *c, struct srb_cmd_s *cmd)
+{
+	unsigned int pos = cmd->offset - c->start;
+	struct scatterlist *sg;
+	unsigned int done;
+	unsigned int off;
+	unsigned int len;
+	int i;
+
+	for (i = 0; i < cmd->sgl_size; i++) {
+		sg = &cmd->sgl[i];
+		for (done = 0; done < sg->length; done += len, pos += len) {
+			off = pos & ~PAGE_MASK;
+			len = min_t(unsigned int, sg->length - done,
+				    PAGE_SIZE - off);
+			memcpy((char *)sg_virt(sg) + done,
+			       (char *)page_address(c->pages[pos >> PAGE_SHIFT]) + off,
+			       len);
+		}
+	}
+}
+
+/* Completes a read from a loaded chunk it holds a reference on */
+static void ra_serve(struct srb_device_s *dev, struct srb_ra_chunk_s *c,
+		     struct srb_cmd_s *cmd)
+{
+	unsigned long flags;
+
+	ra_copy(c, cmd);
+
+	spin_lock_irqsave(&dev->ra_lock, flags);
+	c->busy--;
+	spin_unlock_irqrestore(&dev->ra_lock, flags);
+	ra_put(dev);
+
+	cmd->local = 1;
+	srb_end_request(cmd->req, 0);
+}
+
+static void ra_load(struct srb_device_s *dev, struct srb_ra_chunk_s *c)
+{
+	struct srb_cmd_s *cmd = c->cmd;
+	int len;
+	int i;
+
+	cmd->kind	= SRB_CMD_PREFETCH;
+	cmd->dev	= dev;
+	cmd->chunk	= c;
+	cmd->op		= SRB_CMD_READ;
+	cmd->fua	= 0;
+	cmd->offset	= c->start;
+	cmd->size	= c->len;
+	cmd->attempts	= 0;
+	cmd->cancelled	= 0;
+	cmd->sgl_size	= DIV_ROUND_UP(c->len, PAGE_SIZE);
+	if (ra_alloc_pages(c, cmd->sgl_size)) {
+		/* Its waiters go to a server */
+		srb_ra_end(cmd, -ENOMEM);
+		return;
+	}
+	for (i = 0; i < cmd->sgl_size; i++) {
+		len = min_t(int, PAGE_SIZE, c->len - i * PAGE_SIZE);
+		sg_set_page(&cmd->sgl[i], c->pages[i], len, 0);
+	}
+
+	SRBDEV_LOG_DEBUG(dev, "Reading ahead %d bytes at %llu",
+			 c->len, (unsigned long long)c->start);
+	srb_send(dev, cmd, -1);
+}
+
+/*
+ * Looks up the stream a read belongs to, along with the chunk holding it
+ * if any. ra_lock held.
+ */
+static struct srb_ra_stream_s *__ra_lookup(struct srb_device_s *dev,
+					   struct srb_cmd_s *cmd,
+					   struct srb_ra_chunk_s **chunk)
+{
+	uint64_t end = cmd->offset + cmd->size;
+	struct srb_ra_stream_s *s;
+	struct srb_ra_chunk_s *c;
+	unsigned int i;
+	int j;
+
+	*chunk = NULL;
+	for (i = 0; i < dev->ra_nb_streams; i++) {
+		s = &dev->ra_streams[i];
+		for (j = 0; j < 2; j++) {
+			c = &s->chunks[j];
+			if (c->state != SRB_RA_EMPTY && !c->stale &&
+			    c->start <= cmd->offset && end <= c->start + c->len) {
+				*chunk = c;
+				return s;
+			}
+		}
+	}
+
+	for (i = 0; i < dev->ra_nb_streams; i++) {
+		s = &dev->ra_streams[i];
+		if (s->seq && s->next == cmd->offset)
+			return s;
+	}
+
+	return NULL;
+}
+
+/*
+ * Stream to track a new one with: an unused one, or else the least
+ * recently used of those with nothing in flight. ra_lock held.
+ */
+static struct srb_ra_stream_s *__ra_recycle(struct srb_device_s *dev)
+{
+	struct srb_ra_stream_s *lru = NULL;
+	struct srb_ra_stream_s *s;
+	unsigned int i;
+	int j;
+
+	for (i = 0; i < dev->ra_nb_streams; i++) {
+		s = &dev->ra_streams[i];
+		if (!s->seq)
+			return s;
+		for (j = 0; j < 2; j++) {
+			if (s->chunks[j].state == SRB_RA_LOADING ||
+			    s->chunks[j].busy)
+				break;
+		}
+		if (j == 2 && (!lru || time_before(s->last_used, lru->last_used)))
+			lru = s;
+	}
+
+	if (lru) {
+		for (j = 0; j < 2; j++) {
+			lru->chunks[j].state = SRB_RA_EMPTY;
+			ra_release_pages(&lru->chunks[j]);
+		}
+	}
+
+	return lru;
+}
+
+/*
+ * Releases the chunks a stream's reader went past, and picks those to
+ * load past the ones still ahead of it. ra_lock held.
+ */
+static int __ra_advance(struct srb_device_s *dev, struct srb_ra_stream_s *s,
+			struct srb_ra_chunk_s **load)
+{
+	uint64_t ahead = s->next;
+	struct srb_ra_chunk_s *c;
+	int nr = 0;
+	int j;
+
+	for (j = 0; j < 2; j++) {
+		c = &s->chunks[j];
+		if (c->state == SRB_RA_READY && c->start + c->len <= s->next)
+			c->state = SRB_RA_EMPTY;
+		else if (c->state != SRB_RA_EMPTY && c->start + c->len > ahead)
+			ahead = c->start + c->len;
+	}
+
+	if (s->seq < SRB_RA_MIN_SEQ)
+		return 0;
+
+	for (j = 0; j < 2 && ahead < dev->disk_size; j++) {
+		c = &s->chunks[j];
+		if (c->state != SRB_RA_EMPTY || c->busy)
+			continue;
+		c->state = SRB_RA_LOADING;
+		c->stale = 0;
+		c->start = ahead;
+		c->len = min_t(uint64_t, dev->ra_chunk_size,
+			       dev->disk_size - ahead);
+		ahead += c->len;
+		atomic_inc(&dev->ra_refs);
+		load[nr++] = c;
+	}
+
+	return nr;
+}
+
+/*
+ * Feeds a read to the stream detector. Returns 1 if the read was served
+ * from its stream's window, or is waiting for it to be loaded, 0 if it is
+ * to be sent to a server.
+ */
+int srb_ra_read(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	struct srb_ra_chunk_s *load[2];
+	struct srb_ra_chunk_s *serve = NULL;
+	struct srb_ra_chunk_s *c;
+	struct srb_ra_stream_s *s;
+	unsigned long flags;
+	int queued = 0;
+	int nr = 0;
+	int i;
+
+	spin_lock_irqsave(&dev->ra_lock, flags);
+	if (!dev->ra_streams) {
+		spin_unlock_irqrestore(&dev->ra_lock, flags);
+		return 0;
+	}
+
+	s = __ra_lookup(dev, cmd, &c);
+	if (c) {
+		dev->ra_hits++;
+		if (c->state == SRB_RA_READY) {
+			c->busy++;
+			atomic_inc(&dev->ra_refs);
+			serve = c;
+		} else {
+			list_add_tail(&cmd->list, &c->waiters);
+			queued = 1;
+		}
+	} else if (s) {
+		if (s->seq >= SRB_RA_MIN_SEQ)
+			dev->ra_misses++;
+	} else {
+		s = __ra_recycle(dev);
+		if (s)
+			s->seq = 0;
+	}
+
+	if (s) {
+		s->seq++;
+		if (cmd->offset + cmd->size > s->next)
+			s->next = cmd->offset + cmd->size;
+		s->last_used = jiffies;
+		nr = __ra_advance(dev, s, load);
+	}
+	spin_unlock_irqrestore(&dev->ra_lock, flags);
+
+	for (i = 0; i < nr; i++)
+		ra_load(dev, load[i]);
+	if (serve)
+		ra_serve(dev, serve, cmd);
+
+	return serve || queued;
+}
+
+/*
+ * Ends the prefetch of a chunk: the reads waiting for it are served from
+ * it, or sent to a server if it failed or was written meanwhile.
+ */
+void srb_ra_end(struct srb_cmd_s *cmd, int error)
+{
+	struct srb_device_s *dev = cmd->dev;
+	struct srb_ra_chunk_s *c = cmd->chunk;
+	struct srb_cmd_s *waiter, *tmp;
+	unsigned long flags;
+	LIST_HEAD(waiters);
+	int ready;
+
+	spin_lock_irqsave(&dev->ra_lock, flags);
+	list_splice_init(&c->waiters, &waiters);
+	ready = !error && !c->stale;
+	if (ready) {
+		c->state = SRB_RA_READY;
+		list_for_each_entry(waiter, &waiters, list) {
+			c->busy++;
+			atomic_inc(&dev->ra_refs);
+		}
+	} else {
+		c->state = SRB_RA_EMPTY;
+	}
+	c->stale = 0;
+	spin_unlock_irqrestore(&dev->ra_lock, flags);
+
+	if (error)
+		SRBDEV_LOG_DEBUG(dev, "Readahead of %d bytes at %llu failed: %d",
+				 c->len, (unsigned long long)c->start, error);
+
+	list_for_each_entry_safe(waiter, tmp, &waiters, list) {
+		list_del_init(&waiter->list);
+		if (ready)
+			ra_serve(dev, c, waiter);
+		else
+			srb_dispatch(dev, waiter);
+	}
+
+	ra_put(dev);
+}
+
+/* Drops the chunks overlapping a completed write */
+void srb_ra_invalidate(struct srb_device_s *dev, uint64_t offset, int size)
+{
+	struct srb_ra_chunk_s *c;
+	unsigned long flags;
+	unsigned int i;
+	int j;
+
+	spin_lock_irqsave(&dev->ra_lock, flags);
+	for (i = 0; dev->ra_streams && i < dev->ra_nb_streams; i++) {
+		for (j = 0; j < 2; j++) {
+			c = &dev->ra_streams[i].chunks[j];
+			if (c->state == SRB_RA_EMPTY ||
+			    c->start >= offset + size ||
+			    offset >= c->start + c->len)
+				continue;
+			if (c->state == SRB_RA_LOADING)
+				c->stale = 1;
+			else
+				c->state = SRB_RA_EMPTY;
+		}
+	}
+	spin_unlock_irqrestore(&dev->ra_lock, flags);
+}
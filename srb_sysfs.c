@@ -23,6 +23,7 @@
 #include <linux/device.h>
 #include <linux/blkdev.h>
 #include <linux/string.h>
+#include <linux/version.h>
 
 #include "srb.h"
 
@@ -98,6 +99,40 @@ static int human_to_bytes(char *size_str, unsigned long long *size)
  *                   srb_urls	 Gets device CDMI url
  *                   srb_name   Gets device's on-storage filename
  *                   srb_size   Gets device size
+ *                   srb_hedge_threshold   Gets or pins the hedge delay (us)
+ *                   srb_hedge_percentile  Gets or sets the read latency
+ *                                         percentile the delay follows
+ *                   srb_hedge_budget      Gets or sets the max % of reads
+ *                                         hedged
+ *                   srb_hedges_issued     Gets the number of hedged reads
+ *                   srb_hedges_won        Gets how many hedges won the race
+ *                   srb_ra_window         Gets or sets the readahead window
+ *                                         of a stream (kB), 0 disables it
+ *                   srb_ra_streams        Gets or sets the number of
+ *                                         streams tracked
+ *                   srb_ra_hits           Gets the number of reads served
+ *                                         from the readahead windows
+ *                   srb_ra_misses         Gets the number of stream reads
+ *                                         sent to a server
+ *                   srb_cache_size        Gets or sets the size of the
+ *                                         block cache (MB), 0 disables it
+ *                   srb_cache_hits        Gets the number of reads served
+ *                                         from the block cache
+ *                   srb_cache_misses      Gets the number of cacheable
+ *                                         reads sent to a server
+ *                   srb_wb_log            Gets the write-back log's path
+ *                   srb_wb_dirty          Gets the bytes of the volume
+ *                                         not written back yet
+ *                   srb_wb_volatile       Gets or sets whether writes are
+ *                                         written back from memory
+ *                   srb_wb_max_dirty      Gets or sets the memory writes
+ *                                         may take before waiting (MB)
+ *                   srb_wb_expire         Gets or sets how long writes may
+ *                                         stay in memory (ms)
+ *                   srb_zero_bytes        Gets the bytes of the volume
+ *                                         known to read as zeroes
+ *                   srb_zero_hits         Gets the number of reads served
+ *                                         with zeroes
  *******************************************************************/
 static ssize_t attr_debug_store(struct device *dv,
 				struct device_attribute *attr,
@@ -142,8 +177,8 @@ static ssize_t attr_urls_show(struct device *dv,
 	struct gendisk *disk	  = dev_to_disk(dv);
 	struct srb_device_s *dev = disk->private_data;
 	
-	//snprintf(buff, PAGE_SIZE, "%s\n", dev->thread_cdmi_desc[0].url);
-	return scnprintf(buff, PAGE_SIZE, "%s\n", dev->thread_cdmi_desc[0]->url);
+	//snprintf(buff, PAGE_SIZE, "%s\n", dev->cdmi_desc[0].url);
+	return scnprintf(buff, PAGE_SIZE, "%s\n", dev->url);
 }
 
 static ssize_t attr_disk_name_show(struct device *dv,
@@ -152,8 +187,8 @@ static ssize_t attr_disk_name_show(struct device *dv,
 	struct gendisk *disk	  = dev_to_disk(dv);
 	struct srb_device_s *dev = disk->private_data;
 
-	//snprintf(buff, PAGE_SIZE, "%s\n", kbasename(dev->thread_cdmi_desc[0].url));
-	return scnprintf(buff, PAGE_SIZE, "%s\n", kbasename(dev->thread_cdmi_desc[0]->url));
+	//snprintf(buff, PAGE_SIZE, "%s\n", kbasename(dev->cdmi_desc[0].url));
+	return scnprintf(buff, PAGE_SIZE, "%s\n", kbasename(dev->url));
 }
 
 static ssize_t attr_disk_size_show(struct device *dv,
@@ -165,10 +200,403 @@ static ssize_t attr_disk_size_show(struct device *dv,
 	return scnprintf(buff, PAGE_SIZE, "%llu\n", dev->disk_size);
 }
 
+/* Reads an unsigned value of a device attribute, up to max */
+static int attr_parse_uint(struct srb_device_s *dev, const char *buff,
+			   unsigned int max, unsigned int *val)
+{
+	int ret;
+
+	ret = kstrtouint(buff, 10, val);
+	if (ret < 0 || *val > max) {
+		SRBDEV_LOG_WARN(dev, "Invalid value for device %s in sysfs", dev->name);
+		return ret < 0 ? ret : -EINVAL;
+	}
+
+	return 0;
+}
+
+static ssize_t attr_hedge_threshold_store(struct device *dv,
+					  struct device_attribute *attr,
+					  const char *buff, size_t count)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+	unsigned int val;
+	int ret;
+
+	ret = attr_parse_uint(dev, buff, UINT_MAX, &val);
+	if (ret < 0)
+		return ret;
+	srb_hedge_set_threshold(dev, val);
+
+	return count;
+}
+
+static ssize_t attr_hedge_threshold_show(struct device *dv,
+					 struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%u\n", dev->hedge_threshold);
+}
+
+static ssize_t attr_hedge_percentile_store(struct device *dv,
+					   struct device_attribute *attr,
+					   const char *buff, size_t count)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+	unsigned int val;
+	int ret;
+
+	ret = attr_parse_uint(dev, buff, 99, &val);
+	if (ret < 0)
+		return ret;
+	srb_hedge_set_percentile(dev, val);
+
+	return count;
+}
+
+static ssize_t attr_hedge_percentile_show(struct device *dv,
+					  struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%u\n", dev->hedge_percentile);
+}
+
+static ssize_t attr_hedge_budget_store(struct device *dv,
+				       struct device_attribute *attr,
+				       const char *buff, size_t count)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+	unsigned int val;
+	int ret;
+
+	ret = attr_parse_uint(dev, buff, 100, &val);
+	if (ret < 0)
+		return ret;
+	dev->hedge_budget = val;
+
+	return count;
+}
+
+static ssize_t attr_hedge_budget_show(struct device *dv,
+				      struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%u\n", dev->hedge_budget);
+}
+
+static ssize_t attr_hedges_issued_show(struct device *dv,
+				       struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%lu\n", dev->hedges_issued);
+}
+
+static ssize_t attr_hedges_won_show(struct device *dv,
+				    struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%lu\n", dev->hedges_won);
+}
+
+static ssize_t attr_ra_window_store(struct device *dv,
+				    struct device_attribute *attr,
+				    const char *buff, size_t count)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+	unsigned int val;
+	int ret;
+
+#ifndef SRB_BLK_MQ
+	/* Only blk-mq devices read ahead (see srb_readahead.c) */
+	return -EOPNOTSUPP;
+#endif
+	ret = attr_parse_uint(dev, buff, 2 * dev->max_io_size / kB, &val);
+	if (ret < 0)
+		return ret;
+	ret = srb_ra_configure(dev, val * kB, dev->ra_nb_streams);
+	if (ret < 0)
+		return ret;
+
+	return count;
+}
+
+static ssize_t attr_ra_window_show(struct device *dv,
+				   struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%u\n", dev->ra_window / kB);
+}
+
+static ssize_t attr_ra_streams_store(struct device *dv,
+				     struct device_attribute *attr,
+				     const char *buff, size_t count)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+	unsigned int val;
+	int ret;
+
+#ifndef SRB_BLK_MQ
+	/* Only blk-mq devices read ahead (see srb_readahead.c) */
+	return -EOPNOTSUPP;
+#endif
+	ret = attr_parse_uint(dev, buff, SRB_RA_STREAMS_MAX, &val);
+	if (ret < 0)
+		return ret;
+	ret = srb_ra_configure(dev, dev->ra_window, val);
+	if (ret < 0)
+		return ret;
+
+	return count;
+}
+
+static ssize_t attr_ra_streams_show(struct device *dv,
+				    struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%u\n", dev->ra_nb_streams);
+}
+
+static ssize_t attr_ra_hits_show(struct device *dv,
+				 struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%lu\n", dev->ra_hits);
+}
+
+static ssize_t attr_ra_misses_show(struct device *dv,
+				   struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%lu\n", dev->ra_misses);
+}
+
+static ssize_t attr_cache_size_store(struct device *dv,
+				     struct device_attribute *attr,
+				     const char *buff, size_t count)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+	unsigned int val;
+	int ret;
+
+#ifndef SRB_BLK_MQ
+	/* Only blk-mq devices are served from the cache (see srb_cache.c) */
+	return -EOPNOTSUPP;
+#endif
+	ret = attr_parse_uint(dev, buff, min_t(unsigned long, UINT_MAX,
+			      ULONG_MAX / (MB / PAGE_SIZE)), &val);
+	if (ret < 0)
+		return ret;
+	srb_cache_resize(dev, (unsigned long)val * (MB / PAGE_SIZE));
+
+	return count;
+}
+
+static ssize_t attr_cache_size_show(struct device *dv,
+				    struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%lu\n",
+			 dev->cache.max_pages / (MB / PAGE_SIZE));
+}
+
+static ssize_t attr_cache_hits_show(struct device *dv,
+				    struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%lu\n", dev->cache.hits);
+}
+
+static ssize_t attr_cache_misses_show(struct device *dv,
+				      struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%lu\n", dev->cache.misses);
+}
+
+static ssize_t attr_wb_log_show(struct device *dv,
+				struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%s\n", srb_wblog_path(dev));
+}
+
+static ssize_t attr_wb_dirty_show(struct device *dv,
+				  struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%llu\n",
+			 (unsigned long long)(srb_wblog_dirty(dev) +
+					      dev->wback.dirty));
+}
+
+static ssize_t attr_wb_volatile_store(struct device *dv,
+				      struct device_attribute *attr,
+				      const char *buff, size_t count)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+	unsigned int val;
+	int ret;
+
+	ret = attr_parse_uint(dev, buff, 1, &val);
+	if (ret < 0)
+		return ret;
+	ret = srb_wback_enable(dev, val);
+	if (ret < 0)
+		return ret;
+
+	return count;
+}
+
+static ssize_t attr_wb_volatile_show(struct device *dv,
+				     struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%d\n", dev->wback.enabled);
+}
+
+static ssize_t attr_wb_max_dirty_store(struct device *dv,
+				       struct device_attribute *attr,
+				       const char *buff, size_t count)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+	unsigned int val;
+	int ret;
+
+	ret = attr_parse_uint(dev, buff, UINT_MAX, &val);
+	if (ret < 0)
+		return ret;
+	if (!val)
+		return -EINVAL;
+	dev->wback.max_dirty = (uint64_t)val * MB;
+
+	return count;
+}
+
+static ssize_t attr_wb_max_dirty_show(struct device *dv,
+				      struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%llu\n",
+			 (unsigned long long)dev->wback.max_dirty / MB);
+}
+
+static ssize_t attr_wb_expire_store(struct device *dv,
+				    struct device_attribute *attr,
+				    const char *buff, size_t count)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+	unsigned int val;
+	int ret;
+
+	ret = attr_parse_uint(dev, buff, UINT_MAX, &val);
+	if (ret < 0)
+		return ret;
+	dev->wback.expire_ms = val;
+
+	return count;
+}
+
+static ssize_t attr_wb_expire_show(struct device *dv,
+				   struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%u\n", dev->wback.expire_ms);
+}
+
+static ssize_t attr_zero_bytes_show(struct device *dv,
+				    struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%llu\n",
+			 (unsigned long long)dev->zmap.bytes);
+}
+
+static ssize_t attr_zero_hits_show(struct device *dv,
+				   struct device_attribute *attr, char *buff)
+{
+	struct gendisk *disk	  = dev_to_disk(dv);
+	struct srb_device_s *dev = disk->private_data;
+
+	return scnprintf(buff, PAGE_SIZE, "%lu\n", dev->zmap.hits);
+}
+
 static DEVICE_ATTR(srb_debug, S_IWUSR | S_IRUGO, &attr_debug_show, &attr_debug_store);
 static DEVICE_ATTR(srb_urls, S_IRUGO, &attr_urls_show, NULL);
 static DEVICE_ATTR(srb_name, S_IRUGO, &attr_disk_name_show, NULL);
 static DEVICE_ATTR(srb_size, S_IRUGO, &attr_disk_size_show, NULL);
+static DEVICE_ATTR(srb_hedge_threshold, S_IWUSR | S_IRUGO,
+		   &attr_hedge_threshold_show, &attr_hedge_threshold_store);
+static DEVICE_ATTR(srb_hedge_percentile, S_IWUSR | S_IRUGO,
+		   &attr_hedge_percentile_show, &attr_hedge_percentile_store);
+static DEVICE_ATTR(srb_hedge_budget, S_IWUSR | S_IRUGO,
+		   &attr_hedge_budget_show, &attr_hedge_budget_store);
+static DEVICE_ATTR(srb_hedges_issued, S_IRUGO, &attr_hedges_issued_show, NULL);
+static DEVICE_ATTR(srb_hedges_won, S_IRUGO, &attr_hedges_won_show, NULL);
+static DEVICE_ATTR(srb_ra_window, S_IWUSR | S_IRUGO,
+		   &attr_ra_window_show, &attr_ra_window_store);
+static DEVICE_ATTR(srb_ra_streams, S_IWUSR | S_IRUGO,
+		   &attr_ra_streams_show, &attr_ra_streams_store);
+static DEVICE_ATTR(srb_ra_hits, S_IRUGO, &attr_ra_hits_show, NULL);
+static DEVICE_ATTR(srb_ra_misses, S_IRUGO, &attr_ra_misses_show, NULL);
+static DEVICE_ATTR(srb_cache_size, S_IWUSR | S_IRUGO,
+		   &attr_cache_size_show, &attr_cache_size_store);
+static DEVICE_ATTR(srb_cache_hits, S_IRUGO, &attr_cache_hits_show, NULL);
+static DEVICE_ATTR(srb_cache_misses, S_IRUGO, &attr_cache_misses_show, NULL);
+static DEVICE_ATTR(srb_wb_log, S_IRUGO, &attr_wb_log_show, NULL);
+static DEVICE_ATTR(srb_wb_dirty, S_IRUGO, &attr_wb_dirty_show, NULL);
+static DEVICE_ATTR(srb_wb_volatile, S_IWUSR | S_IRUGO,
+		   &attr_wb_volatile_show, &attr_wb_volatile_store);
+static DEVICE_ATTR(srb_wb_max_dirty, S_IWUSR | S_IRUGO,
+		   &attr_wb_max_dirty_show, &attr_wb_max_dirty_store);
+static DEVICE_ATTR(srb_wb_expire, S_IWUSR | S_IRUGO,
+		   &attr_wb_expire_show, &attr_wb_expire_store);
+static DEVICE_ATTR(srb_zero_bytes, S_IRUGO, &attr_zero_bytes_show, NULL);
+static DEVICE_ATTR(srb_zero_hits, S_IRUGO, &attr_zero_hits_show, NULL);
 
 
 /************************************************************************
@@ -183,20 +611,20 @@ static DEVICE_ATTR(srb_size, S_IRUGO, &attr_disk_size_show, NULL);
 static struct class *class_srb;		/* /sys/class/srb */
 
 
-static void class_srb_release(struct class *cls)
+static void class_srb_release(srb_class_t *cls)
 {
 	if (cls != NULL)
 		kfree(cls);
 }
 
-static ssize_t class_srb_create_show(struct class *c, struct class_attribute *attr,
+static ssize_t class_srb_create_show(srb_class_t *c, srb_class_attr_t *attr,
 				      char *buf)
 {
 	return scnprintf(buf, PAGE_SIZE, "# Usage: echo 'VolumeName size(bytes)' > create\n");
 }
 
-static ssize_t class_srb_create_store(struct class *c,
-				struct class_attribute *attr,
+static ssize_t class_srb_create_store(srb_class_t *c,
+				srb_class_attr_t *attr,
 				const char *buf, size_t count)
 {
 	ssize_t ret = 0;
@@ -268,7 +696,7 @@ out:
 	return ret;
 }
 
-static ssize_t class_srb_extend_show(struct class *c, struct class_attribute *attr,
+static ssize_t class_srb_extend_show(srb_class_t *c, srb_class_attr_t *attr,
 				      char *buf)
 {
 	return scnprintf(buf, PAGE_SIZE,
@@ -276,8 +704,8 @@ static ssize_t class_srb_extend_show(struct class *c, struct class_attribute *at
 		 "# Usage: echo 'VolumeName size(bytes)' > extend\n");
 }
 
-static ssize_t class_srb_extend_store(struct class *c,
-				       struct class_attribute *attr,
+static ssize_t class_srb_extend_store(srb_class_t *c,
+				       srb_class_attr_t *attr,
 				       const char *buf, size_t count)
 {
 	ssize_t ret = 0;
@@ -346,14 +774,14 @@ out:
 	return ret;
 }
 
-static ssize_t class_srb_destroy_show(struct class *c, struct class_attribute *attr,
+static ssize_t class_srb_destroy_show(srb_class_t *c, srb_class_attr_t *attr,
 				       char *buf)
 {
 	return scnprintf(buf, PAGE_SIZE, "# Usage: echo VolumeName > destroy\n");
 }
 
-static ssize_t class_srb_destroy_store(struct class *c,
-					struct class_attribute *attr,
+static ssize_t class_srb_destroy_store(srb_class_t *c,
+					srb_class_attr_t *attr,
 					const char *buf, size_t count)
 {
 	ssize_t ret = 0;
@@ -385,22 +813,23 @@ out:
 	return ret;
 }
 
-static ssize_t class_srb_attach_show(struct class *c, struct class_attribute *attr,
+static ssize_t class_srb_attach_show(srb_class_t *c, srb_class_attr_t *attr,
 				      char *buf)
 {
-	return scnprintf(buf, PAGE_SIZE, "# Usage: echo VolumeName DeviceName > attach\n");
+	return scnprintf(buf, PAGE_SIZE, "# Usage: echo VolumeName DeviceName [MaxIOSize [WriteBackLog]] > attach\n");
 }
 
-static ssize_t class_srb_attach_store(struct class *c,
-			struct class_attribute *attr,
+static ssize_t class_srb_attach_store(srb_class_t *c,
+			srb_class_attr_t *attr,
 			const char *buf, size_t count)
 {
 	int ret;
 	const char *delim = " ";
 	char *tmp_buf = NULL;
-	char *params[2];
+	char *params[4];
 	const char **filename = (const char **)&params[0];
 	const char **devname = (const char **)&params[1];
+	unsigned long long max_io = 0;
 
 	memset(params, 0, sizeof(params));
 
@@ -418,9 +847,9 @@ static ssize_t class_srb_attach_store(struct class *c,
 	else
 		tmp_buf[count] = 0;
 
-	ret = parse_params(tmp_buf, delim, params, 2, count);
-	if (ret != 2) {
-		SRB_LOG_ERR(srb_log, "Invalid parameters: %i instead of 2",
+	ret = parse_params(tmp_buf, delim, params, 4, count);
+	if (ret < 2 || ret > 4) {
+		SRB_LOG_ERR(srb_log, "Invalid parameters: %i instead of 2 to 4",
 			     ret);
 		ret = -EINVAL;
 		goto out;
@@ -443,9 +872,28 @@ static ssize_t class_srb_attach_store(struct class *c,
 		goto out;
 	}
 
+	/* Optional maximum request size, defaults to max_io_size (or 0) */
+	if (NULL != params[2]) {
+		ret = human_to_bytes(params[2], &max_io);
+		if (ret != 0) {
+			SRB_LOG_ERR(srb_log, "Invalid parameter #3: '%s'",
+				     params[2]);
+			goto out;
+		}
+	}
+
+	/* Optional write-back log, a file or a block device */
+	if (NULL != params[3] && strlen(params[3]) > SRB_URL_SIZE) {
+		SRB_LOG_ERR(srb_log, "Invalid parameter #4: "
+			     "'%s'(%lu characters)", params[3],
+			     strlen(params[3]));
+		ret = -EINVAL;
+		goto out;
+	}
+
 	SRB_LOG_INFO(srb_log, "Attaching volume '%s' as device '%s'",
 		      *filename, *devname);
-	ret = srb_device_attach(*filename, *devname);
+	ret = srb_device_attach(*filename, *devname, max_io, params[3]);
 	if (ret != 0)
 		goto out;
 
@@ -457,14 +905,14 @@ out:
 	return ret;
 }
 
-static ssize_t class_srb_detach_show(struct class *c, struct class_attribute *attr,
+static ssize_t class_srb_detach_show(srb_class_t *c, srb_class_attr_t *attr,
 				      char *buf)
 {
 	return scnprintf(buf, PAGE_SIZE, "# Usage: echo DeviceName > detach\n");
 }
 
-static ssize_t class_srb_detach_store(struct class *c,
-				struct class_attribute *attr,
+static ssize_t class_srb_detach_store(srb_class_t *c,
+				srb_class_attr_t *attr,
 				const char *buf,
 				size_t count)
 {
@@ -491,14 +939,14 @@ static ssize_t class_srb_detach_store(struct class *c,
 	return ret;
 }
 
-static ssize_t class_srb_addurl_show(struct class *c, struct class_attribute *attr,
+static ssize_t class_srb_addurl_show(srb_class_t *c, srb_class_attr_t *attr,
 					 char *buf)
 {
 	return scnprintf(buf, PAGE_SIZE, "# Usage: echo server_url1,...,server_urlN > add_urls\n");
 }
 
-static ssize_t class_srb_addurl_store(struct class *c,
-					  struct class_attribute *attr,
+static ssize_t class_srb_addurl_store(srb_class_t *c,
+					  srb_class_attr_t *attr,
 					  const char *buf,
 					  size_t count)
 {
@@ -551,14 +999,14 @@ end:
 	return ret;
 }
 
-static ssize_t class_srb_removeurl_show(struct class *c, struct class_attribute *attr,
+static ssize_t class_srb_removeurl_show(srb_class_t *c, srb_class_attr_t *attr,
 					    char *buf)
 {
 	return scnprintf(buf, PAGE_SIZE, "# Usage: echo server_url1,...,server_urlN > remove_urls\n");
 }
 
-static ssize_t class_srb_removeurl_store(struct class *c,
-					     struct class_attribute *attr,
+static ssize_t class_srb_removeurl_store(srb_class_t *c,
+					     srb_class_attr_t *attr,
 					     const char *buf,
 					     size_t count)
 {
@@ -612,7 +1060,7 @@ end:
 	return ret;
 }
 
-static ssize_t class_srb_urls_show(struct class *c, struct class_attribute *attr,
+static ssize_t class_srb_urls_show(srb_class_t *c, srb_class_attr_t *attr,
 				       char *buf)
 {
 	ssize_t	ret = 0;
@@ -622,7 +1070,7 @@ static ssize_t class_srb_urls_show(struct class *c, struct class_attribute *attr
 	return ret;
 }
 
-static ssize_t class_srb_volumes_show(struct class *c, struct class_attribute *attr,
+static ssize_t class_srb_volumes_show(srb_class_t *c, srb_class_attr_t *attr,
 				       char *buf)
 {
 	ssize_t	ret = 0;
@@ -639,6 +1087,25 @@ void srb_sysfs_device_init(srb_device_t *dev)
 	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_urls);
 	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_name);
 	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_size);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_hedge_threshold);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_hedge_percentile);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_hedge_budget);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_hedges_issued);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_hedges_won);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_ra_window);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_ra_streams);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_ra_hits);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_ra_misses);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_cache_size);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_cache_hits);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_cache_misses);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_wb_log);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_wb_dirty);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_wb_volatile);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_wb_max_dirty);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_wb_expire);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_zero_bytes);
+	device_create_file(disk_to_dev(dev->disk), &dev_attr_srb_zero_hits);
 }
 
 static struct class_attribute class_srb_attrs[] = {
@@ -654,9 +1121,26 @@ static struct class_attribute class_srb_attrs[] = {
 	__ATTR_NULL
 };
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+/* class_attrs was replaced by attribute groups in 4.13 */
+static struct attribute *class_srb_attrs_list[ARRAY_SIZE(class_srb_attrs)];
+
+static const struct attribute_group class_srb_group = {
+	.attrs = class_srb_attrs_list,
+};
+
+static const struct attribute_group *class_srb_groups[] = {
+	&class_srb_group,
+	NULL
+};
+#endif
+
 int srb_sysfs_init(void)
 {
 	int ret = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	int i;
+#endif
 
 	/*
 	 * create control files in sysfs
@@ -670,9 +1154,18 @@ int srb_sysfs_init(void)
 		return -ENOMEM;
 	}
 	class_srb->name	  = DEV_NAME;
+#ifdef SRB_CLASS_OWNER
 	class_srb->owner	  = THIS_MODULE;
+#endif
 	class_srb->class_release = class_srb_release;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	for (i = 0; class_srb_attrs[i].attr.name != NULL; i++)
+		class_srb_attrs_list[i] = &class_srb_attrs[i].attr;
+	class_srb_attrs_list[i] = NULL;
+	class_srb->class_groups  = class_srb_groups;
+#else
 	class_srb->class_attrs   = class_srb_attrs;
+#endif
 
 	ret = class_register(class_srb);
 	if (ret) {
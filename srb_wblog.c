@@ -0,0 +1,1131 @@
+/*
+ * Copyright (C) 2014 SCALITY SA - http://www.scality.com
+ *
+ * This file is part of ScalityRestBlock.
+ *
+ * ScalityRestBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ScalityRestBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ScalityRestBlock.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Write-back log
+ *
+ * A device may be paired at attach time with a local file or block device
+ * (an SSD), used as a circular log of its writes. Writes are appended to
+ * the log by the device's log worker and acknowledged once it was synced,
+ * a single sync covering all the writes the worker got at once. FUA writes
+ * and flushes are thus durable as soon as they completed; flushes still
+ * sync the servers for the other writes.
+ *
+ * Records are a header slot followed by the data of the write, and carry
+ * the stamp the log was formatted with, a sequence number and a checksum.
+ * The superblock points to the oldest record not destaged yet, from which
+ * the records are replayed when the log is opened again, until the first
+ * one which is torn or stale.
+ *
+ * An index of the extents of the volume held by the log, newest first,
+ * points to their data in it. Reads overlapping the index are handed over
+ * to the worker too, which reads them from the servers if the log does not
+ * hold all of their data, then overlays the extents of the log.
+ *
+ * The destager sends the extents of the oldest records to the servers as
+ * ranged PUTs, sorted by offset and coalesced up to the device's
+ * max_io_size, syncs the servers, and releases the records. It runs in the
+ * background every SRB_WBLOG_DESTAGE_MS, right away once the log is over
+ * SRB_WBLOG_HIGH_PCT full, and from the worker when a write does not fit.
+ * Discards, zeroing and write same requests are only sent to the servers
+ * once the whole log was destaged.
+ *
+ * The servers are reached through the device's paths (see srb_send_wait),
+ * rather than through a connection of the log's own.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/crc32.h>
+
+#include "srb.h"
+
+#define WBLOG_MAGIC		"SRBWBLOG"
+#define WBLOG_VERSION		1
+#define WBLOG_REC_MAGIC		0x5342524cU	/* "SRBL" */
+
+/* On-disk superblock, at the start of the log */
+struct srb_wblog_sb_s {
+	char			magic[8];
+	__le32			version;
+	__le32			slot;
+	__le64			size;		/* Of the log */
+	__le64			stamp;		/* Of the records */
+	__le64			tail;		/* Oldest record */
+	__le64			tail_seq;
+	char			volume[SRB_URL_SIZE + 1];
+};
+
+/* On-disk header of a record, in its own slot */
+struct srb_wblog_hdr_s {
+	__le32			magic;
+	__le32			len;		/* Of the data following it */
+	__le64			seq;
+	__le64			stamp;
+	__le64			offset;		/* On the volume */
+	__le32			data_crc;
+	__le32			hdr_crc;	/* Computed with hdr_crc = 0 */
+};
+
+/* Extent of the volume whose latest data is in the log */
+struct srb_wblog_extent_s {
+	struct rb_node		node;
+	uint64_t		start;
+	uint64_t		end;
+	uint64_t		pos;		/* Of start's data in the log */
+	uint64_t		seq;		/* Of its record */
+};
+
+struct srb_wblog_rec_s {
+	struct list_head	list;
+	uint64_t		seq;
+	uint64_t		pos;
+	uint64_t		size;		/* Header slot included */
+};
+
+struct srb_wblog_s {
+	struct srb_device_s	*dev;
+	struct file		*file;
+	char			path[SRB_URL_SIZE + 1];
+	uint64_t		size;
+	uint64_t		stamp;
+
+	spinlock_t		lock;		/* Protects what follows */
+	struct rb_root		index;		/* Extents, by offset */
+	uint64_t		dirty;		/* Bytes of the extents */
+	struct list_head	records;	/* Oldest first */
+	uint64_t		used;		/* Bytes of the records */
+	uint64_t		head;		/* Where the next record goes */
+	uint64_t		seq;		/* Of the next record */
+	struct list_head	pending;	/* Requests for the worker */
+	int			stopping;
+
+	struct workqueue_struct	*wq;
+	struct work_struct	work;		/* Log worker */
+	struct delayed_work	destage_work;
+	struct mutex		destage_mutex;
+	struct page		**pages;	/* Destaging buffer, max_io_size */
+	int			nr_pages;
+	char			*slot;		/* Header buffer, worker's */
+	char			*sb;		/* Superblock buffer, destager's */
+};
+
+/*
+ * Log file I/O
+ */
+static int wblog_rw(struct srb_wblog_s *wb, int write, void *buf, size_t len,
+		    uint64_t pos)
+{
+	ssize_t ret;
+
+	if (write)
+		ret = srb_kernel_write(wb->file, buf, len, pos);
+	else
+		ret = srb_kernel_read(wb->file, buf, len, pos);
+	if (ret != len) {
+		SRBDEV_LOG_ERR(wb->dev, "Unable to %s %zu bytes at %llu of "
+			       "write-back log %s: %zd", write ? "write" : "read",
+			       len, (unsigned long long)pos, wb->path, ret);
+		return ret < 0 ? ret : -EIO;
+	}
+
+	return 0;
+}
+
+static int wblog_sync(struct srb_wblog_s *wb)
+{
+	int ret;
+
+	ret = vfs_fsync(wb->file, 0);
+	if (ret)
+		SRBDEV_LOG_ERR(wb->dev, "Unable to sync write-back log %s: %d",
+			       wb->path, ret);
+
+	return ret;
+}
+
+/*
+ * Copies len bytes of the log at pos between the pages of a request, at
+ * position at of it, and the log: into them unless write is set.
+ */
+static int wblog_rw_sg(struct srb_wblog_s *wb, int write,
+		       struct srb_cmd_s *cmd, unsigned int at,
+		       unsigned int len, uint64_t pos)
+{
+	struct scatterlist *sg;
+	unsigned int base = 0;
+	unsigned int off;
+	unsigned int n;
+	int ret;
+	int i;
+
+	for (i = 0; i < cmd->sgl_size && len; base += sg->length, i++) {
+		sg = &cmd->sgl[i];
+		if (at >= base + sg->length)
+			continue;
+		off = at - base;
+		n = min_t(unsigned int, len, sg->length - off);
+		ret = wblog_rw(wb, write, (char *)sg_virt(sg) + off, n, pos);
+		if (ret)
+			return ret;
+		at += n;
+		pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Oldest record still in the log, past the ones up to seq after (0: none),
+ * or where the next one goes. wblog lock held.
+ */
+static void __wblog_tail(struct srb_wblog_s *wb, uint64_t after,
+			 uint64_t *tail, uint64_t *tail_seq)
+{
+	struct srb_wblog_rec_s *rec;
+
+	list_for_each_entry(rec, &wb->records, list) {
+		if (rec->seq > after) {
+			*tail = rec->pos;
+			*tail_seq = rec->seq;
+			return;
+		}
+	}
+	*tail = wb->head;
+	*tail_seq = wb->seq;
+}
+
+/* Records up to seq after (0: none) are no longer replayed */
+static int wblog_write_sb(struct srb_wblog_s *wb, uint64_t after)
+{
+	struct srb_wblog_sb_s *sb = (struct srb_wblog_sb_s *)wb->sb;
+	uint64_t tail, tail_seq;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	__wblog_tail(wb, after, &tail, &tail_seq);
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	memset(wb->sb, 0, SRB_WBLOG_SLOT);
+	memcpy(sb->magic, WBLOG_MAGIC, sizeof(sb->magic));
+	sb->version	= cpu_to_le32(WBLOG_VERSION);
+	sb->slot	= cpu_to_le32(SRB_WBLOG_SLOT);
+	sb->size	= cpu_to_le64(wb->size);
+	sb->stamp	= cpu_to_le64(wb->stamp);
+	sb->tail	= cpu_to_le64(tail);
+	sb->tail_seq	= cpu_to_le64(tail_seq);
+	strncpy(sb->volume, wb->dev->filename, SRB_URL_SIZE);
+
+	ret = wblog_rw(wb, 1, wb->sb, SRB_WBLOG_SLOT, 0);
+	if (!ret)
+		ret = wblog_sync(wb);
+
+	return ret;
+}
+
+/*
+ * Index
+ */
+
+/* First extent ending after offset. wblog lock held. */
+static struct srb_wblog_extent_s *__wblog_first(struct srb_wblog_s *wb,
+						uint64_t offset)
+{
+	struct rb_node *node = wb->index.rb_node;
+	struct srb_wblog_extent_s *first = NULL;
+	struct srb_wblog_extent_s *e;
+
+	while (node) {
+		e = rb_entry(node, struct srb_wblog_extent_s, node);
+		if (e->end <= offset) {
+			node = node->rb_right;
+		} else {
+			first = e;
+			node = node->rb_left;
+		}
+	}
+
+	return first;
+}
+
+static struct srb_wblog_extent_s *__wblog_next(struct srb_wblog_extent_s *e)
+{
+	struct rb_node *node = rb_next(&e->node);
+
+	return node ? rb_entry(node, struct srb_wblog_extent_s, node) : NULL;
+}
+
+static void __wblog_link(struct srb_wblog_s *wb, struct srb_wblog_extent_s *new)
+{
+	struct rb_node **link = &wb->index.rb_node;
+	struct rb_node *parent = NULL;
+	struct srb_wblog_extent_s *e;
+
+	while (*link) {
+		parent = *link;
+		e = rb_entry(parent, struct srb_wblog_extent_s, node);
+		if (new->start < e->start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &wb->index);
+	wb->dirty += new->end - new->start;
+}
+
+static void __wblog_unlink(struct srb_wblog_s *wb, struct srb_wblog_extent_s *e)
+{
+	rb_erase(&e->node, &wb->index);
+	wb->dirty -= e->end - e->start;
+	kfree(e);
+}
+
+/*
+ * Makes new the latest data of its extent, trimming the ones it overlaps.
+ * Splitting an extent takes split, which is consumed then (set to NULL).
+ * wblog lock held.
+ */
+static void __wblog_index(struct srb_wblog_s *wb, struct srb_wblog_extent_s *new,
+			  struct srb_wblog_extent_s **split)
+{
+	struct srb_wblog_extent_s *e, *next;
+
+	for (e = __wblog_first(wb, new->start); e && e->start < new->end;
+	     e = next) {
+		next = __wblog_next(e);
+		if (e->start < new->start && e->end > new->end) {
+			(*split)->start = new->end;
+			(*split)->end = e->end;
+			(*split)->pos = e->pos + (new->end - e->start);
+			(*split)->seq = e->seq;
+			wb->dirty -= e->end - new->start;
+			e->end = new->start;
+			__wblog_link(wb, *split);
+			*split = NULL;
+			break;
+		} else if (e->start < new->start) {
+			wb->dirty -= e->end - new->start;
+			e->end = new->start;
+		} else if (e->end > new->end) {
+			wb->dirty -= new->end - e->start;
+			e->pos += new->end - e->start;
+			e->start = new->end;
+			break;
+		} else {
+			__wblog_unlink(wb, e);
+		}
+	}
+	__wblog_link(wb, new);
+}
+
+/* Adds the extent of a record to the index. May sleep. */
+static int wblog_index(struct srb_wblog_s *wb, uint64_t offset, int len,
+		       uint64_t pos, uint64_t seq)
+{
+	struct srb_wblog_extent_s *new, *split;
+	unsigned long flags;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	split = kzalloc(sizeof(*split), GFP_KERNEL);
+	if (!new || !split) {
+		kfree(new);
+		kfree(split);
+		return -ENOMEM;
+	}
+	new->start = offset;
+	new->end = offset + len;
+	new->pos = pos;
+	new->seq = seq;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	__wblog_index(wb, new, &split);
+	spin_unlock_irqrestore(&wb->lock, flags);
+	kfree(split);
+
+	return 0;
+}
+
+/*
+ * Copies the extents overlapping [start, end) of records seq_lo to seq_hi,
+ * clipped to it. Returns their number, or -ENOMEM.
+ */
+static int wblog_extents(struct srb_wblog_s *wb, uint64_t start, uint64_t end,
+			 uint64_t seq_lo, uint64_t seq_hi,
+			 struct srb_wblog_extent_s **extents)
+{
+	struct srb_wblog_extent_s *e, *copy;
+	unsigned long flags;
+	int max = 0;
+	int nr;
+
+	/*
+	 * The worker may split an extent while the lock is dropped to
+	 * allocate, so count again under the lock until they all fit.
+	 */
+	*extents = NULL;
+	spin_lock_irqsave(&wb->lock, flags);
+	for (;;) {
+		nr = 0;
+		for (e = __wblog_first(wb, start); e && e->start < end;
+		     e = __wblog_next(e))
+			if (e->seq >= seq_lo && e->seq <= seq_hi)
+				nr++;
+		if (nr <= max)
+			break;
+		spin_unlock_irqrestore(&wb->lock, flags);
+
+		kfree(*extents);
+		max = nr;
+		*extents = kmalloc_array(max, sizeof(**extents), GFP_KERNEL);
+		if (!*extents)
+			return -ENOMEM;
+		spin_lock_irqsave(&wb->lock, flags);
+	}
+
+	nr = 0;
+	for (e = __wblog_first(wb, start); e && e->start < end;
+	     e = __wblog_next(e)) {
+		if (e->seq < seq_lo || e->seq > seq_hi)
+			continue;
+		copy = &(*extents)[nr++];
+		*copy = *e;
+		if (copy->start < start) {
+			copy->pos += start - copy->start;
+			copy->start = start;
+		}
+		if (copy->end > end)
+			copy->end = end;
+	}
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	return nr;
+}
+
+/*
+ * Destager
+ */
+
+/*
+ * Sends size bytes of contiguous extents to the servers from the log,
+ * through wb->pages, skipping the first skip bytes of the first one.
+ */
+static int wblog_put(struct srb_wblog_s *wb, struct srb_wblog_extent_s *e,
+		     uint64_t skip, uint64_t size)
+{
+	struct scatterlist *pages;
+	uint64_t offset = e->start + skip;
+	unsigned int at = 0;
+	unsigned int n;
+	int nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	int ret;
+	int i;
+
+	while (at < size) {
+		n = min_t(uint64_t, size - at, e->end - e->start - skip);
+		n = min_t(unsigned int, n, PAGE_SIZE - (at & ~PAGE_MASK));
+		ret = wblog_rw(wb, 0, (char *)page_address(
+			       wb->pages[at >> PAGE_SHIFT]) +
+			       (at & ~PAGE_MASK), n, e->pos + skip);
+		if (ret)
+			return ret;
+		at += n;
+		skip += n;
+		if (skip == e->end - e->start) {
+			e++;
+			skip = 0;
+		}
+	}
+
+	pages = kmalloc_array(nr_pages, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+	sg_init_table(pages, nr_pages);
+	for (i = 0; i < nr_pages; i++)
+		sg_set_page(&pages[i], wb->pages[i],
+			    min_t(uint64_t, PAGE_SIZE, size - i * PAGE_SIZE), 0);
+
+	ret = srb_send_wait(wb->dev, SRB_CMD_WRITE, 0, offset, size, pages,
+			    nr_pages, -1);
+	kfree(pages);
+
+	return ret;
+}
+
+/*
+ * Destages the oldest records, up to SRB_WBLOG_BATCH bytes of them.
+ * destage_mutex held.
+ */
+static int wblog_destage_batch(struct srb_wblog_s *wb)
+{
+	struct srb_device_s *dev = wb->dev;
+	struct srb_wblog_extent_s *extents;
+	struct srb_wblog_extent_s *e, *next;
+	struct srb_wblog_rec_s *rec, *tmp;
+	uint64_t seq_lo, seq_hi;
+	uint64_t batch = 0;
+	uint64_t skip, first_skip;
+	uint64_t size;
+	uint64_t len;
+	unsigned long flags;
+	int first;
+	int nr;
+	int ret = 0;
+	int i;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	if (list_empty(&wb->records)) {
+		spin_unlock_irqrestore(&wb->lock, flags);
+		return 0;
+	}
+	seq_lo = list_first_entry(&wb->records, struct srb_wblog_rec_s, list)->seq;
+	seq_hi = seq_lo;
+	list_for_each_entry(rec, &wb->records, list) {
+		if (batch && batch + rec->size > SRB_WBLOG_BATCH)
+			break;
+		batch += rec->size;
+		seq_hi = rec->seq;
+	}
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	nr = wblog_extents(wb, 0, ~0ULL, seq_lo, seq_hi, &extents);
+	if (nr < 0)
+		return nr;
+
+	/*
+	 * Extents come sorted: contiguous ones make a single PUT, up to
+	 * max_io_size (records replayed may be larger).
+	 */
+	for (i = 0, skip = 0; i < nr; ) {
+		first = i;
+		first_skip = skip;
+		size = 0;
+		while (i < nr && size < dev->max_io_size) {
+			if (size && extents[i].start != extents[i - 1].end)
+				break;
+			len = min_t(uint64_t, extents[i].end - extents[i].start -
+				    skip, dev->max_io_size - size);
+			size += len;
+			skip += len;
+			if (skip < extents[i].end - extents[i].start)
+				break;
+			i++;
+			skip = 0;
+		}
+		ret = wblog_put(wb, &extents[first], first_skip, size);
+		if (ret)
+			goto out;
+	}
+
+	/* The servers hold the same volume, and each must make it durable */
+	for (i = 0; nr && i < dev->nb_paths; i++) {
+		ret = srb_send_wait(dev, SRB_CMD_SYNC, 0, 0, 0, NULL, 0, i);
+		if (ret)
+			goto out;
+	}
+
+	/* Records must not be replayed once their room may be reused */
+	ret = wblog_write_sb(wb, seq_hi);
+	if (ret)
+		goto out;
+
+	/* Reads of the range will go to the servers again */
+	for (i = 0; i < nr; i++)
+		srb_ra_invalidate(dev, extents[i].start,
+				  extents[i].end - extents[i].start);
+
+	spin_lock_irqsave(&wb->lock, flags);
+	for (i = 0; i < nr; i++) {
+		for (e = __wblog_first(wb, extents[i].start);
+		     e && e->start < extents[i].end; e = next) {
+			next = __wblog_next(e);
+			if (e->seq == extents[i].seq)
+				__wblog_unlink(wb, e);
+		}
+	}
+	list_for_each_entry_safe(rec, tmp, &wb->records, list) {
+		if (rec->seq > seq_hi)
+			break;
+		wb->used -= rec->size;
+		list_del(&rec->list);
+		kfree(rec);
+	}
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	SRBDEV_LOG_DEBUG(dev, "Destaged records %llu to %llu (%d extents)",
+			 (unsigned long long)seq_lo,
+			 (unsigned long long)seq_hi, nr);
+
+out:
+	if (ret)
+		SRBDEV_LOG_WARN(dev, "Unable to destage write-back log %s: %d",
+				wb->path, ret);
+	kfree(extents);
+
+	return ret;
+}
+
+/* Destages the oldest records, or all of them */
+static int wblog_destage(struct srb_wblog_s *wb, int all)
+{
+	unsigned long flags;
+	int more;
+	int ret;
+
+	mutex_lock(&wb->destage_mutex);
+	do {
+		ret = wblog_destage_batch(wb);
+		spin_lock_irqsave(&wb->lock, flags);
+		more = !list_empty(&wb->records);
+		spin_unlock_irqrestore(&wb->lock, flags);
+	} while (!ret && all && more);
+	mutex_unlock(&wb->destage_mutex);
+
+	return ret;
+}
+
+static void wblog_destage_work(struct work_struct *work)
+{
+	struct srb_wblog_s *wb = container_of(to_delayed_work(work),
+					      struct srb_wblog_s, destage_work);
+	unsigned int noio;
+
+	noio = memalloc_noio_save();
+	wblog_destage(wb, 1);
+	memalloc_noio_restore(noio);
+	if (!wb->stopping)
+		queue_delayed_work(wb->wq, &wb->destage_work,
+				   msecs_to_jiffies(SRB_WBLOG_DESTAGE_MS));
+}
+
+/*
+ * Log worker
+ */
+
+/* Finds room for a record. wblog lock held. */
+static int __wblog_fits(struct srb_wblog_s *wb, uint64_t size, uint64_t *pos)
+{
+	uint64_t tail, tail_seq;
+
+	if (list_empty(&wb->records))
+		wb->head = SRB_WBLOG_START;
+	__wblog_tail(wb, 0, &tail, &tail_seq);
+
+	if (list_empty(&wb->records) || wb->head > tail) {
+		/* Free space at the end, then before the tail */
+		if (wb->head + size <= wb->size) {
+			*pos = wb->head;
+			return 1;
+		}
+		if (!list_empty(&wb->records) &&
+		    SRB_WBLOG_START + size <= tail) {
+			*pos = SRB_WBLOG_START;
+			return 1;
+		}
+		return 0;
+	}
+
+	/* Wrapped around: free space up to the tail */
+	if (wb->head + size <= tail) {
+		*pos = wb->head;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Appends a write to the log, destaging records to make room for it */
+static int wblog_append(struct srb_wblog_s *wb, struct srb_cmd_s *cmd)
+{
+	struct srb_wblog_hdr_s *hdr = (struct srb_wblog_hdr_s *)wb->slot;
+	struct srb_wblog_rec_s *rec;
+	struct scatterlist *sg;
+	uint64_t size = SRB_WBLOG_SLOT + cmd->size;
+	unsigned long flags;
+	uint64_t pos;
+	uint64_t seq;
+	u32 crc = ~0;
+	int fits;
+	int ret;
+	int i;
+
+	rec = kzalloc(sizeof(*rec), GFP_KERNEL);
+	if (!rec)
+		return -ENOMEM;
+
+	for (;;) {
+		spin_lock_irqsave(&wb->lock, flags);
+		fits = __wblog_fits(wb, size, &pos);
+		seq = wb->seq;
+		spin_unlock_irqrestore(&wb->lock, flags);
+		if (fits)
+			break;
+		ret = wblog_destage(wb, 0);
+		if (ret)
+			goto err;
+	}
+
+	for (i = 0; i < cmd->sgl_size; i++) {
+		sg = &cmd->sgl[i];
+		crc = crc32_le(crc, sg_virt(sg), sg->length);
+	}
+
+	memset(wb->slot, 0, SRB_WBLOG_SLOT);
+	hdr->magic	= cpu_to_le32(WBLOG_REC_MAGIC);
+	hdr->len	= cpu_to_le32(cmd->size);
+	hdr->seq	= cpu_to_le64(seq);
+	hdr->stamp	= cpu_to_le64(wb->stamp);
+	hdr->offset	= cpu_to_le64(cmd->offset);
+	hdr->data_crc	= cpu_to_le32(crc);
+	hdr->hdr_crc	= cpu_to_le32(crc32_le(~0, (unsigned char *)hdr,
+					       sizeof(*hdr)));
+
+	ret = wblog_rw(wb, 1, wb->slot, SRB_WBLOG_SLOT, pos);
+	if (!ret)
+		ret = wblog_rw_sg(wb, 1, cmd, 0, cmd->size,
+				  pos + SRB_WBLOG_SLOT);
+	if (!ret)
+		ret = wblog_index(wb, cmd->offset, cmd->size,
+				  pos + SRB_WBLOG_SLOT, seq);
+	if (ret)
+		goto err;
+
+	rec->seq = seq;
+	rec->pos = pos;
+	rec->size = size;
+	spin_lock_irqsave(&wb->lock, flags);
+	list_add_tail(&rec->list, &wb->records);
+	wb->used += size;
+	wb->head = pos + size;
+	wb->seq++;
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	return 0;
+
+err:
+	kfree(rec);
+	return ret;
+}
+
+/* Acknowledges the writes appended, once the log is synced */
+static void wblog_commit(struct srb_wblog_s *wb, struct list_head *appended)
+{
+	struct srb_cmd_s *cmd, *tmp;
+	int ret;
+
+	if (list_empty(appended))
+		return;
+
+	ret = wblog_sync(wb);
+	list_for_each_entry_safe(cmd, tmp, appended, list) {
+		list_del_init(&cmd->list);
+		srb_end_request(cmd->req, ret ? -EIO : 0);
+	}
+}
+
+/* Reads what the servers do not hold from the log */
+static void wblog_read(struct srb_wblog_s *wb, struct srb_cmd_s *cmd)
+{
+	struct srb_wblog_extent_s *extents;
+	uint64_t covered = cmd->offset;
+	int nr;
+	int ret = 0;
+	int i;
+
+	nr = wblog_extents(wb, cmd->offset, cmd->offset + cmd->size,
+			   0, ~0ULL, &extents);
+	if (nr < 0) {
+		ret = nr;
+		goto out;
+	}
+
+	for (i = 0; i < nr && extents[i].start == covered; i++)
+		covered = extents[i].end;
+	if (covered < cmd->offset + cmd->size)
+		ret = srb_send_wait(wb->dev, SRB_CMD_READ, 0, cmd->offset,
+				    cmd->size, cmd->sgl, cmd->sgl_size, -1);
+
+	/* Only the worker appends records: their data stays in the log */
+	for (i = 0; !ret && i < nr; i++)
+		ret = wblog_rw_sg(wb, 0, cmd, extents[i].start - cmd->offset,
+				  extents[i].end - extents[i].start,
+				  extents[i].pos);
+	kfree(extents);
+
+out:
+	cmd->local = 1;
+	srb_end_request(cmd->req, ret);
+}
+
+static void wblog_work(struct work_struct *work)
+{
+	struct srb_wblog_s *wb = container_of(work, struct srb_wblog_s, work);
+	struct srb_device_s *dev = wb->dev;
+	struct srb_cmd_s *cmd, *tmp;
+	unsigned long flags;
+	LIST_HEAD(appended);
+	LIST_HEAD(batch);
+	unsigned int noio;
+	int high;
+	int ret;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	list_splice_init(&wb->pending, &batch);
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	/*
+	 * The log file's page cache must not reclaim memory by writing back
+	 * to this device, whose writes wait for us (see loop.c).
+	 */
+	noio = memalloc_noio_save();
+
+	list_for_each_entry_safe(cmd, tmp, &batch, list) {
+		list_del_init(&cmd->list);
+		switch (cmd->op) {
+		case SRB_CMD_WRITE:
+			ret = wblog_append(wb, cmd);
+			if (ret)
+				srb_end_request(cmd->req, ret);
+			else
+				list_add_tail(&cmd->list, &appended);
+			break;
+		case SRB_CMD_READ:
+			wblog_read(wb, cmd);
+			break;
+		default:
+			/* Must not be overwritten by older data of the log */
+			wblog_commit(wb, &appended);
+			ret = wblog_destage(wb, 1);
+			if (ret)
+				srb_end_request(cmd->req, ret);
+			else
+				srb_dispatch(dev, cmd);
+			break;
+		}
+	}
+	wblog_commit(wb, &appended);
+	memalloc_noio_restore(noio);
+
+	spin_lock_irqsave(&wb->lock, flags);
+	high = wb->used * 100 > wb->size * SRB_WBLOG_HIGH_PCT;
+	spin_unlock_irqrestore(&wb->lock, flags);
+	if (high)
+		mod_delayed_work(wb->wq, &wb->destage_work, 0);
+}
+
+/*
+ * Hands a request over to the log worker: writes, and reads overlapping
+ * the log. Returns 0 if the request is to be sent to a server as usual.
+ */
+int srb_wblog_submit(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	struct srb_wblog_s *wb = dev->wblog;
+	struct srb_wblog_extent_s *e;
+	unsigned long flags;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	if (cmd->op == SRB_CMD_READ) {
+		e = __wblog_first(wb, cmd->offset);
+		if (!e || e->start >= cmd->offset + cmd->size) {
+			spin_unlock_irqrestore(&wb->lock, flags);
+			return 0;
+		}
+	}
+	list_add_tail(&cmd->list, &wb->pending);
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	queue_work(wb->wq, &wb->work);
+
+	return 1;
+}
+
+/*
+ * Recovery
+ */
+
+/* Checks the record at pos, and indexes it if it is the one expected */
+static int wblog_replay(struct srb_wblog_s *wb, uint64_t pos)
+{
+	struct srb_wblog_hdr_s *hdr = (struct srb_wblog_hdr_s *)wb->slot;
+	struct srb_wblog_rec_s *rec;
+	uint64_t offset;
+	uint64_t done;
+	u32 hdr_crc;
+	u32 crc = ~0;
+	unsigned int n;
+	int len;
+	int ret;
+
+	if (pos + SRB_WBLOG_SLOT > wb->size)
+		return -EINVAL;
+	ret = wblog_rw(wb, 0, wb->slot, SRB_WBLOG_SLOT, pos);
+	if (ret)
+		return ret;
+
+	hdr_crc = le32_to_cpu(hdr->hdr_crc);
+	hdr->hdr_crc = 0;
+	len = le32_to_cpu(hdr->len);
+	offset = le64_to_cpu(hdr->offset);
+	if (le32_to_cpu(hdr->magic) != WBLOG_REC_MAGIC ||
+	    le64_to_cpu(hdr->stamp) != wb->stamp ||
+	    le64_to_cpu(hdr->seq) != wb->seq ||
+	    hdr_crc != crc32_le(~0, (unsigned char *)hdr, sizeof(*hdr)) ||
+	    len <= 0 || pos + SRB_WBLOG_SLOT + len > wb->size)
+		return -EINVAL;
+
+	for (done = 0; done < len; done += n) {
+		n = min_t(uint64_t, len - done, PAGE_SIZE);
+		ret = wblog_rw(wb, 0, page_address(wb->pages[0]), n,
+			       pos + SRB_WBLOG_SLOT + done);
+		if (ret)
+			return ret;
+		crc = crc32_le(crc, page_address(wb->pages[0]), n);
+	}
+	if (crc != le32_to_cpu(hdr->data_crc))
+		return -EINVAL;
+
+	rec = kzalloc(sizeof(*rec), GFP_KERNEL);
+	if (!rec)
+		return -ENOMEM;
+	ret = wblog_index(wb, offset, len, pos + SRB_WBLOG_SLOT, wb->seq);
+	if (ret) {
+		kfree(rec);
+		return ret;
+	}
+	rec->seq = wb->seq++;
+	rec->pos = pos;
+	rec->size = SRB_WBLOG_SLOT + len;
+	list_add_tail(&rec->list, &wb->records);
+	wb->used += rec->size;
+	wb->head = pos + rec->size;
+
+	return 0;
+}
+
+/* Formats the log, or replays the records of the volume it holds */
+static int wblog_load(struct srb_wblog_s *wb)
+{
+	struct srb_wblog_sb_s *sb = (struct srb_wblog_sb_s *)wb->sb;
+	struct srb_device_s *dev = wb->dev;
+	uint64_t pos;
+	int ret;
+
+	ret = wblog_rw(wb, 0, wb->sb, SRB_WBLOG_SLOT, 0);
+	if (ret)
+		return ret;
+
+	if (memcmp(sb->magic, WBLOG_MAGIC, sizeof(sb->magic)) ||
+	    le32_to_cpu(sb->version) != WBLOG_VERSION) {
+		SRBDEV_LOG_INFO(dev, "Formatting write-back log %s (%llu bytes)",
+				wb->path, (unsigned long long)wb->size);
+		wb->stamp = ((uint64_t)srb_random_u32() << 32) | srb_random_u32();
+		wb->seq = 1;
+		wb->head = SRB_WBLOG_START;
+		return wblog_write_sb(wb, 0);
+	}
+
+	sb->volume[SRB_URL_SIZE] = 0;
+	if (strcmp(sb->volume, dev->filename) ||
+	    le32_to_cpu(sb->slot) != SRB_WBLOG_SLOT ||
+	    le64_to_cpu(sb->size) > wb->size) {
+		SRBDEV_LOG_ERR(dev, "Write-back log %s belongs to volume %s",
+			       wb->path, sb->volume);
+		return -EINVAL;
+	}
+	wb->size = le64_to_cpu(sb->size);
+	wb->stamp = le64_to_cpu(sb->stamp);
+	wb->seq = le64_to_cpu(sb->tail_seq);
+	pos = le64_to_cpu(sb->tail);
+	wb->head = pos;
+
+	/* Records follow each other, wrapping around when one does not fit */
+	for (;;) {
+		ret = wblog_replay(wb, pos);
+		if (ret == -EINVAL && pos != SRB_WBLOG_START)
+			ret = wblog_replay(wb, pos = SRB_WBLOG_START);
+		if (ret == -EINVAL)
+			break;
+		if (ret)
+			return ret;
+		pos = wb->head;
+	}
+
+	SRBDEV_LOG_INFO(dev, "Replayed %llu bytes to write back from log %s",
+			(unsigned long long)wb->dirty, wb->path);
+
+	return 0;
+}
+
+static void wblog_free(struct srb_wblog_s *wb)
+{
+	struct srb_wblog_extent_s *e, *next;
+	struct srb_wblog_rec_s *rec, *tmp;
+	int i;
+
+	if (wb->wq)
+		destroy_workqueue(wb->wq);
+	if (wb->file && !IS_ERR(wb->file))
+		filp_close(wb->file, NULL);
+
+	for (e = __wblog_first(wb, 0); e; e = next) {
+		next = __wblog_next(e);
+		__wblog_unlink(wb, e);
+	}
+	list_for_each_entry_safe(rec, tmp, &wb->records, list) {
+		list_del(&rec->list);
+		kfree(rec);
+	}
+	if (wb->pages) {
+		for (i = 0; i < wb->nr_pages; i++) {
+			if (wb->pages[i])
+				__free_page(wb->pages[i]);
+		}
+		kfree(wb->pages);
+	}
+	kfree(wb->sb);
+	kfree(wb->slot);
+	kfree(wb);
+}
+
+/*
+ * Pairs a device with its write-back log, before it is made available:
+ * the data the log holds is more recent than the servers'.
+ */
+int srb_wblog_open(struct srb_device_s *dev, const char *path)
+{
+	struct srb_wblog_s *wb;
+	int ret;
+	int i;
+
+	wb = kzalloc(sizeof(*wb), GFP_KERNEL);
+	if (!wb)
+		return -ENOMEM;
+
+	wb->dev = dev;
+	strncpy(wb->path, path, SRB_URL_SIZE);
+	spin_lock_init(&wb->lock);
+	wb->index = RB_ROOT;
+	INIT_LIST_HEAD(&wb->records);
+	INIT_LIST_HEAD(&wb->pending);
+	INIT_WORK(&wb->work, wblog_work);
+	INIT_DELAYED_WORK(&wb->destage_work, wblog_destage_work);
+	mutex_init(&wb->destage_mutex);
+
+	wb->file = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(wb->file)) {
+		ret = PTR_ERR(wb->file);
+		SRBDEV_LOG_ERR(dev, "Unable to open write-back log %s: %d",
+			       path, ret);
+		goto err;
+	}
+
+	/* Room for the largest write, twice so the log can wrap around */
+	wb->size = round_down(i_size_read(wb->file->f_mapping->host),
+			      SRB_WBLOG_SLOT);
+	if (wb->size < SRB_WBLOG_START +
+	    2 * (SRB_WBLOG_SLOT + (uint64_t)dev->max_io_size)) {
+		SRBDEV_LOG_ERR(dev, "Write-back log %s is too small (%llu bytes)",
+			       path, (unsigned long long)wb->size);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	ret = -ENOMEM;
+	wb->slot = kzalloc(SRB_WBLOG_SLOT, GFP_KERNEL);
+	wb->sb = kzalloc(SRB_WBLOG_SLOT, GFP_KERNEL);
+	wb->nr_pages = dev->max_io_size >> PAGE_SHIFT;
+	wb->pages = kcalloc(wb->nr_pages, sizeof(struct page *), GFP_KERNEL);
+	if (!wb->slot || !wb->sb || !wb->pages)
+		goto err;
+	for (i = 0; i < wb->nr_pages; i++) {
+		wb->pages[i] = alloc_page(GFP_KERNEL);
+		if (!wb->pages[i])
+			goto err;
+	}
+
+	/* The worker and the destager run side by side */
+	wb->wq = alloc_workqueue("srb_wb_%s", WQ_MEM_RECLAIM | WQ_UNBOUND, 2,
+				 dev->name);
+	if (!wb->wq)
+		goto err;
+
+	ret = wblog_load(wb);
+	if (ret)
+		goto err;
+
+	dev->wblog = wb;
+	queue_delayed_work(wb->wq, &wb->destage_work,
+			   wb->dirty ? 0 : msecs_to_jiffies(SRB_WBLOG_DESTAGE_MS));
+
+	return 0;
+
+err:
+	wblog_free(wb);
+	return ret;
+}
+
+/*
+ * Destages what the log holds, once the device's requests all completed,
+ * and closes it. What could not be destaged is kept for the next time.
+ */
+void srb_wblog_close(struct srb_device_s *dev)
+{
+	struct srb_wblog_s *wb = dev->wblog;
+	unsigned int noio;
+
+	if (!wb)
+		return;
+
+	wb->stopping = 1;
+	cancel_delayed_work_sync(&wb->destage_work);
+	flush_workqueue(wb->wq);
+
+	noio = memalloc_noio_save();
+	if (wblog_destage(wb, 1))
+		SRBDEV_LOG_WARN(dev, "Keeping %llu bytes to write back in log %s",
+				(unsigned long long)wb->dirty, wb->path);
+	wblog_write_sb(wb, 0);
+	memalloc_noio_restore(noio);
+
+	dev->wblog = NULL;
+	wblog_free(wb);
+}
+
+const char *srb_wblog_path(struct srb_device_s *dev)
+{
+	return dev->wblog ? dev->wblog->path : "";
+}
+
+uint64_t srb_wblog_dirty(struct srb_device_s *dev)
+{
+	return dev->wblog ? dev->wblog->dirty : 0;
+}
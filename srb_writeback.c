@@ -0,0 +1,690 @@
+/*
+ * Copyright (C) 2014 SCALITY SA - http://www.scality.com
+ *
+ * This file is part of ScalityRestBlock.
+ *
+ * ScalityRestBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ScalityRestBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ScalityRestBlock.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Volatile write-back
+ *
+ * Devices of scratch volumes may keep their writes in memory, and complete
+ * them right away: what was written since the last flush is lost if the
+ * host crashes. The ranges written are kept in extents sorted by offset,
+ * the ranges overlapping a write being merged with it into a single extent,
+ * which holds the data of the pages it spans. Adjacent ranges are merged too
+ * while the extent stays within the device's max_io_size.
+ *
+ * Writes are handed over to the device's worker, which absorbs them into
+ * the extents, and so are the reads overlapping an extent, which it reads
+ * from the servers if the extents do not hold all of their data, then
+ * overlays the extents.
+ *
+ * The flusher sends the extents to the servers as ranged PUTs of up to the
+ * device's max_io_size. It runs in the background every
+ * SRB_WBACK_PERIOD_MS, for the extents older than expire_ms, or for all of
+ * them while more than half of max_dirty is in memory. Writes wait for it
+ * beyond max_dirty, flushes and FUA writes complete once it wrote back the
+ * extents, and discards, zeroing and write same requests are only sent
+ * once it wrote back the extents they overlap.
+ *
+ * Extents are replaced when they grow, so an extent whose generation did
+ * not change while it was sent is clean. Clean extents are kept while
+ * reads wait for a server (see wback_read), lest those overlay nothing on
+ * data read before it was written back.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+
+#include "srb.h"
+
+struct srb_wback_extent_s {
+	struct rb_node		node;
+	uint64_t		start;
+	uint64_t		end;
+	unsigned long		dirtied;	/* Its oldest write, jiffies */
+	unsigned long		gen;		/* Of its latest write */
+	unsigned long		flushed;	/* gen once written back */
+	struct page		**pages;	/* Of the volume, from start's */
+};
+
+static inline int wback_nr_pages(uint64_t start, uint64_t end)
+{
+	return ((end - 1) >> PAGE_SHIFT) - (start >> PAGE_SHIFT) + 1;
+}
+
+/* The page holding offset in an extent, and where */
+static inline char *wback_addr(struct srb_wback_extent_s *x, uint64_t offset)
+{
+	int i = (offset >> PAGE_SHIFT) - (x->start >> PAGE_SHIFT);
+
+	return (char *)page_address(x->pages[i]) + (offset & ~PAGE_MASK);
+}
+
+/*
+ * First extent ending after offset. wback lock or map_mutex held: extents
+ * change with both held.
+ */
+static struct srb_wback_extent_s *__wback_first(struct srb_wback_s *wb,
+						uint64_t offset)
+{
+	struct rb_node *node = wb->extents.rb_node;
+	struct srb_wback_extent_s *first = NULL;
+	struct srb_wback_extent_s *x;
+
+	while (node) {
+		x = rb_entry(node, struct srb_wback_extent_s, node);
+		if (x->end <= offset) {
+			node = node->rb_right;
+		} else {
+			first = x;
+			node = node->rb_left;
+		}
+	}
+
+	return first;
+}
+
+static struct srb_wback_extent_s *__wback_next(struct srb_wback_extent_s *x)
+{
+	struct rb_node *node = rb_next(&x->node);
+
+	return node ? rb_entry(node, struct srb_wback_extent_s, node) : NULL;
+}
+
+static void __wback_link(struct srb_wback_s *wb, struct srb_wback_extent_s *new)
+{
+	struct rb_node **link = &wb->extents.rb_node;
+	struct rb_node *parent = NULL;
+	struct srb_wback_extent_s *x;
+
+	while (*link) {
+		parent = *link;
+		x = rb_entry(parent, struct srb_wback_extent_s, node);
+		if (new->start < x->start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &wb->extents);
+	wb->dirty += new->end - new->start;
+}
+
+/* Unlinks an extent, freeing its pages unless they went to another one */
+static void __wback_unlink(struct srb_wback_s *wb, struct srb_wback_extent_s *x,
+			   int free_pages)
+{
+	int i;
+
+	rb_erase(&x->node, &wb->extents);
+	wb->dirty -= x->end - x->start;
+	if (free_pages) {
+		for (i = 0; i < wback_nr_pages(x->start, x->end); i++)
+			__free_page(x->pages[i]);
+	}
+	kfree(x->pages);
+	kfree(x);
+}
+
+/*
+ * Copies the bytes from start to end between the pages of a request and an
+ * extent: into the extent if to_extent is set.
+ */
+static void wback_copy(struct srb_wback_extent_s *x, struct srb_cmd_s *cmd,
+		       uint64_t start, uint64_t end, int to_extent)
+{
+	struct scatterlist *sg;
+	uint64_t base = cmd->offset;
+	unsigned int off;
+	unsigned int n;
+	char *addr;
+	int i;
+
+	for (i = 0; i < cmd->sgl_size && start < end; base += sg->length, i++) {
+		sg = &cmd->sgl[i];
+		while (start < end && start < base + sg->length) {
+			off = start - base;
+			n = min_t(uint64_t, end - start, sg->length - off);
+			n = min_t(unsigned int, n,
+				  PAGE_SIZE - (start & ~PAGE_MASK));
+			addr = wback_addr(x, start);
+			if (to_extent)
+				memcpy(addr, (char *)sg_virt(sg) + off, n);
+			else
+				memcpy((char *)sg_virt(sg) + off, addr, n);
+			start += n;
+		}
+	}
+}
+
+/*
+ * Absorbs a write into a new extent, replacing the extents it overlaps, and
+ * those it is adjacent to as long as the new one stays within max_io_size:
+ * extents are rebuilt on every write, which must stay cheap. map_mutex held.
+ */
+static int wback_absorb(struct srb_wback_s *wb, struct srb_cmd_s *cmd)
+{
+	struct srb_wback_extent_s *first, *stop, *left, *x, *next, *new;
+	uint64_t limit = wb->dev->max_io_size;
+	struct page **pages = NULL;
+	struct page *page, *tmp;
+	uint64_t wend = cmd->offset + cmd->size;
+	uint64_t start = cmd->offset;
+	uint64_t end = wend;
+	uint64_t base;
+	uint64_t from, to;
+	unsigned long flags;
+	LIST_HEAD(spare);
+	int nr;
+	int idx;
+	int i;
+
+	first = __wback_first(wb, start);
+	for (x = first; x && x->start < wend; x = __wback_next(x)) {
+		start = min(start, x->start);
+		end = max(end, x->end);
+	}
+	stop = x;
+	if (stop && stop->start == end && stop->end - start <= limit) {
+		end = stop->end;
+		stop = __wback_next(stop);
+	}
+	left = start ? __wback_first(wb, start - 1) : NULL;
+	if (left && left->end == start && end - left->start <= limit) {
+		start = left->start;
+		first = left;
+	}
+	base = start >> PAGE_SHIFT;
+	nr = wback_nr_pages(start, end);
+
+	new = kzalloc(sizeof(*new), GFP_NOIO);
+	pages = kcalloc(nr, sizeof(*pages), GFP_NOIO);
+	if (!new || !pages)
+		goto err;
+
+	/*
+	 * Borrow the pages of the extents merged, a page shared by two of them
+	 * being the first one's, then allocate the others up front: from there
+	 * on, nothing fails.
+	 */
+	for (x = first; x != stop; x = __wback_next(x)) {
+		for (i = 0; i < wback_nr_pages(x->start, x->end); i++) {
+			idx = (x->start >> PAGE_SHIFT) - base + i;
+			if (!pages[idx])
+				pages[idx] = x->pages[i];
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		if (pages[i])
+			continue;
+		page = alloc_page(GFP_NOIO);
+		if (!page)
+			goto err;
+		list_add(&page->lru, &spare);
+	}
+	for (i = 0; i < nr; i++) {
+		if (pages[i])
+			continue;
+		page = list_first_entry(&spare, struct page, lru);
+		list_del(&page->lru);
+		pages[i] = page;
+	}
+
+	new->start = start;
+	new->end = end;
+	new->pages = pages;
+	new->dirtied = jiffies;
+	new->gen = ++wb->gen;
+	for (x = first; x != stop; x = __wback_next(x)) {
+		if (time_before(x->dirtied, new->dirtied))
+			new->dirtied = x->dirtied;
+		/* The second extent of a shared page moves its bytes over */
+		for (i = 0; i < wback_nr_pages(x->start, x->end); i++) {
+			idx = (x->start >> PAGE_SHIFT) - base + i;
+			if (pages[idx] == x->pages[i])
+				continue;
+			from = max(x->start, (base + idx) << PAGE_SHIFT);
+			to = min(x->end, (base + idx + 1) << PAGE_SHIFT);
+			memcpy(wback_addr(new, from), wback_addr(x, from),
+			       to - from);
+			__free_page(x->pages[i]);
+		}
+	}
+	wback_copy(new, cmd, cmd->offset, wend, 1);
+
+	spin_lock_irqsave(&wb->lock, flags);
+	for (x = first; x != stop; x = next) {
+		next = __wback_next(x);
+		__wback_unlink(wb, x, 0);
+	}
+	__wback_link(wb, new);
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	return 0;
+
+err:
+	list_for_each_entry_safe(page, tmp, &spare, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+	kfree(pages);
+	kfree(new);
+	return -ENOMEM;
+}
+
+/*
+ * Drops the extents written back, unless reads wait for a server.
+ * flush_mutex held.
+ */
+static void wback_clean(struct srb_wback_s *wb)
+{
+	struct srb_wback_extent_s *x, *next;
+	unsigned long flags;
+
+	mutex_lock(&wb->map_mutex);
+	if (!wb->readers) {
+		spin_lock_irqsave(&wb->lock, flags);
+		for (x = __wback_first(wb, 0); x; x = next) {
+			next = __wback_next(x);
+			if (x->flushed == x->gen)
+				__wback_unlink(wb, x, 1);
+		}
+		spin_unlock_irqrestore(&wb->lock, flags);
+	}
+	mutex_unlock(&wb->map_mutex);
+}
+
+/*
+ * Sends the piece of the extent holding offset from there, up to the
+ * device's max_io_size and the extent's end. Returns its size, or an error.
+ */
+static int wback_put(struct srb_wback_s *wb, uint64_t offset, int fua)
+{
+	struct srb_device_s *dev = wb->dev;
+	struct srb_wback_extent_s *x;
+	struct page *page;
+	unsigned int off;
+	unsigned int n;
+	uint64_t pos;
+	int size;
+	int nr;
+	int ret;
+	int i;
+
+	/* Only the flusher drops extents, the others cover what they did */
+	mutex_lock(&wb->map_mutex);
+	x = __wback_first(wb, offset);
+	size = min_t(uint64_t, x->end - offset, dev->max_io_size);
+	nr = wback_nr_pages(offset, offset + size);
+	sg_init_table(wb->sgl, nr);
+	for (pos = offset, i = 0; i < nr; pos += n, i++) {
+		off = pos & ~PAGE_MASK;
+		n = min_t(uint64_t, PAGE_SIZE - off, offset + size - pos);
+		page = x->pages[(pos >> PAGE_SHIFT) - (x->start >> PAGE_SHIFT)];
+		/* Merging extents frees the pages they shared */
+		get_page(page);
+		sg_set_page(&wb->sgl[i], page, n, off);
+	}
+	mutex_unlock(&wb->map_mutex);
+
+	/* Writes absorbed meanwhile are sent again with their extent */
+	ret = srb_send_wait(dev, SRB_CMD_WRITE, fua, offset, size, wb->sgl, nr,
+			    -1);
+	for (i = 0; i < nr; i++)
+		put_page(sg_page(&wb->sgl[i]));
+	if (ret)
+		return ret;
+
+	/* Reads of the range will go to the servers again */
+	srb_ra_invalidate(dev, offset, size);
+
+	return size;
+}
+
+/*
+ * Writes back the extents overlapping the range from start to end: all of
+ * them, or those older than expire_ms.
+ */
+static int wback_flush(struct srb_wback_s *wb, uint64_t start, uint64_t end,
+		       int all, int fua)
+{
+	struct srb_wback_extent_s *x;
+	unsigned long expire = msecs_to_jiffies(wb->expire_ms);
+	unsigned long gen;
+	uint64_t pos = start;
+	uint64_t first, last;
+	int ret = 0;
+
+	mutex_lock(&wb->flush_mutex);
+	for (;;) {
+		mutex_lock(&wb->map_mutex);
+		for (x = __wback_first(wb, pos); x && x->start < end;
+		     x = __wback_next(x)) {
+			if (x->flushed != x->gen &&
+			    (all || time_after_eq(jiffies, x->dirtied + expire)))
+				break;
+		}
+		if (!x || x->start >= end) {
+			mutex_unlock(&wb->map_mutex);
+			break;
+		}
+		first = max(pos, x->start);
+		last = x->end;
+		gen = x->gen;
+		mutex_unlock(&wb->map_mutex);
+
+		for (pos = first; pos < last; pos += ret) {
+			ret = wback_put(wb, pos, fua);
+			if (ret < 0)
+				goto out;
+		}
+		ret = 0;
+
+		/* Clean unless it was written meanwhile */
+		mutex_lock(&wb->map_mutex);
+		x = __wback_first(wb, first);
+		if (x->start == first && x->end == last && x->gen == gen)
+			x->flushed = gen;
+		mutex_unlock(&wb->map_mutex);
+	}
+
+out:
+	wback_clean(wb);
+	mutex_unlock(&wb->flush_mutex);
+	if (ret)
+		SRBDEV_LOG_WARN(wb->dev, "Unable to write back range at %llu: %d",
+				(unsigned long long)pos, ret);
+
+	return ret;
+}
+
+static int wback_over(struct srb_wback_s *wb, uint64_t limit)
+{
+	unsigned long flags;
+	int over;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	over = wb->dirty > limit;
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	return over;
+}
+
+static void wback_flush_work(struct work_struct *work)
+{
+	struct srb_wback_s *wb = container_of(to_delayed_work(work),
+					      struct srb_wback_s, flush_work);
+
+	wback_flush(wb, 0, ~0ULL, !wb->enabled ||
+		    wback_over(wb, wb->max_dirty / 2), 0);
+	if (!wb->stopping)
+		queue_delayed_work(wb->wq, &wb->flush_work,
+				   msecs_to_jiffies(SRB_WBACK_PERIOD_MS));
+}
+
+/* Reads what the servers do not hold from the extents */
+static void wback_read(struct srb_wback_s *wb, struct srb_cmd_s *cmd)
+{
+	struct srb_wback_extent_s *x;
+	uint64_t start = cmd->offset;
+	uint64_t end = start + cmd->size;
+	uint64_t covered = start;
+	int ret = 0;
+
+	mutex_lock(&wb->map_mutex);
+	for (x = __wback_first(wb, start); x && x->start <= covered &&
+	     covered < end; x = __wback_next(x))
+		covered = x->end;
+	if (covered < end) {
+		wb->readers++;
+		mutex_unlock(&wb->map_mutex);
+		ret = srb_send_wait(wb->dev, SRB_CMD_READ, 0, start, cmd->size,
+				    cmd->sgl, cmd->sgl_size, -1);
+		mutex_lock(&wb->map_mutex);
+		wb->readers--;
+	}
+	for (x = __wback_first(wb, start); !ret && x && x->start < end;
+	     x = __wback_next(x))
+		wback_copy(x, cmd, max(start, x->start), min(end, x->end), 0);
+	mutex_unlock(&wb->map_mutex);
+
+	cmd->local = 1;
+	srb_end_request(cmd->req, ret);
+}
+
+static void wback_write(struct srb_wback_s *wb, struct srb_cmd_s *cmd)
+{
+	uint64_t end = cmd->offset + cmd->size;
+	int ret;
+
+	if (wback_over(wb, wb->max_dirty)) {
+		ret = wback_flush(wb, 0, ~0ULL, 1, 0);
+		if (ret) {
+			srb_end_request(cmd->req, ret);
+			return;
+		}
+	}
+
+	mutex_lock(&wb->map_mutex);
+	ret = wback_absorb(wb, cmd);
+	mutex_unlock(&wb->map_mutex);
+	if (ret) {
+		/* Sent as is, once older data of its range is */
+		ret = wback_flush(wb, cmd->offset, end, 1, 0);
+		if (!ret)
+			srb_dispatch(wb->dev, cmd);
+		else
+			srb_end_request(cmd->req, ret);
+		return;
+	}
+
+	if (cmd->fua)
+		ret = wback_flush(wb, cmd->offset, end, 1, 1);
+	srb_end_request(cmd->req, ret);
+}
+
+static void wback_work(struct work_struct *work)
+{
+	struct srb_wback_s *wb = container_of(work, struct srb_wback_s, work);
+	struct srb_cmd_s *cmd, *tmp;
+	unsigned long flags;
+	LIST_HEAD(batch);
+	int ret;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	list_splice_init(&wb->pending, &batch);
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	list_for_each_entry_safe(cmd, tmp, &batch, list) {
+		list_del_init(&cmd->list);
+		switch (cmd->op) {
+		case SRB_CMD_WRITE:
+			wback_write(wb, cmd);
+			break;
+		case SRB_CMD_READ:
+			wback_read(wb, cmd);
+			break;
+		case SRB_CMD_SYNC:
+			/* The servers are synced once the extents are sent */
+			ret = wback_flush(wb, 0, ~0ULL, 1, 0);
+			if (ret)
+				srb_end_request(cmd->req, ret);
+			else
+				srb_flush_submit(wb->dev, cmd);
+			break;
+		default:
+			/* Must not be overwritten by older data of the range */
+			ret = wback_flush(wb, cmd->offset,
+					  cmd->offset + cmd->size, 1, 0);
+			if (ret)
+				srb_end_request(cmd->req, ret);
+			else
+				srb_dispatch(wb->dev, cmd);
+			break;
+		}
+	}
+
+	if (wback_over(wb, wb->max_dirty / 2))
+		mod_delayed_work(wb->wq, &wb->flush_work, 0);
+}
+
+/*
+ * Hands a request over to the worker while the device writes back, or
+ * still holds extents: writes, flushes, and reads overlapping the extents.
+ * Returns 0 if the request is to be sent to a server as usual.
+ */
+int srb_wback_submit(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	struct srb_wback_s *wb = &dev->wback;
+	struct srb_wback_extent_s *x;
+	unsigned long flags;
+
+	if (!wb->wq)
+		return 0;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	if (!wb->enabled && RB_EMPTY_ROOT(&wb->extents) &&
+	    list_empty(&wb->pending))
+		goto out;
+	if (cmd->op == SRB_CMD_READ) {
+		x = __wback_first(wb, cmd->offset);
+		if (!x || x->start >= cmd->offset + cmd->size)
+			goto out;
+	}
+	list_add_tail(&cmd->list, &wb->pending);
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	queue_work(wb->wq, &wb->work);
+
+	return 1;
+
+out:
+	spin_unlock_irqrestore(&wb->lock, flags);
+	return 0;
+}
+
+/*
+ * Starts or stops absorbing writes. Stopping returns once the extents were
+ * written back.
+ */
+int srb_wback_enable(struct srb_device_s *dev, int enable)
+{
+	struct srb_wback_s *wb = &dev->wback;
+	unsigned long flags;
+	int ret = 0;
+
+	if (enable && dev->wblog)
+		return -EBUSY;
+
+	mutex_lock(&wb->flush_mutex);
+	if (enable && !wb->wq) {
+		wb->sgl = kmalloc_array(dev->max_segs + 1, sizeof(*wb->sgl),
+					GFP_KERNEL);
+		/* The worker and the flusher run side by side */
+		wb->wq = alloc_workqueue("srb_wback_%s",
+					 WQ_MEM_RECLAIM | WQ_UNBOUND, 2,
+					 dev->name);
+		if (!wb->sgl || !wb->wq) {
+			if (wb->wq)
+				destroy_workqueue(wb->wq);
+			wb->wq = NULL;
+			kfree(wb->sgl);
+			wb->sgl = NULL;
+			ret = -ENOMEM;
+		} else {
+			queue_delayed_work(wb->wq, &wb->flush_work,
+					   msecs_to_jiffies(SRB_WBACK_PERIOD_MS));
+		}
+	}
+	mutex_unlock(&wb->flush_mutex);
+	if (ret || !wb->wq)
+		return ret;
+
+	spin_lock_irqsave(&wb->lock, flags);
+	wb->enabled = !!enable;
+	spin_unlock_irqrestore(&wb->lock, flags);
+
+	SRBDEV_LOG_INFO(dev, "Volatile write-back %s",
+			enable ? "enabled" : "disabled");
+	if (!enable) {
+		flush_workqueue(wb->wq);
+		ret = wback_flush(wb, 0, ~0ULL, 1, 0);
+	}
+
+	return ret;
+}
+
+/* Writes back the extents, once the device's requests all completed */
+void srb_wback_stop(struct srb_device_s *dev)
+{
+	struct srb_wback_s *wb = &dev->wback;
+	struct srb_wback_extent_s *x, *next;
+
+	if (!wb->wq)
+		return;
+
+	wb->stopping = 1;
+	wb->enabled = 0;
+	cancel_delayed_work_sync(&wb->flush_work);
+	flush_workqueue(wb->wq);
+
+	if (wback_flush(wb, 0, ~0ULL, 1, 0))
+		SRBDEV_LOG_ERR(dev, "Lost %llu bytes not written back",
+			       (unsigned long long)wb->dirty);
+	destroy_workqueue(wb->wq);
+	wb->wq = NULL;
+
+	for (x = __wback_first(wb, 0); x; x = next) {
+		next = __wback_next(x);
+		__wback_unlink(wb, x, 1);
+	}
+	kfree(wb->sgl);
+	wb->sgl = NULL;
+	wb->stopping = 0;
+}
+
+void srb_wback_device_init(struct srb_device_s *dev)
+{
+	struct srb_wback_s *wb = &dev->wback;
+
+	wb->dev = dev;
+	spin_lock_init(&wb->lock);
+	wb->extents = RB_ROOT;
+	wb->dirty = 0;
+	INIT_LIST_HEAD(&wb->pending);
+	wb->enabled = 0;
+	wb->stopping = 0;
+	mutex_init(&wb->map_mutex);
+	wb->gen = 0;
+	wb->readers = 0;
+	mutex_init(&wb->flush_mutex);
+	wb->sgl = NULL;
+	wb->wq = NULL;
+	INIT_WORK(&wb->work, wback_work);
+	INIT_DELAYED_WORK(&wb->flush_work, wback_flush_work);
+	wb->max_dirty = SRB_WBACK_MAX_DIRTY_DFLT;
+	wb->expire_ms = SRB_WBACK_EXPIRE_DFLT;
+}
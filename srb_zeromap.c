@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2014 SCALITY SA - http://www.scality.com
+ *
+ * This file is part of ScalityRestBlock.
+ *
+ * ScalityRestBlock is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ScalityRestBlock is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ScalityRestBlock.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Known-zero extents
+ *
+ * Devices keep track of the ranges of their volume known to read as
+ * zeroes, and complete the reads falling within one of them with zeroed
+ * pages, without a round-trip to a server. Filesystem probes and image
+ * scans read many areas never written.
+ *
+ * The ranges come from:
+ *  - the extension of an attached volume, whose new end reads as zeroes,
+ *  - the discards and zeroing completed,
+ *  - the reads whose response carries the X-Scal-Hole header, which the
+ *    servers may add when the range is a hole of the volume.
+ *
+ * Writes remove their range as soon as they are submitted, so that a read
+ * submitted after them is never served with zeroes. The map only ever
+ * grows if no write was submitted or completed since the discard, zeroing
+ * or read telling so was itself submitted: otherwise, the range may hold
+ * the data of a write racing with it. Growing the map is best effort,
+ * shrinking it is not: when a range cannot be split, the whole extent is
+ * forgotten.
+ *
+ * The servers' hole hints are ignored while writes wait in the write-back
+ * tiers, as the servers do not hold the latest data then.
+ *
+ * Reads are only completed from the map with blk-mq, for the same reason
+ * as in srb_readahead.c.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/scatterlist.h>
+
+#include "srb.h"
+
+struct srb_zmap_extent_s {
+	struct rb_node		node;
+	uint64_t		start;
+	uint64_t		end;		/* Excluded */
+};
+
+/* First extent ending at or after offset. zmap lock held. */
+static struct srb_zmap_extent_s *__zmap_first(struct srb_zmap_s *zmap,
+					      uint64_t offset)
+{
+	struct rb_node *node = zmap->extents.rb_node;
+	struct srb_zmap_extent_s *first = NULL;
+	struct srb_zmap_extent_s *x;
+
+	while (node) {
+		x = rb_entry(node, struct srb_zmap_extent_s, node);
+		if (x->end >= offset) {
+			first = x;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return first;
+}
+
+static struct srb_zmap_extent_s *__zmap_next(struct srb_zmap_extent_s *x)
+{
+	struct rb_node *node = rb_next(&x->node);
+
+	return node ? rb_entry(node, struct srb_zmap_extent_s, node) : NULL;
+}
+
+static void __zmap_insert(struct srb_zmap_s *zmap, struct srb_zmap_extent_s *new)
+{
+	struct rb_node **link = &zmap->extents.rb_node;
+	struct rb_node *parent = NULL;
+	struct srb_zmap_extent_s *x;
+
+	while (*link) {
+		parent = *link;
+		x = rb_entry(parent, struct srb_zmap_extent_s, node);
+		if (new->start < x->start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &zmap->extents);
+	zmap->nr_extents++;
+	zmap->bytes += new->end - new->start;
+}
+
+static void __zmap_erase(struct srb_zmap_s *zmap, struct srb_zmap_extent_s *x)
+{
+	rb_erase(&x->node, &zmap->extents);
+	zmap->nr_extents--;
+	zmap->bytes -= x->end - x->start;
+	kfree(x);
+}
+
+/* Merges [start, end) into the extents. zmap lock held. */
+static void __zmap_add(struct srb_zmap_s *zmap, uint64_t start, uint64_t end)
+{
+	struct srb_zmap_extent_s *x = __zmap_first(zmap, start);
+	struct srb_zmap_extent_s *next;
+
+	if (start >= end)
+		return;
+
+	if (!x || x->start > end) {
+		/* Requests are submitted in atomic context */
+		if (zmap->nr_extents >= SRB_ZMAP_MAX_EXTENTS)
+			return;
+		x = kmalloc(sizeof(*x), GFP_NOWAIT | __GFP_NOWARN);
+		if (!x)
+			return;
+		x->start = start;
+		x->end = end;
+		__zmap_insert(zmap, x);
+		return;
+	}
+
+	/* Overlapping or adjacent: x absorbs the range and those following */
+	zmap->bytes -= x->end - x->start;
+	if (start < x->start)
+		x->start = start;
+	while ((next = __zmap_next(x)) && next->start <= end) {
+		if (next->end > end)
+			end = next->end;
+		__zmap_erase(zmap, next);
+	}
+	if (end > x->end)
+		x->end = end;
+	zmap->bytes += x->end - x->start;
+}
+
+/* Removes [start, end) from the extents. zmap lock held. */
+static void __zmap_remove(struct srb_zmap_s *zmap, uint64_t start, uint64_t end)
+{
+	struct srb_zmap_extent_s *x = __zmap_first(zmap, start);
+	struct srb_zmap_extent_s *tail;
+	struct srb_zmap_extent_s *next;
+
+	while (x && x->start < end) {
+		next = __zmap_next(x);
+		if (x->end <= start) {
+			/* Ends right where the range starts */
+		} else if (x->start < start && x->end > end) {
+			/* Not fatal: the end of x is forgotten */
+			tail = kmalloc(sizeof(*tail), GFP_NOWAIT | __GFP_NOWARN);
+			zmap->bytes -= x->end - start;
+			if (tail) {
+				tail->start = end;
+				tail->end = x->end;
+			}
+			x->end = start;
+			if (tail)
+				__zmap_insert(zmap, tail);
+			break;
+		} else if (x->start < start) {
+			zmap->bytes -= x->end - start;
+			x->end = start;
+		} else if (x->end > end) {
+			/* Still after its predecessor: they do not overlap */
+			zmap->bytes -= end - x->start;
+			x->start = end;
+		} else {
+			__zmap_erase(zmap, x);
+		}
+		x = next;
+	}
+}
+
+/*
+ * Adds [offset, offset + size) known to read as zeroes by a command
+ * submitted when the writes seen were seq, unless a write could have
+ * raced with it.
+ */
+static void zmap_zeroed(struct srb_device_s *dev, uint64_t offset, int size,
+			unsigned long seq)
+{
+	struct srb_zmap_s *zmap = &dev->zmap;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zmap->lock, flags);
+	if (seq == zmap->wseq && !zmap->inflight)
+		__zmap_add(zmap, offset, offset + size);
+	spin_unlock_irqrestore(&zmap->lock, flags);
+}
+
+/*
+ * Called on the submission of a write, a discard or a zeroing, be it a
+ * request or the write-back tiers' own I/O.
+ */
+void srb_zmap_write_start(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	struct srb_zmap_s *zmap = &dev->zmap;
+	unsigned long flags;
+
+	if (cmd->op == SRB_CMD_DISCARD || cmd->op == SRB_CMD_ZERO) {
+		cmd->zmap_wseq = srb_zmap_seq(dev);
+		return;
+	}
+	if (cmd->op != SRB_CMD_WRITE && cmd->op != SRB_CMD_WRITE_SAME)
+		return;
+
+	spin_lock_irqsave(&zmap->lock, flags);
+	__zmap_remove(zmap, cmd->offset, cmd->offset + cmd->size);
+	zmap->wseq++;
+	zmap->inflight++;
+	spin_unlock_irqrestore(&zmap->lock, flags);
+}
+
+/* Called on the completion of a command given to srb_zmap_write_start */
+void srb_zmap_write_end(struct srb_device_s *dev, struct srb_cmd_s *cmd,
+			int error)
+{
+	struct srb_zmap_s *zmap = &dev->zmap;
+	unsigned long flags;
+
+	if (cmd->op == SRB_CMD_DISCARD || cmd->op == SRB_CMD_ZERO) {
+		/* Failed, the range holds either its old data or zeroes */
+		if (!error)
+			zmap_zeroed(dev, cmd->offset, cmd->size, cmd->zmap_wseq);
+		return;
+	}
+	if (cmd->op != SRB_CMD_WRITE && cmd->op != SRB_CMD_WRITE_SAME)
+		return;
+
+	spin_lock_irqsave(&zmap->lock, flags);
+	zmap->wseq++;
+	zmap->inflight--;
+	spin_unlock_irqrestore(&zmap->lock, flags);
+}
+
+/*
+ * Writes seen by a command submitted now, to be given back to
+ * srb_zmap_hint. A stale value only makes the hint ignored.
+ */
+unsigned long srb_zmap_seq(struct srb_device_s *dev)
+{
+	return dev->zmap.wseq;
+}
+
+/*
+ * A server told that [offset, offset + size) is a hole of the volume, in
+ * response to a read submitted when the writes seen were seq.
+ */
+void srb_zmap_hint(struct srb_device_s *dev, uint64_t offset, int size,
+		   unsigned long seq)
+{
+	/* The servers may not hold the latest data of the range */
+	if (dev->wblog || dev->wback.enabled || dev->wback.dirty)
+		return;
+
+	zmap_zeroed(dev, offset, size, seq);
+}
+
+/*
+ * Completes a read with zeroes if it falls within a known-zero extent.
+ * Returns 0 if it is to be sent to a server.
+ */
+int srb_zmap_read(struct srb_device_s *dev, struct srb_cmd_s *cmd)
+{
+	struct srb_zmap_s *zmap = &dev->zmap;
+	struct srb_zmap_extent_s *x;
+	unsigned long flags;
+	int hit;
+	int i;
+
+	if (!zmap->nr_extents || !cmd->size)
+		return 0;
+
+	spin_lock_irqsave(&zmap->lock, flags);
+	x = __zmap_first(zmap, cmd->offset);
+	hit = x && x->start <= cmd->offset &&
+	      x->end >= cmd->offset + cmd->size;
+	if (hit)
+		zmap->hits++;
+	spin_unlock_irqrestore(&zmap->lock, flags);
+	if (!hit)
+		return 0;
+
+	for (i = 0; i < cmd->sgl_size; i++)
+		memset(sg_virt(&cmd->sgl[i]), 0, cmd->sgl[i].length);
+
+	cmd->local = 1;
+	srb_end_request(cmd->req, 0);
+
+	return 1;
+}
+
+/*
+ * The volume of the device was resized: its new end reads as zeroes, and
+ * no request could reach it before.
+ */
+void srb_zmap_resize(struct srb_device_s *dev, uint64_t old_size,
+		     uint64_t new_size)
+{
+	struct srb_zmap_s *zmap = &dev->zmap;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zmap->lock, flags);
+	if (new_size > old_size)
+		__zmap_add(zmap, old_size, new_size);
+	else
+		__zmap_remove(zmap, new_size, old_size);
+	spin_unlock_irqrestore(&zmap->lock, flags);
+}
+
+void srb_zmap_device_init(struct srb_device_s *dev)
+{
+	struct srb_zmap_s *zmap = &dev->zmap;
+
+	spin_lock_init(&zmap->lock);
+	zmap->extents = RB_ROOT;
+	zmap->nr_extents = 0;
+	zmap->bytes = 0;
+	zmap->wseq = 0;
+	zmap->inflight = 0;
+	zmap->hits = 0;
+}
+
+/* Drops the extents of a device whose requests all completed */
+void srb_zmap_device_cleanup(struct srb_device_s *dev)
+{
+	struct srb_zmap_s *zmap = &dev->zmap;
+	struct rb_node *node;
+
+	while ((node = rb_first(&zmap->extents)))
+		__zmap_erase(zmap, rb_entry(node, struct srb_zmap_extent_s,
+					    node));
+}